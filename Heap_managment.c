@@ -1,9 +1,13 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
 
+#include "heap_manager.h"
+
 // ANSI color codes for better visibility
 #define COLOR_RESET   "\x1b[0m"
 #define COLOR_RED     "\x1b[31m"
@@ -14,62 +18,89 @@
 #define COLOR_CYAN    "\x1b[36m"
 #define COLOR_BOLD    "\x1b[1m"
 
-// Structure for a heap block
-typedef struct Node {
-    int size;
-    bool isFree;
-    char name[20];
-    struct Node* next;
-    int allocated_size;
-    
-    // GC-related fields
-    bool marked;
-    bool isRoot;
-    char** references;
-    int numReferences;
-    int refCapacity;
-} Node;
-
-// Audit log entry
-typedef struct AuditLog {
-    char operation[100];
-    char timestamp[26];
-    struct AuditLog* next;
-} AuditLog;
-
-// Global audit log
-AuditLog* auditHead = NULL;
-
-// Global GC statistics
-typedef struct {
-    int totalCollections;
-    int totalFreed;
-    int lastFreedCount;
-    int totalAllocations;
-    int totalManualFrees;
-} GCStats;
-
-GCStats gcStats = {0, 0, 0, 0, 0};
-
-// Function to get current timestamp
-void getCurrentTimestamp(char* buffer, size_t size) {
-    time_t now = time(NULL);
-    struct tm* t = localtime(&now);
+#define AUDIT_LOG_SHOWN 20
+
+// Wall-clock time of an audit record, from its monotonic timestamp
+static void formatAuditTime(unsigned long long timestamp, char* buffer, size_t size) {
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    unsigned long long monoNow = (unsigned long long)mono.tv_sec * 1000000000ULL + (unsigned long long)mono.tv_nsec;
+    time_t when = real.tv_sec - (time_t)((monoNow - timestamp) / 1000000000ULL);
+    struct tm* t = localtime(&when);
     strftime(buffer, size, "%Y-%m-%d %H:%M:%S", t);
 }
 
-// Add entry to audit log
-void addAuditLog(const char* operation) {
-    AuditLog* newLog = (AuditLog*)malloc(sizeof(AuditLog));
-    strncpy(newLog->operation, operation, 99);
-    newLog->operation[99] = '\0';
-    getCurrentTimestamp(newLog->timestamp, sizeof(newLog->timestamp));
-    newLog->next = auditHead;
-    auditHead = newLog;
+static void formatAuditRecord(const HeapAuditRecord* record, char* buffer, size_t size) {
+    switch (record->op) {
+        case HEAP_AUDIT_INIT:
+            snprintf(buffer, size, "Heap initialized with %zu bytes in %d Fibonacci blocks", record->size, record->count);
+            break;
+        case HEAP_AUDIT_ALLOC:
+            snprintf(buffer, size, "Allocated '%s' (size: %zu, root: %s)", record->name, record->size,
+                     record->isRoot ? "YES" : "NO");
+            break;
+        case HEAP_AUDIT_FREE:
+            snprintf(buffer, size, "Manually freed '%s' (size: %zu)", record->name, record->size);
+            break;
+        case HEAP_AUDIT_MERGE:
+            snprintf(buffer, size, "Merged %d adjacent free blocks", record->count);
+            break;
+        case HEAP_AUDIT_REF_ADD:
+            snprintf(buffer, size, "Reference added: '%s' → '%s'", record->name, record->target);
+            break;
+        case HEAP_AUDIT_REF_REMOVE:
+            snprintf(buffer, size, "Reference removed: '%s' → '%s'", record->name, record->target);
+            break;
+        case HEAP_AUDIT_ROOT:
+            snprintf(buffer, size, "Block '%s' root status: %s", record->name, record->isRoot ? "SET" : "UNSET");
+            break;
+        case HEAP_AUDIT_GC:
+            snprintf(buffer, size, "GC #%zu completed - freed %d blocks", record->size, record->count);
+            break;
+        case HEAP_AUDIT_MINOR_GC:
+            snprintf(buffer, size, "Minor GC #%zu completed - freed %d young blocks", record->size, record->count);
+            break;
+        case HEAP_AUDIT_RC_FREE:
+            snprintf(buffer, size, "Freed unreferenced '%s' (size: %zu)", record->name, record->size);
+            break;
+        case HEAP_AUDIT_ALLOC_BATCH:
+            snprintf(buffer, size, "Batch allocated %d blocks (%zu bytes requested)", record->count, record->size);
+            break;
+        case HEAP_AUDIT_FREE_BATCH:
+            snprintf(buffer, size, "Batch freed %d blocks (size: %zu)", record->count, record->size);
+            break;
+        case HEAP_AUDIT_RESIZE:
+            snprintf(buffer, size, "Resized '%s' to %zu bytes (block size: %d)", record->name, record->size, record->count);
+            break;
+        case HEAP_AUDIT_COMPACT:
+            snprintf(buffer, size, "Compacted heap - moved %d blocks (%zu bytes)", record->count, record->size);
+            break;
+        case HEAP_AUDIT_GROW:
+            snprintf(buffer, size, "Grew heap by %zu bytes (%d regions)", record->size, record->count);
+            break;
+        case HEAP_AUDIT_SHRINK:
+            snprintf(buffer, size, "Gave back %zu bytes (%d regions unmapped)", record->size, record->count);
+            break;
+        case HEAP_AUDIT_SAVE:
+            snprintf(buffer, size, "Saved heap image of %zu bytes (%d descriptors)", record->size, record->count);
+            break;
+        case HEAP_AUDIT_LOAD:
+            snprintf(buffer, size, "Loaded heap image with %zu bytes (%d descriptors)", record->size, record->count);
+            break;
+        default:
+            snprintf(buffer, size, "Unknown operation %d", record->op);
+    }
 }
 
-// Print audit log
-void printAuditLog() {
+// Print audit log. Records are only formatted here.
+void printAuditLog(Heap* heap) {
+    HeapAuditRecord records[AUDIT_LOG_SHOWN];
+    int count = heapAuditRead(heap, records, AUDIT_LOG_SHOWN);
+    char timestamp[26];
+    char operation[100];
+
     printf("\n");
     printf(COLOR_CYAN COLOR_BOLD);
     printf("╔════════════════════════════════════════════════════════════════════════╗\n");
@@ -77,25 +108,22 @@ void printAuditLog() {
     printf("╚════════════════════════════════════════════════════════════════════════╝\n");
     printf(COLOR_RESET);
     
-    if (auditHead == NULL) {
+    if (count == 0) {
         printf(COLOR_YELLOW "  No operations recorded yet.\n" COLOR_RESET);
         return;
     }
     
-    AuditLog* current = auditHead;
-    int count = 1;
-    
     // Print in reverse order (most recent first)
     printf(COLOR_CYAN "  [Timestamp]          | [Operation]\n");
     printf("  ─────────────────────┼──────────────────────────────────────────────\n" COLOR_RESET);
     
-    while (current != NULL && count <= 20) { // Show last 20 operations
-        printf("  %s | %s\n", current->timestamp, current->operation);
-        current = current->next;
-        count++;
+    for (int i = 0; i < count; i++) {
+        formatAuditTime(records[i].timestamp, timestamp, sizeof(timestamp));
+        formatAuditRecord(&records[i], operation, sizeof(operation));
+        printf("  %s | %s\n", timestamp, operation);
     }
     
-    if (current != NULL) {
+    if (heapAuditTotal(heap) > AUDIT_LOG_SHOWN) {
         printf(COLOR_YELLOW "  ... and more (showing last 20 entries)\n" COLOR_RESET);
     }
     printf("\n");
@@ -117,558 +145,287 @@ void printBox(const char* title, const char* content) {
     }
 }
 
-// Function to generate Fibonacci numbers
-void generateFibonacciList(int totalMemory, int* fibArr, int* count) {
-    int a = 1, b = 1, c = 2;  
-    *count = 0;
-
-    while (c <= totalMemory) {
-        fibArr[(*count)++] = c;  
-        a = b;
-        b = c;
-        c = a + b;
-    }
+static void printIndent(int depth) {
+    for (int i = 0; i < depth; i++) printf("  ");
 }
 
-// Initialize heap
-Node* initializeHeap(int totalMemory) {
-    int fibArr[100]; 
-    int count = 0;
-
-    generateFibonacciList(totalMemory, fibArr, &count); 
+// Heap event handler: renders what the allocator did. The context is the heap.
+void printHeapEvent(const HeapEvent* event, void* context) {
+    Heap* heap = (Heap*)context;
 
-    Node* head = NULL;
-    Node* prev = NULL;
-
-    for (int i = 0; i < count; i++) {
-        Node* newNode = (Node*)malloc(sizeof(Node));
-        newNode->size = fibArr[i];
-        newNode->isFree = true;
-        newNode->next = NULL;
-        newNode->allocated_size = 0;
-        newNode->marked = false;
-        newNode->isRoot = false;
-        newNode->references = NULL;
-        newNode->numReferences = 0;
-        newNode->refCapacity = 0;
-
-        if (head == NULL) {
-            head = newNode;
-        } else {
-            prev->next = newNode;
-        }
-        prev = newNode;
-    }
-
-    char logMsg[100];
-    sprintf(logMsg, "Heap initialized with %d bytes in %d Fibonacci blocks", totalMemory, count);
-    addAuditLog(logMsg);
+    switch (event->type) {
+        case HEAP_EVENT_ALLOC_REQUEST:
+            printf("\n" COLOR_BOLD "═══ ALLOCATION REQUEST ═══\n" COLOR_RESET);
+            printf("  Name: " COLOR_CYAN "%s" COLOR_RESET " | Size: " COLOR_YELLOW "%zu" COLOR_RESET " | Root: %s\n", 
+                   event->name, event->requestedSize,
+                   event->isRoot ? COLOR_GREEN "YES" COLOR_RESET : COLOR_RED "NO" COLOR_RESET);
+            break;
 
-    return head; 
-}
+        case HEAP_EVENT_ALLOC:
+            printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Allocated '%s' → Block size: " COLOR_YELLOW "%zu" COLOR_RESET 
+                   " | Used: " COLOR_YELLOW "%zu" COLOR_RESET " | Waste: " COLOR_RED "%zu\n" COLOR_RESET,
+                   event->name, event->size, event->requestedSize, event->size - event->requestedSize);
+            break;
 
-// Print heap state with better formatting
-void traverseHeap(Node* head) {
-    Node* current = head;
-    int allocatedCount = 0;
-    int freeCount = 0;
-    int totalAllocated = 0;
-    int totalFree = 0;
-    
-    printf("\n");
-    printf(COLOR_BOLD COLOR_MAGENTA);
-    printf("╔════════════════════════════════════════════════════════════════════════╗\n");
-    printf("║                          HEAP MEMORY MAP                               ║\n");
-    printf("╚════════════════════════════════════════════════════════════════════════╝\n");
-    printf(COLOR_RESET);
-    
-    printf(COLOR_CYAN "  ┌──────────────────────────────────────────────────────────────┐\n" COLOR_RESET);
-    
-    while (current != NULL) {
-        if (!current->isFree) {
-            allocatedCount++;
-            totalAllocated += current->size;
-            
-            printf(COLOR_GREEN "  │ [ALLOCATED] " COLOR_RESET);
-            printf("%-15s | Size: " COLOR_YELLOW "%-5d" COLOR_RESET, current->name, current->size);
-            printf(" | Used: " COLOR_YELLOW "%-5d" COLOR_RESET, current->allocated_size);
-            printf(" │\n");
-            
-            printf("  │             Root: " COLOR_CYAN "%-3s" COLOR_RESET, current->isRoot ? "YES" : "NO");
-            printf(" | References: " COLOR_CYAN "%-2d" COLOR_RESET, current->numReferences);
-            
-            if (current->numReferences > 0) {
-                printf(" [");
-                for (int i = 0; i < current->numReferences; i++) {
-                    printf("%s%s", current->references[i], 
-                           i < current->numReferences - 1 ? ", " : "");
-                }
-                printf("]");
+        case HEAP_EVENT_ALLOC_FAILED:
+            if (event->status == HEAP_ERR_NAME_TOO_LONG) {
+                printf(COLOR_RED "  ✗ ERROR: Name too long (max 19 characters).\n" COLOR_RESET);
+            } else if (event->status == HEAP_ERR_DUPLICATE_NAME) {
+                printf(COLOR_RED "  ✗ ERROR: Duplicate name '%s'.\n" COLOR_RESET, event->name);
+            } else if (event->status == HEAP_ERR_INVALID) {
+                printf(COLOR_RED "  ✗ ERROR: A block needs a name.\n" COLOR_RESET);
+            } else {
+                printf(COLOR_RED "  ✗ FAILED: Memory allocation failed after GC.\n" COLOR_RESET);
             }
-            printf("     │\n");
-            printf(COLOR_CYAN "  ├──────────────────────────────────────────────────────────────┤\n" COLOR_RESET);
-        } else {
-            freeCount++;
-            totalFree += current->size;
-            
-            printf(COLOR_RED "  │ [FREE]      " COLOR_RESET);
-            printf("%-15s | Size: " COLOR_YELLOW "%-5d" COLOR_RESET, "Available", current->size);
-            printf("                      │\n");
-            printf(COLOR_CYAN "  ├──────────────────────────────────────────────────────────────┤\n" COLOR_RESET);
-        }
-        current = current->next;
-    }
-    
-    printf(COLOR_CYAN "  └──────────────────────────────────────────────────────────────┘\n" COLOR_RESET);
-    
-    printf("\n" COLOR_BOLD "  Summary:\n" COLOR_RESET);
-    printf("  • Allocated Blocks: " COLOR_GREEN "%d" COLOR_RESET " (Total: " COLOR_YELLOW "%d bytes" COLOR_RESET ")\n", 
-           allocatedCount, totalAllocated);
-    printf("  • Free Blocks: " COLOR_RED "%d" COLOR_RESET " (Total: " COLOR_YELLOW "%d bytes" COLOR_RESET ")\n", 
-           freeCount, totalFree);
-    printf("  • Total Memory: " COLOR_CYAN "%d bytes" COLOR_RESET "\n\n", totalAllocated + totalFree);
-}
-
-// Fibonacci helper functions
-int getPreviousFibonacci(int size) {
-    if (size <= 1) return 0;
-    int a = 1, b = 1, c = a + b;
-    while (c < size) {
-        a = b;
-        b = c;
-        c = a + b;
-    }
-    return b;
-}
+            break;
 
-bool isFibonacciPair(int a, int b) {
-    int x = 1, y = 1, z = x + y;
-    while (z < a || z < b) {
-        x = y;
-        y = z;
-        z = x + y;
-    }
-    return (z == a && y == b) || (z == b && y == a);
-}
+        case HEAP_EVENT_SPLIT:
+            printf(COLOR_YELLOW "  ⚡ SPLIT: " COLOR_RESET "Block of size %zu being split...\n", event->size);
+            break;
 
-// Merge blocks with detailed logging
-void mergeBlock(Node* head) {
-    if (head == NULL) return;
+        case HEAP_EVENT_SPLIT_FREE:
+            printf(COLOR_YELLOW "    → " COLOR_RESET "Created free block of size " COLOR_GREEN "%zu" COLOR_RESET "\n", event->size);
+            break;
 
-    Node* current = head;
-    int mergeCount = 0;
+        case HEAP_EVENT_MERGE:
+            printf(COLOR_YELLOW "  ⚡ MERGE: " COLOR_RESET "Combined blocks [%zu + %zu = " COLOR_GREEN "%zu" COLOR_RESET "]\n", 
+                   event->size, event->otherSize, event->size + event->otherSize);
+            break;
 
-    while (current != NULL && current->next != NULL) {
-        if (current->isFree && current->next->isFree && 
-            isFibonacciPair(current->size, current->next->size)) {
-            
-            int oldSize1 = current->size;
-            int oldSize2 = current->next->size;
-            
-            current->size += current->next->size;
-            Node* temp = current->next;
-            current->next = current->next->next;
-            free(temp);
+        case HEAP_EVENT_COALESCED:
+            break;
 
-            memset(current->name, 0, sizeof(current->name));
-            
-            printf(COLOR_YELLOW "  ⚡ MERGE: " COLOR_RESET "Combined blocks [%d + %d = " COLOR_GREEN "%d" COLOR_RESET "]\n", 
-                   oldSize1, oldSize2, current->size);
-            
-            mergeCount++;
-            current = head;
-            continue;
-        }
-        current = current->next;
-    }
-    
-    if (mergeCount > 0) {
-        char logMsg[100];
-        sprintf(logMsg, "Merged %d adjacent free blocks", mergeCount);
-        addAuditLog(logMsg);
-    }
-}
+        case HEAP_EVENT_FREE_REQUEST:
+            printf("\n" COLOR_BOLD "═══ FREE REQUEST ═══\n" COLOR_RESET);
+            printf("  Name: " COLOR_CYAN "%s\n" COLOR_RESET, event->name);
+            break;
 
-// Split block with logging
-void splitBlock(Node* node, int requiredSize) {
-    if (node == NULL || node->size <= requiredSize) return;
+        case HEAP_EVENT_FREE:
+            printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Freed '%s' (size: %zu)\n", 
+                   event->name, event->size);
+            printf(COLOR_YELLOW "  Checking for merge opportunities...\n" COLOR_RESET);
+            break;
 
-    printf(COLOR_YELLOW "  ⚡ SPLIT: " COLOR_RESET "Block of size %d being split...\n", node->size);
+        case HEAP_EVENT_FREE_FAILED:
+            if (event->status == HEAP_ERR_INVALID) {
+                printf(COLOR_RED "  ✗ ERROR: Cannot free unnamed block.\n" COLOR_RESET);
+            } else {
+                printf(COLOR_RED "  ✗ ERROR: Block '%s' not found.\n" COLOR_RESET, event->name);
+            }
+            break;
 
-    while (node->size > requiredSize) {
-        int newSize = getPreviousFibonacci(node->size);
+        case HEAP_EVENT_REF_ADD:
+            printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Reference added: " COLOR_CYAN "'%s' → '%s'\n" COLOR_RESET, 
+                   event->name, event->target);
+            break;
 
-        Node* newNode = (Node*)malloc(sizeof(Node));
-        newNode->size = newSize;
-        newNode->isFree = true;
-        newNode->next = node->next;
-        newNode->marked = false;
-        newNode->isRoot = false;
-        newNode->references = NULL;
-        newNode->numReferences = 0;
-        newNode->refCapacity = 0;
+        case HEAP_EVENT_REF_REMOVE:
+            printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Reference removed: " COLOR_CYAN "'%s' → '%s'\n" COLOR_RESET, 
+                   event->name, event->target);
+            break;
 
-        node->next = newNode;
-        node->size -= newSize;
-        
-        printf(COLOR_YELLOW "    → " COLOR_RESET "Created free block of size " COLOR_GREEN "%d" COLOR_RESET "\n", newSize);
-    }
-}
+        case HEAP_EVENT_REF_FAILED:
+            if (event->status == HEAP_ERR_NOT_FOUND) {
+                printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Block '%s' not found.\n", event->name);
+            } else if (event->status == HEAP_ERR_REF_EXISTS) {
+                printf(COLOR_YELLOW "  ⚠ WARNING: " COLOR_RESET "Reference '%s → %s' already exists.\n", 
+                       event->name, event->target);
+            } else if (event->status == HEAP_ERR_REF_NOT_FOUND) {
+                printf(COLOR_YELLOW "  ⚠ WARNING: " COLOR_RESET "Reference '%s → %s' not found.\n",
+                       event->name, event->target);
+            } else {
+                printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Memory allocation failed.\n");
+            }
+            break;
 
-int getClosestFibonacci(int size) {
-    if (size <= 1) return 1;
-    int a = 1, b = 1, c = a + b;
-    while (c < size) {
-        a = b;
-        b = c;
-        c = a + b;
-    }
-    return c;
-}
+        case HEAP_EVENT_ROOT:
+            printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Block " COLOR_CYAN "'%s'" COLOR_RESET " is now %s root.\n", 
+                   event->name, event->isRoot ? COLOR_GREEN "a" COLOR_RESET : COLOR_RED "NOT a" COLOR_RESET);
+            break;
 
-Node* findBestFit_by_buddy_system(Node* head, int size) {
-    int closestFibSize = getClosestFibonacci(size);
-    Node* bestFit = NULL;
-    Node* current = head;
+        case HEAP_EVENT_ROOT_FAILED:
+            printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Block '%s' not found.\n", event->name);
+            break;
 
-    while (current != NULL) {
-        if (current->isFree && current->size >= closestFibSize) {
-            if (bestFit == NULL || current->size < bestFit->size) {
-                bestFit = current;
+        case HEAP_EVENT_GC_START:
+            if (event->triggered) {
+                printf(COLOR_YELLOW "  ⚠ No suitable block found. Running GC...\n" COLOR_RESET);
             }
-        }
-        current = current->next;
-    }
-
-    return bestFit;
-}
+            printBox("GARBAGE COLLECTION STARTED", NULL);
+            printf(COLOR_BOLD "\n  MARK PHASE:\n" COLOR_RESET);
+            printf(COLOR_CYAN "  Finding all reachable blocks from roots...\n\n" COLOR_RESET);
+            break;
 
-Node* findNodeByName(Node* head, char* name) {
-    Node* current = head;
-    while (current != NULL) {
-        if (!current->isFree && strcmp(current->name, name) == 0) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
-}
+        case HEAP_EVENT_GC_ROOT:
+            printf(COLOR_MAGENTA "  ROOT: " COLOR_RESET "'%s'\n", event->name);
+            break;
 
-// Add reference with logging
-void addReference(Node* head, char* fromName, char* toName) {
-    Node* fromNode = findNodeByName(head, fromName);
-    Node* toNode = findNodeByName(head, toName);
-    
-    if (fromNode == NULL) {
-        printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Block '%s' not found.\n", fromName);
-        return;
-    }
-    
-    if (toNode == NULL) {
-        printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Block '%s' not found.\n", toName);
-        return;
-    }
-    
-    for (int i = 0; i < fromNode->numReferences; i++) {
-        if (strcmp(fromNode->references[i], toName) == 0) {
-            printf(COLOR_YELLOW "  ⚠ WARNING: " COLOR_RESET "Reference '%s → %s' already exists.\n", 
-                   fromName, toName);
-            return;
-        }
-    }
-    
-    if (fromNode->numReferences >= fromNode->refCapacity) {
-        int newCapacity = fromNode->refCapacity == 0 ? 4 : fromNode->refCapacity * 2;
-        char** newRefs = (char**)realloc(fromNode->references, newCapacity * sizeof(char*));
-        if (newRefs == NULL) {
-            printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Memory allocation failed.\n");
-            return;
-        }
-        fromNode->references = newRefs;
-        fromNode->refCapacity = newCapacity;
-    }
-    
-    fromNode->references[fromNode->numReferences] = (char*)malloc(20 * sizeof(char));
-    strncpy(fromNode->references[fromNode->numReferences], toName, 19);
-    fromNode->references[fromNode->numReferences][19] = '\0';
-    fromNode->numReferences++;
-    
-    printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Reference added: " COLOR_CYAN "'%s' → '%s'\n" COLOR_RESET, 
-           fromName, toName);
-    
-    char logMsg[100];
-    sprintf(logMsg, "Reference added: '%s' → '%s'", fromName, toName);
-    addAuditLog(logMsg);
-}
+        case HEAP_EVENT_GC_NO_ROOTS:
+            printf(COLOR_RED "  ⚠ WARNING: No root blocks found! All non-root blocks will be freed.\n" COLOR_RESET);
+            break;
 
-// Remove reference with logging
-void removeReference(Node* head, char* fromName, char* toName) {
-    Node* fromNode = findNodeByName(head, fromName);
-    
-    if (fromNode == NULL) {
-        printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Block '%s' not found.\n", fromName);
-        return;
-    }
-    
-    for (int i = 0; i < fromNode->numReferences; i++) {
-        if (strcmp(fromNode->references[i], toName) == 0) {
-            free(fromNode->references[i]);
-            
-            for (int j = i; j < fromNode->numReferences - 1; j++) {
-                fromNode->references[j] = fromNode->references[j + 1];
-            }
-            fromNode->numReferences--;
-            
-            printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Reference removed: " COLOR_CYAN "'%s' → '%s'\n" COLOR_RESET, 
-                   fromName, toName);
-            
-            char logMsg[100];
-            sprintf(logMsg, "Reference removed: '%s' → '%s'", fromName, toName);
-            addAuditLog(logMsg);
-            return;
-        }
-    }
-    
-    printf(COLOR_YELLOW "  ⚠ WARNING: " COLOR_RESET "Reference '%s → %s' not found.\n", fromName, toName);
-}
+        case HEAP_EVENT_MARK:
+            printIndent(event->count);
+            printf(COLOR_GREEN "  ✓ MARKED: " COLOR_RESET "'%s' (size: %zu)\n", event->name, event->size);
+            break;
 
-// Set root status with logging
-void setRoot(Node* head, char* name, bool isRoot) {
-    Node* node = findNodeByName(head, name);
-    if (node == NULL) {
-        printf(COLOR_RED "  ✗ ERROR: " COLOR_RESET "Block '%s' not found.\n", name);
-        return;
-    }
-    
-    node->isRoot = isRoot;
-    printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Block " COLOR_CYAN "'%s'" COLOR_RESET " is now %s root.\n", 
-           name, isRoot ? COLOR_GREEN "a" COLOR_RESET : COLOR_RED "NOT a" COLOR_RESET);
-    
-    char logMsg[100];
-    sprintf(logMsg, "Block '%s' root status: %s", name, isRoot ? "SET" : "UNSET");
-    addAuditLog(logMsg);
-}
+        case HEAP_EVENT_MARK_FOLLOW:
+            printIndent(event->count + 1);
+            printf(COLOR_CYAN "    → Following reference to '%s'\n" COLOR_RESET, event->target);
+            break;
 
-// Mark phase with logging
-void markBlock(Node* head, Node* node, int depth) {
-    if (node == NULL || node->isFree || node->marked) {
-        return;
-    }
-    
-    node->marked = true;
-    
-    for (int i = 0; i < depth; i++) printf("  ");
-    printf(COLOR_GREEN "  ✓ MARKED: " COLOR_RESET "'%s' (size: %d)\n", node->name, node->size);
-    
-    for (int i = 0; i < node->numReferences; i++) {
-        Node* referenced = findNodeByName(head, node->references[i]);
-        if (referenced != NULL) {
-            for (int j = 0; j < depth + 1; j++) printf("  ");
-            printf(COLOR_CYAN "    → Following reference to '%s'\n" COLOR_RESET, node->references[i]);
-            markBlock(head, referenced, depth + 1);
-        }
-    }
-}
+        case HEAP_EVENT_SWEEP_START:
+            printf("\n" COLOR_YELLOW "  SWEEP PHASE:\n" COLOR_RESET);
+            break;
 
-// Sweep phase with logging
-int sweepBlocks(Node* head) {
-    Node* current = head;
-    int freedCount = 0;
-    int totalFreedSize = 0;
-    
-    printf("\n" COLOR_YELLOW "  SWEEP PHASE:\n" COLOR_RESET);
-    
-    while (current != NULL) {
-        if (!current->isFree && !current->marked) {
-            printf(COLOR_RED "  ✗ FREEING: " COLOR_RESET "'%s' (size: %d, allocated: %d) " 
+        case HEAP_EVENT_SWEEP_FREE:
+            printf(COLOR_RED "  ✗ FREEING: " COLOR_RESET "'%s' (size: %zu, allocated: %zu) " 
                    COLOR_RED "[UNREACHABLE]\n" COLOR_RESET,
-                   current->name, current->size, current->allocated_size);
-            
-            totalFreedSize += current->size;
-            
-            for (int i = 0; i < current->numReferences; i++) {
-                free(current->references[i]);
+                   event->name, event->size, event->requestedSize);
+            break;
+
+        case HEAP_EVENT_SWEEP_END:
+            if (event->count == 0) {
+                printf(COLOR_GREEN "  ✓ No unreachable blocks found.\n" COLOR_RESET);
+            } else {
+                printf(COLOR_YELLOW "\n  Total freed: %d blocks (%zu bytes)\n" COLOR_RESET, 
+                       event->count, event->size);
+                printf("\n" COLOR_YELLOW "  POST-SWEEP CLEANUP:\n" COLOR_RESET);
             }
-            free(current->references);
-            current->references = NULL;
-            current->numReferences = 0;
-            current->refCapacity = 0;
-            
-            current->isFree = true;
-            memset(current->name, 0, sizeof(current->name));
-            current->allocated_size = 0;
-            current->isRoot = false;
-            
-            freedCount++;
-        }
-        
-        current->marked = false;
-        current = current->next;
-    }
-    
-    if (freedCount == 0) {
-        printf(COLOR_GREEN "  ✓ No unreachable blocks found.\n" COLOR_RESET);
-    } else {
-        printf(COLOR_YELLOW "\n  Total freed: %d blocks (%d bytes)\n" COLOR_RESET, 
-               freedCount, totalFreedSize);
-    }
-    
-    return freedCount;
-}
+            break;
 
-// Garbage collection with detailed logging
-void garbageCollect(Node* head) {
-    printBox("GARBAGE COLLECTION STARTED", NULL);
-    
-    printf(COLOR_BOLD "\n  MARK PHASE:\n" COLOR_RESET);
-    printf(COLOR_CYAN "  Finding all reachable blocks from roots...\n\n" COLOR_RESET);
-    
-    Node* current = head;
-    int rootCount = 0;
-    
-    while (current != NULL) {
-        if (!current->isFree && current->isRoot) {
-            printf(COLOR_MAGENTA "  ROOT: " COLOR_RESET "'%s'\n", current->name);
-            markBlock(head, current, 1);
-            rootCount++;
+        case HEAP_EVENT_GC_END: {
+            const GCStats* stats = heapGetStats(heap);
+            printf("\n");
+            printBox("GARBAGE COLLECTION COMPLETE", NULL);
+            printf(COLOR_GREEN "  ✓ Freed: " COLOR_YELLOW "%d" COLOR_GREEN " block(s)\n" COLOR_RESET, event->count);
+            printf(COLOR_CYAN "  ℹ Total GC runs: %d | Total blocks freed: %d\n" COLOR_RESET, 
+                   stats->totalCollections, stats->totalFreed);
+            printf("\n");
+            break;
         }
-        current = current->next;
-    }
-    
-    if (rootCount == 0) {
-        printf(COLOR_RED "  ⚠ WARNING: No root blocks found! All non-root blocks will be freed.\n" COLOR_RESET);
-    }
-    
-    int freedCount = sweepBlocks(head);
-    
-    if (freedCount > 0) {
-        printf("\n" COLOR_YELLOW "  POST-SWEEP CLEANUP:\n" COLOR_RESET);
-        mergeBlock(head);
-    }
-    
-    gcStats.totalCollections++;
-    gcStats.totalFreed += freedCount;
-    gcStats.lastFreedCount = freedCount;
-    
-    printf("\n");
-    printBox("GARBAGE COLLECTION COMPLETE", NULL);
-    printf(COLOR_GREEN "  ✓ Freed: " COLOR_YELLOW "%d" COLOR_GREEN " block(s)\n" COLOR_RESET, freedCount);
-    printf(COLOR_CYAN "  ℹ Total GC runs: %d | Total blocks freed: %d\n" COLOR_RESET, 
-           gcStats.totalCollections, gcStats.totalFreed);
-    printf("\n");
-    
-    char logMsg[100];
-    sprintf(logMsg, "GC #%d completed - freed %d blocks", gcStats.totalCollections, freedCount);
-    addAuditLog(logMsg);
-}
 
-// Allocate memory with detailed logging
-void* allocate_memory(Node* head, char* name, int size, bool isRoot) {
-    printf("\n" COLOR_BOLD "═══ ALLOCATION REQUEST ═══\n" COLOR_RESET);
-    printf("  Name: " COLOR_CYAN "%s" COLOR_RESET " | Size: " COLOR_YELLOW "%d" COLOR_RESET " | Root: %s\n", 
-           name, size, isRoot ? COLOR_GREEN "YES" COLOR_RESET : COLOR_RED "NO" COLOR_RESET);
-    
-    if (strlen(name) > 19) {
-        printf(COLOR_RED "  ✗ ERROR: Name too long (max 19 characters).\n" COLOR_RESET);
-        return NULL;
-    }
+        case HEAP_EVENT_MINOR_GC_START:
+            printf(COLOR_CYAN "  ℹ Nursery full. Running minor GC...\n" COLOR_RESET);
+            break;
 
-    Node* temp = head;
-    while (temp != NULL) {
-        if (!temp->isFree && strcmp(temp->name, name) == 0) {
-            printf(COLOR_RED "  ✗ ERROR: Duplicate name '%s'.\n" COLOR_RESET, name);
-            return NULL;
-        }
-        temp = temp->next;
-    }
+        case HEAP_EVENT_PROMOTE:
+            printf(COLOR_MAGENTA "  ↑ PROMOTED: " COLOR_RESET "'%s' (size: %zu)\n", event->name, event->size);
+            break;
 
-    Node* bestFit = findBestFit_by_buddy_system(head, size);
+        case HEAP_EVENT_MINOR_GC_END:
+            printf(COLOR_GREEN "  ✓ Minor GC freed " COLOR_YELLOW "%d" COLOR_GREEN " young block(s)\n" COLOR_RESET, event->count);
+            break;
 
-    if (bestFit == NULL) {
-        printf(COLOR_YELLOW "  ⚠ No suitable block found. Running GC...\n" COLOR_RESET);
-        garbageCollect(head);
-        bestFit = findBestFit_by_buddy_system(head, size);
+        case HEAP_EVENT_RC_FREE:
+            printf(COLOR_RED "  ✗ FREEING: " COLOR_RESET "'%s' (size: %zu) " COLOR_RED "[NO REFERENCES]\n" COLOR_RESET,
+                   event->name, event->size);
+            break;
 
-        if (bestFit == NULL) {
-            printf(COLOR_RED "  ✗ FAILED: Memory allocation failed after GC.\n" COLOR_RESET);
-            return NULL;
-        }
-    }
+        case HEAP_EVENT_RESIZE:
+            printf(COLOR_GREEN "  ✓ RESIZED: " COLOR_RESET "'%s' → Block size: " COLOR_YELLOW "%zu" COLOR_RESET
+                   " (was %zu) | Used: " COLOR_YELLOW "%zu" COLOR_RESET " @ %zu\n",
+                   event->name, event->size, event->otherSize, event->requestedSize, event->offset);
+            break;
 
-    int closestFibSize = getClosestFibonacci(size);
+        case HEAP_EVENT_RESIZE_FAILED:
+            if (event->status == HEAP_ERR_NO_SPACE) {
+                printf(COLOR_RED "  ✗ FAILED: No room to resize '%s' to %zu bytes.\n" COLOR_RESET,
+                       event->name != NULL ? event->name : "block", event->requestedSize);
+            } else {
+                printf(COLOR_RED "  ✗ ERROR: Block '%s' not found.\n" COLOR_RESET, event->name != NULL ? event->name : "");
+            }
+            break;
 
-    if (bestFit->size > closestFibSize) {
-        splitBlock(bestFit, getPreviousFibonacci(bestFit->size));
-    }
+        case HEAP_EVENT_COMPACT:
+            printf(COLOR_CYAN "  ℹ Compacted heap: moved " COLOR_YELLOW "%d" COLOR_CYAN " block(s), %zu bytes\n" COLOR_RESET,
+                   event->count, event->size);
+            break;
 
-    bestFit->isFree = false;
-    strncpy(bestFit->name, name, 19);
-    bestFit->name[19] = '\0';
-    bestFit->allocated_size = size;
-    bestFit->isRoot = isRoot;
-    bestFit->marked = false;
+        case HEAP_EVENT_GROW:
+            printf(COLOR_CYAN "  ℹ Heap grown: added " COLOR_YELLOW "%zu" COLOR_CYAN " bytes @ %zu (total %zu)\n" COLOR_RESET,
+                   event->size, event->offset, heapTotalMemory(heap));
+            break;
 
-    gcStats.totalAllocations++;
+        case HEAP_EVENT_SHRINK:
+            printf(COLOR_CYAN "  ℹ Heap trimmed: gave back " COLOR_YELLOW "%zu" COLOR_CYAN " bytes, unmapped %d region(s)\n" COLOR_RESET,
+                   event->size, event->count);
+            break;
+    }
+}
 
-    printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Allocated '%s' → Block size: " COLOR_YELLOW "%d" COLOR_RESET 
-           " | Used: " COLOR_YELLOW "%d" COLOR_RESET " | Waste: " COLOR_RED "%d\n" COLOR_RESET,
-           bestFit->name, bestFit->size, size, bestFit->size - size);
+// Print heap state with better formatting
+void traverseHeap(Heap* heap) {
+    int allocatedCount = 0;
+    int freeCount = 0;
+    size_t totalAllocated = 0;
+    size_t totalFree = 0;
+    HeapBlockView block;
     
-    char logMsg[100];
-    sprintf(logMsg, "Allocated '%s' (size: %d, root: %s)", name, size, isRoot ? "YES" : "NO");
-    addAuditLog(logMsg);
+    printf("\n");
+    printf(COLOR_BOLD COLOR_MAGENTA);
+    printf("╔════════════════════════════════════════════════════════════════════════╗\n");
+    printf("║                          HEAP MEMORY MAP                               ║\n");
+    printf("╚════════════════════════════════════════════════════════════════════════╝\n");
+    printf(COLOR_RESET);
     
-    return (void*)bestFit;
-}
-
-// Free memory with logging
-void free_memory(Node* head, char* name) {
-    printf("\n" COLOR_BOLD "═══ FREE REQUEST ═══\n" COLOR_RESET);
-    printf("  Name: " COLOR_CYAN "%s\n" COLOR_RESET, name);
+    printf(COLOR_CYAN "  ┌──────────────────────────────────────────────────────────────┐\n" COLOR_RESET);
     
-    if (name == NULL) {
-        printf(COLOR_RED "  ✗ ERROR: Cannot free unnamed block.\n" COLOR_RESET);
-        return;
-    }
+    for (int id = heapFirstBlock(heap); id != HEAP_NO_BLOCK; id = heapNextBlock(heap, id)) {
+        heapInspectBlock(heap, id, &block);
 
-    Node* current = head;
-
-    while (current != NULL) {
-        if (!current->isFree && strcmp(current->name, name) == 0) {
-            int freedSize = current->size;
-            current->isFree = true;
+        if (!block.isFree) {
+            allocatedCount++;
+            totalAllocated += block.size;
             
-            printf(COLOR_GREEN "  ✓ SUCCESS: " COLOR_RESET "Freed '%s' (size: %d)\n", 
-                   current->name, freedSize);
+            printf(COLOR_GREEN "  │ [ALLOCATED] " COLOR_RESET);
+            printf("%-15s | Size: " COLOR_YELLOW "%-5zu" COLOR_RESET, block.name, block.size);
+            printf(" | Used: " COLOR_YELLOW "%-5zu" COLOR_RESET, block.allocatedSize);
+            printf(" @ %-5zu │\n", block.offset);
             
-            for (int i = 0; i < current->numReferences; i++) {
-                free(current->references[i]);
+            printf("  │             Root: " COLOR_CYAN "%-3s" COLOR_RESET, block.isRoot ? "YES" : "NO");
+            // References to blocks freed since the last collection are not shown
+            int liveReferences = 0;
+            for (int i = 0; i < block.numReferences; i++) {
+                if (heapRefName(heap, block.references[i]) != NULL) liveReferences++;
             }
-            free(current->references);
-            current->references = NULL;
-            current->numReferences = 0;
-            current->refCapacity = 0;
-            current->isRoot = false;
+            printf(" | References: " COLOR_CYAN "%-2d" COLOR_RESET, liveReferences);
             
-            memset(current->name, 0, sizeof(current->name));
-
-            gcStats.totalManualFrees++;
-            
-            char logMsg[100];
-            sprintf(logMsg, "Manually freed '%s' (size: %d)", name, freedSize);
-            addAuditLog(logMsg);
+            if (liveReferences > 0) {
+                printf(" [");
+                for (int i = 0, shown = 0; i < block.numReferences; i++) {
+                    const char* target = heapRefName(heap, block.references[i]);
+                    if (target == NULL) continue;
+                    printf("%s%s", target, ++shown < liveReferences ? ", " : "");
+                }
+                printf("]");
+            }
+            printf("     │\n");
+            printf(COLOR_CYAN "  ├──────────────────────────────────────────────────────────────┤\n" COLOR_RESET);
+        } else {
+            freeCount++;
+            totalFree += block.size;
             
-            printf(COLOR_YELLOW "  Checking for merge opportunities...\n" COLOR_RESET);
-            mergeBlock(head);
-            return;
+            printf(COLOR_RED "  │ [FREE]      " COLOR_RESET);
+            printf("%-15s | Size: " COLOR_YELLOW "%-5zu" COLOR_RESET, "Available", block.size);
+            printf("              @ %-5zu │\n", block.offset);
+            printf(COLOR_CYAN "  ├──────────────────────────────────────────────────────────────┤\n" COLOR_RESET);
         }
-        current = current->next;
     }
-
-    printf(COLOR_RED "  ✗ ERROR: Block '%s' not found.\n" COLOR_RESET, name);
+    
+    printf(COLOR_CYAN "  └──────────────────────────────────────────────────────────────┘\n" COLOR_RESET);
+    
+    printf("\n" COLOR_BOLD "  Summary:\n" COLOR_RESET);
+    printf("  • Allocated Blocks: " COLOR_GREEN "%d" COLOR_RESET " (Total: " COLOR_YELLOW "%zu bytes" COLOR_RESET ")\n", 
+           allocatedCount, totalAllocated);
+    printf("  • Free Blocks: " COLOR_RED "%d" COLOR_RESET " (Total: " COLOR_YELLOW "%zu bytes" COLOR_RESET ")\n", 
+           freeCount, totalFree);
+    printf("  • Total Memory: " COLOR_CYAN "%zu bytes" COLOR_RESET "\n\n", totalAllocated + totalFree);
 }
 
-void printStatistics() {
+void printStatistics(Heap* heap) {
+    const GCStats* stats = heapGetStats(heap);
+
     printf("\n");
     printf(COLOR_BOLD COLOR_MAGENTA);
     printf("╔════════════════════════════════════════════════════════════════════════╗\n");
@@ -677,13 +434,18 @@ void printStatistics() {
     printf(COLOR_RESET);
     
     printf(COLOR_CYAN "  Memory Operations:\n" COLOR_RESET);
-    printf("    • Total Allocations:      " COLOR_GREEN "%d\n" COLOR_RESET, gcStats.totalAllocations);
-    printf("    • Manual Frees:           " COLOR_YELLOW "%d\n" COLOR_RESET, gcStats.totalManualFrees);
+    printf("    • Total Allocations:      " COLOR_GREEN "%d\n" COLOR_RESET, stats->totalAllocations);
+    printf("    • Manual Frees:           " COLOR_YELLOW "%d\n" COLOR_RESET, stats->totalManualFrees);
     
     printf(COLOR_CYAN "\n  Garbage Collection:\n" COLOR_RESET);
-    printf("    • Total GC Runs:          " COLOR_GREEN "%d\n" COLOR_RESET, gcStats.totalCollections);
-    printf("    • Total Blocks Freed:     " COLOR_YELLOW "%d\n" COLOR_RESET, gcStats.totalFreed);
-    printf("    • Last GC Freed:          " COLOR_MAGENTA "%d\n" COLOR_RESET, gcStats.lastFreedCount);
+    printf("    • Total GC Runs:          " COLOR_GREEN "%d\n" COLOR_RESET, stats->totalCollections);
+    printf("    • Total Blocks Freed:     " COLOR_YELLOW "%d\n" COLOR_RESET, stats->totalFreed);
+    printf("    • Last GC Freed:          " COLOR_MAGENTA "%d\n" COLOR_RESET, stats->lastFreedCount);
+
+    printf(COLOR_CYAN "\n  Regions:\n" COLOR_RESET);
+    printf("    • Total Memory:           " COLOR_GREEN "%zu bytes\n" COLOR_RESET, heapTotalMemory(heap));
+    printf("    • Regions Added:          " COLOR_GREEN "%d\n" COLOR_RESET, stats->regionsAdded);
+    printf("    • Regions Unmapped:       " COLOR_YELLOW "%d\n" COLOR_RESET, stats->regionsUnmapped);
     
     printf("\n");
 }
@@ -699,19 +461,31 @@ void printMenu() {
     printf("║  3. Display Heap Layout       │  7. Run Garbage Collection            ║\n");
     printf("║  4. Add Reference (A → B)     │  8. Show Statistics                   ║\n");
     printf("║                               │  9. Show Audit Log                    ║\n");
-    printf("║  0. Quit                      │                                       ║\n");
+    printf("║ 10. Save Heap Image           │ 11. Load Heap Image                   ║\n");
+    printf("║ 12. Start/Stop Trace          │  0. Quit                              ║\n");
     printf("╚════════════════════════════════════════════════════════════════════════╝\n");
     printf(COLOR_RESET);
     printf(COLOR_YELLOW "Enter your choice: " COLOR_RESET);
 }
 
-int main() {
-    int totalMemory = 16000;
-    Node* heap = initializeHeap(totalMemory);
+// The heap starts at 16000 bytes and may grow to 1 GiB; either can be given
+// on the command line
+int main(int argc, char** argv) {
+    size_t totalMemory = argc > 1 ? strtoull(argv[1], NULL, 10) : 16000;
+    size_t maxMemory = argc > 2 ? strtoull(argv[2], NULL, 10) : (size_t)1 << 30;
+    Heap* heap = initializeGrowableHeap(totalMemory, maxMemory, false);
     int choice;
     size_t size;
     char name[20], name2[20];
+    char path[256], tracePath[256];
     int rootChoice;
+    bool tracing = false;
+
+    if (heap == NULL) {
+        fprintf(stderr, COLOR_RED "Failed to initialize heap.\n" COLOR_RESET);
+        return 1;
+    }
+    heapSetEventHandler(heap, printHeapEvent, heap);
 
     printf(COLOR_BOLD COLOR_CYAN);
     printf("\n");
@@ -721,7 +495,7 @@ int main() {
     printf("║                                                                        ║\n");
     printf("╚════════════════════════════════════════════════════════════════════════╝\n");
     printf(COLOR_RESET);
-    printf("\n  Total Memory: " COLOR_GREEN "%d bytes\n" COLOR_RESET, totalMemory);
+    printf("\n  Total Memory: " COLOR_GREEN "%zu bytes" COLOR_RESET " (up to %zu)\n", totalMemory, maxMemory);
 
     while (1) {
         printMenu();
@@ -781,22 +555,72 @@ int main() {
                 break;
                 
             case 8:
-                printStatistics();
+                printStatistics(heap);
                 break;
                 
             case 9:
-                printAuditLog();
+                printAuditLog(heap);
+                break;
+
+            case 10:
+                printf(COLOR_CYAN "\n Enter image file: " COLOR_RESET);
+                scanf("%255s", path);
+                if (heapSaveImage(heap, path) == HEAP_OK) {
+                    printf(COLOR_GREEN "  ✓ Saved heap image to '%s'.\n" COLOR_RESET, path);
+                } else {
+                    printf(COLOR_RED "  ✗ ERROR: Could not write '%s'.\n" COLOR_RESET, path);
+                }
+                break;
+
+            case 11: {
+                printf(COLOR_CYAN "\n Enter image file: " COLOR_RESET);
+                scanf("%255s", path);
+                HeapStatus status;
+                Heap* loaded = heapLoadImage(path, false, &status);
+                if (loaded == NULL) {
+                    printf(COLOR_RED "  ✗ ERROR: %s '%s'.\n" COLOR_RESET,
+                           status == HEAP_ERR_BAD_IMAGE ? "Not a heap image:" : "Could not read", path);
+                    break;
+                }
+                destroyHeap(heap);
+                heap = loaded;
+                tracing = false;
+                heapSetEventHandler(heap, printHeapEvent, heap);
+                printf(COLOR_GREEN "  ✓ Loaded heap image '%s' (%zu bytes).\n" COLOR_RESET, path, heapTotalMemory(heap));
+                break;
+            }
+
+            case 12:
+                if (tracing) {
+                    tracing = false;
+                    if (heapStopTrace(heap) == HEAP_OK) {
+                        printf(COLOR_GREEN "  ✓ Trace written to '%s'.\n" COLOR_RESET, tracePath);
+                    } else {
+                        printf(COLOR_RED "  ✗ ERROR: Could not write all of '%s'.\n" COLOR_RESET, tracePath);
+                    }
+                    break;
+                }
+                printf(COLOR_CYAN "\n Enter trace file: " COLOR_RESET);
+                scanf("%255s", tracePath);
+                tracing = heapStartTrace(heap, tracePath) == HEAP_OK;
+                if (tracing) {
+                    printf(COLOR_GREEN "  ✓ Tracing to '%s'; choose 12 again to stop.\n" COLOR_RESET, tracePath);
+                } else {
+                    printf(COLOR_RED "  ✗ ERROR: Could not create '%s'.\n" COLOR_RESET, tracePath);
+                }
                 break;
                 
             case 0:
                 printf("\n" COLOR_GREEN "Thank you for using Fibonacci Heap Manager!\n" COLOR_RESET);
                 printf(COLOR_CYAN "Final Statistics:\n" COLOR_RESET);
-                printStatistics();
+                printStatistics(heap);
+                destroyHeap(heap);
                 return 0;
                 
             default:
                 printf(COLOR_RED "\n  ✗ Invalid choice. Please try again.\n" COLOR_RESET);
         }
     }
+    destroyHeap(heap);
     return 0;
 }
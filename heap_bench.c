@@ -0,0 +1,684 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap_manager.h"
+
+// Benchmarks for the allocator. Every workload is generated up front as a
+// sequence of operations and run unchanged against the heap and against
+// libc malloc, so both see the same trace.
+//
+//     heap_bench [--quick] [--json file] [--baseline file] [--threshold percent] [--trace file]
+//
+// Results go to stdout as a table and, with --json, to file as one result
+// per line. --baseline compares the tracked results with an earlier JSON
+// file and exits with 1 if any got worse by more than the threshold
+// (default 10 percent). The malloc results are there for reference and are
+// not tracked.
+
+#define MAX_RESULTS   256
+#define MAX_SAMPLES   20
+#define MAX_THREADS   64
+
+typedef struct Result {
+    char name[64];
+    const char* unit;
+    double value;
+    bool lowerIsBetter;
+    bool tracked;
+    int sampleCount;               // Values over time, oldest first
+    double samples[MAX_SAMPLES];
+} Result;
+
+static Result results[MAX_RESULTS];
+static int resultCount = 0;
+static bool quick = false;
+
+static Result* addResult(const char* name, const char* unit, double value, bool lowerIsBetter, bool tracked) {
+    if (resultCount == MAX_RESULTS) return NULL;
+    Result* result = &results[resultCount++];
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->unit = unit;
+    result->value = value;
+    result->lowerIsBetter = lowerIsBetter;
+    result->tracked = tracked;
+    printf("  %-40s %14.2f %s\n", result->name, value, unit);
+    return result;
+}
+
+static double nowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// xorshift64*, so every run and both allocators get the same sequence
+static unsigned long long nextRandom(unsigned long long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// Size distributions
+
+typedef enum {
+    SIZES_SMALL,     // 8 to 128 bytes
+    SIZES_MEDIUM,    // 128 bytes to 4 KiB
+    SIZES_LARGE,     // 4 KiB to 64 KiB
+    SIZES_MIXED,     // Mostly small, with a long tail up to 64 KiB
+    SIZES_COUNT
+} SizeDistribution;
+
+static const char* distributionNames[SIZES_COUNT] = { "small", "medium", "large", "mixed" };
+
+static size_t pickSize(SizeDistribution distribution, unsigned long long* state) {
+    unsigned long long r = nextRandom(state);
+    switch (distribution) {
+    case SIZES_SMALL:  return 8 + r % 121;
+    case SIZES_MEDIUM: return 128 + r % (4096 - 127);
+    case SIZES_LARGE:  return 4096 + r % (65536 - 4095);
+    default: {
+        // Each doubling of the size is half as likely
+        int shift = 3 + __builtin_ctzll((r >> 32) | (1ULL << 13));
+        return ((size_t)1 << shift) + r % ((size_t)1 << shift);
+    }
+    }
+}
+
+// An operation on a slot of the working set: allocate size bytes into it,
+// or free it when size is 0
+typedef struct Op {
+    int slot;
+    size_t size;
+} Op;
+
+// Random allocations and frees over slotCount slots, starting by filling
+// half of them
+static Op* makeOps(SizeDistribution distribution, int slotCount, int count, unsigned long long seed) {
+    Op* ops = (Op*)malloc(count * sizeof(Op));
+    bool* used = (bool*)calloc(slotCount, sizeof(bool));
+    if (ops == NULL || used == NULL) {
+        free(ops);
+        free(used);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int slot = i < slotCount / 2 ? i : (int)(nextRandom(&seed) % slotCount);
+        ops[i].slot = slot;
+        ops[i].size = used[slot] ? 0 : pickSize(distribution, &seed);
+        used[slot] = !used[slot];
+    }
+    free(used);
+    return ops;
+}
+
+// Throughput. Blocks are roots, so collections triggered along the way find
+// nothing to free, as with memory that malloc never reclaims by itself.
+
+static double runHeapOps(Heap* heap, const Op* ops, int count, int slotCount, int* failed) {
+    HeapRef* slots = (HeapRef*)malloc(slotCount * sizeof(HeapRef));
+    for (int i = 0; i < slotCount; i++) slots[i] = HEAP_NULL_REF;
+    *failed = 0;
+
+    double start = nowNanos();
+    for (int i = 0; i < count; i++) {
+        HeapRef* slot = &slots[ops[i].slot];
+        if (ops[i].size == 0) {
+            free_handle(heap, *slot);
+            *slot = HEAP_NULL_REF;
+        } else {
+            *slot = allocate_handle(heap, NULL, ops[i].size, true);
+            if (*slot == HEAP_NULL_REF) {
+                (*failed)++;
+            } else {
+                *(volatile char*)heapHandleMemory(heap, *slot) = 1;
+            }
+        }
+    }
+    double elapsed = nowNanos() - start;
+
+    free(slots);
+    return elapsed;
+}
+
+static double runMallocOps(const Op* ops, int count, int slotCount) {
+    void** slots = (void**)calloc(slotCount, sizeof(void*));
+
+    double start = nowNanos();
+    for (int i = 0; i < count; i++) {
+        void** slot = &slots[ops[i].slot];
+        if (ops[i].size == 0) {
+            free(*slot);
+            *slot = NULL;
+        } else {
+            *slot = malloc(ops[i].size);
+            if (*slot != NULL) {
+                *(volatile char*)*slot = 1;
+            }
+        }
+    }
+    double elapsed = nowNanos() - start;
+
+    for (int i = 0; i < slotCount; i++) free(slots[i]);
+    free(slots);
+    return elapsed;
+}
+
+static void benchThroughput(void) {
+    int slotCount = 4096;
+    int count = quick ? 200000 : 1000000;
+    char name[64];
+
+    printf("\nThroughput (allocate_handle / free_handle against malloc / free)\n");
+    for (int d = 0; d < SIZES_COUNT; d++) {
+        Op* ops = makeOps((SizeDistribution)d, slotCount, count, 0x9e3779b97f4a7c15ULL + d);
+        Heap* heap = initializeGrowableHeap((size_t)1 << 20, (size_t)1 << 33, false);
+        if (ops == NULL || heap == NULL) {
+            fprintf(stderr, "throughput: out of memory\n");
+            free(ops);
+            if (heap != NULL) destroyHeap(heap);
+            continue;
+        }
+
+        int failed;
+        double heapNanos = runHeapOps(heap, ops, count, slotCount, &failed);
+        destroyHeap(heap);
+        double mallocNanos = runMallocOps(ops, count, slotCount);
+        free(ops);
+
+        snprintf(name, sizeof(name), "alloc.%s.heap", distributionNames[d]);
+        addResult(name, "ns/op", heapNanos / count, true, true);
+        snprintf(name, sizeof(name), "alloc.%s.malloc", distributionNames[d]);
+        addResult(name, "ns/op", mallocNanos / count, true, false);
+        if (failed > 0) {
+            snprintf(name, sizeof(name), "alloc.%s.heap.failed", distributionNames[d]);
+            addResult(name, "allocations", failed, true, true);
+        }
+    }
+}
+
+// Fragmentation. A fixed-size heap is churned at about 60% occupancy,
+// switching between small and large sizes every quarter of the run so
+// small blocks left over pin down memory the large ones need, and walked
+// at regular points. Fragmentation is the share
+// of free memory outside the largest free block; internal waste is the
+// share of allocated memory beyond what was asked for.
+
+typedef struct HeapShape {
+    size_t freeBytes;
+    size_t largestFree;
+    size_t allocatedBytes;
+    size_t requestedBytes;
+} HeapShape;
+
+static void measureHeap(Heap* heap, HeapShape* shape) {
+    HeapBlockView view;
+    memset(shape, 0, sizeof(*shape));
+    for (int block = heapFirstBlock(heap); block != HEAP_NO_BLOCK; block = heapNextBlock(heap, block)) {
+        heapInspectBlock(heap, block, &view);
+        if (view.isFree) {
+            shape->freeBytes += view.size;
+            if (view.size > shape->largestFree) shape->largestFree = view.size;
+        } else {
+            shape->allocatedBytes += view.size;
+            shape->requestedBytes += view.allocatedSize;
+        }
+    }
+}
+
+static void benchFragmentation(bool compacting) {
+    size_t heapBytes = quick ? (size_t)8 << 20 : (size_t)32 << 20;
+    int count = quick ? 200000 : 1000000;
+    const char* mode = compacting ? "compacting" : "plain";
+    unsigned long long seed = 42;
+    char name[64];
+
+    Heap* heap = initializeHeap(heapBytes);
+    int slotCount = 4096;
+    HeapRef* slots = (HeapRef*)malloc(slotCount * sizeof(HeapRef));
+    size_t* sizes = (size_t*)calloc(slotCount, sizeof(size_t));
+    if (heap == NULL || slots == NULL || sizes == NULL) {
+        fprintf(stderr, "fragmentation: out of memory\n");
+        if (heap != NULL) destroyHeap(heap);
+        free(slots);
+        free(sizes);
+        return;
+    }
+    heapSetCompaction(heap, compacting);
+    for (int i = 0; i < slotCount; i++) slots[i] = HEAP_NULL_REF;
+
+    size_t target = heapBytes / 10 * 6;
+    size_t live = 0;
+    int failed = 0;
+    double samples[MAX_SAMPLES];
+    double peak = 0.0;
+    HeapShape shape;
+
+    for (int i = 0, sample = 0; i < count; i++) {
+        int slot = (int)(nextRandom(&seed) % slotCount);
+        if (slots[slot] != HEAP_NULL_REF) {
+            free_handle(heap, slots[slot]);
+            live -= sizes[slot];
+            slots[slot] = HEAP_NULL_REF;
+        } else if (live < target) {
+            size_t size = pickSize((i / (count / 4)) % 2 == 0 ? SIZES_SMALL : SIZES_LARGE, &seed);
+            slots[slot] = allocate_handle(heap, NULL, size, true);
+            if (slots[slot] == HEAP_NULL_REF) {
+                failed++;
+            } else {
+                sizes[slot] = size;
+                live += size;
+            }
+        }
+
+        if ((i + 1) % (count / MAX_SAMPLES) == 0 && sample < MAX_SAMPLES) {
+            if (compacting) {
+                garbageCollect(heap);
+            }
+            measureHeap(heap, &shape);
+            double fragmentation = shape.freeBytes > 0 ? 1.0 - (double)shape.largestFree / shape.freeBytes : 0.0;
+            samples[sample++] = fragmentation * 100.0;
+            if (samples[sample - 1] > peak) peak = samples[sample - 1];
+        }
+    }
+
+    measureHeap(heap, &shape);
+    printf("\nFragmentation over time (%s, %zu byte heap)\n", mode, heapBytes);
+    snprintf(name, sizeof(name), "fragmentation.%s.final", mode);
+    Result* result = addResult(name, "%", samples[MAX_SAMPLES - 1], true, true);
+    if (result != NULL) {
+        result->sampleCount = MAX_SAMPLES;
+        memcpy(result->samples, samples, sizeof(samples));
+    }
+    snprintf(name, sizeof(name), "fragmentation.%s.peak", mode);
+    addResult(name, "%", peak, true, true);
+    snprintf(name, sizeof(name), "fragmentation.%s.internalWaste", mode);
+    addResult(name, "%", shape.allocatedBytes > 0 ? 100.0 * (1.0 - (double)shape.requestedBytes / shape.allocatedBytes) : 0.0,
+              true, true);
+    snprintf(name, sizeof(name), "fragmentation.%s.failed", mode);
+    addResult(name, "allocations", failed, true, true);
+
+    destroyHeap(heap);
+    free(slots);
+    free(sizes);
+}
+
+// Collection pauses. A live graph of n blocks of a given shape is built
+// next to n blocks of garbage, and one full collection is timed. The
+// median of a few runs on fresh heaps is reported.
+
+typedef enum {
+    GRAPH_LIST,      // One chain from a single root
+    GRAPH_TREE,      // A binary tree from a single root
+    GRAPH_RANDOM,    // Two random edges per block, one root in 100
+    GRAPH_COUNT
+} GraphShape;
+
+static const char* graphNames[GRAPH_COUNT] = { "list", "tree", "random" };
+
+static double timeCollection(GraphShape graph, int n, int gcThreads) {
+    Heap* heap = initializeGrowableHeap((size_t)n * 160, (size_t)1 << 34, false);
+    HeapRef* blocks = (HeapRef*)malloc(2 * (size_t)n * sizeof(HeapRef));
+    if (heap == NULL || blocks == NULL) {
+        if (heap != NULL) destroyHeap(heap);
+        free(blocks);
+        return -1.0;
+    }
+    heapSetGCThreads(heap, gcThreads);
+    unsigned long long seed = 7;
+
+    for (int i = 0; i < 2 * n; i++) {
+        bool isRoot = i < n && (i == 0 || (graph == GRAPH_RANDOM && i % 100 == 0));
+        blocks[i] = allocate_handle(heap, NULL, 32, isRoot);
+    }
+    for (int i = 0; i < n; i++) {
+        switch (graph) {
+        case GRAPH_LIST:
+            if (i + 1 < n) addReferenceByHandle(heap, blocks[i], blocks[i + 1]);
+            break;
+        case GRAPH_TREE:
+            if (2 * i + 1 < n) addReferenceByHandle(heap, blocks[i], blocks[2 * i + 1]);
+            if (2 * i + 2 < n) addReferenceByHandle(heap, blocks[i], blocks[2 * i + 2]);
+            break;
+        default:
+            addReferenceByHandle(heap, blocks[i], blocks[nextRandom(&seed) % n]);
+            addReferenceByHandle(heap, blocks[i], blocks[nextRandom(&seed) % n]);
+            break;
+        }
+        // The garbage is chained too, so the sweep sees references
+        if (i + 1 < n) addReferenceByHandle(heap, blocks[n + i], blocks[n + i + 1]);
+    }
+
+    double start = nowNanos();
+    garbageCollect(heap);
+    double elapsed = nowNanos() - start;
+
+    destroyHeap(heap);
+    free(blocks);
+    return elapsed;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Median of the runs that could be set up, or -1 if none could
+static double medianCollection(GraphShape graph, int n, int gcThreads) {
+    double runs[5];
+    int attempts = quick ? 1 : 5;
+    int count = 0;
+    for (int i = 0; i < attempts; i++) {
+        double elapsed = timeCollection(graph, n, gcThreads);
+        if (elapsed >= 0) {
+            runs[count++] = elapsed;
+        }
+    }
+    if (count == 0) return -1.0;
+    qsort(runs, count, sizeof(double), compareDoubles);
+    return runs[count / 2];
+}
+
+static void addCollection(const char* name, GraphShape graph, int n, int gcThreads) {
+    double elapsed = medianCollection(graph, n, gcThreads);
+    if (elapsed < 0) {
+        fprintf(stderr, "%s: no collection could be set up\n", name);
+        return;
+    }
+    addResult(name, "us", elapsed / 1e3, true, true);
+}
+
+static void benchCollection(int cores) {
+    int sizes[] = { 1000, 10000, 100000 };
+    int sizeCount = quick ? 2 : 3;
+    int gcThreads = cores < 8 ? cores : 8;
+    char name[64];
+
+    printf("\nCollection pause (live blocks plus as many garbage blocks)\n");
+    for (int g = 0; g < GRAPH_COUNT; g++) {
+        for (int s = 0; s < sizeCount; s++) {
+            snprintf(name, sizeof(name), "gc.%s.%d", graphNames[g], sizes[s]);
+            addCollection(name, (GraphShape)g, sizes[s], 1);
+        }
+    }
+    if (gcThreads > 1) {
+        int n = sizes[sizeCount - 1];
+        snprintf(name, sizeof(name), "gc.random.%d.threads%d", n, gcThreads);
+        addCollection(name, GRAPH_RANDOM, n, gcThreads);
+    }
+}
+
+// Thread scaling. Every thread runs its own small-block trace against one
+// concurrent heap, or against malloc.
+
+// Holds the threads until all of them have started, or sends them home if
+// some could not be
+typedef struct StartGate {
+    pthread_mutex_t lock;
+    pthread_cond_t opened;
+    enum { GATE_WAITING, GATE_RUN, GATE_ABANDON } state;
+} StartGate;
+
+typedef struct ThreadWork {
+    Heap* heap;          // NULL to use malloc
+    const Op* ops;
+    int count;
+    int slotCount;
+    StartGate* gate;
+} ThreadWork;
+
+static void openGate(StartGate* gate, bool run) {
+    pthread_mutex_lock(&gate->lock);
+    gate->state = run ? GATE_RUN : GATE_ABANDON;
+    pthread_cond_broadcast(&gate->opened);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+static void* threadWorker(void* arg) {
+    ThreadWork* work = (ThreadWork*)arg;
+    int failed;
+    pthread_mutex_lock(&work->gate->lock);
+    while (work->gate->state == GATE_WAITING) {
+        pthread_cond_wait(&work->gate->opened, &work->gate->lock);
+    }
+    bool run = work->gate->state == GATE_RUN;
+    pthread_mutex_unlock(&work->gate->lock);
+    if (!run) return NULL;
+
+    if (work->heap != NULL) {
+        runHeapOps(work->heap, work->ops, work->count, work->slotCount, &failed);
+    } else {
+        runMallocOps(work->ops, work->count, work->slotCount);
+    }
+    return NULL;
+}
+
+// Operations per microsecond across all threads, or -1 if the heap or a
+// thread could not be set up
+static double runThreads(bool useHeap, int threadCount, Op** ops, int count, int slotCount) {
+    pthread_t threads[MAX_THREADS];
+    ThreadWork work[MAX_THREADS];
+    StartGate gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, GATE_WAITING };
+
+    Heap* heap = useHeap ? initializeGrowableHeap((size_t)16 << 20, (size_t)1 << 34, true) : NULL;
+    if (useHeap && heap == NULL) return -1.0;
+
+    int started = 0;
+    for (; started < threadCount; started++) {
+        work[started] = (ThreadWork){ heap, ops[started], count, slotCount, &gate };
+        if (pthread_create(&threads[started], NULL, threadWorker, &work[started]) != 0) break;
+    }
+
+    // Time from the gate opening, so thread creation is left out
+    bool run = started == threadCount;
+    double start = nowNanos();
+    openGate(&gate, run);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = nowNanos() - start;
+
+    if (heap != NULL) destroyHeap(heap);
+    pthread_cond_destroy(&gate.opened);
+    pthread_mutex_destroy(&gate.lock);
+    if (!run) {
+        fprintf(stderr, "threads.%d: only %d threads could be started\n", threadCount, started);
+        return -1.0;
+    }
+    return (double)count * threadCount / (elapsed / 1e3);
+}
+
+static void benchThreads(int cores) {
+    int count = quick ? 100000 : 500000;
+    int slotCount = 256;
+    int maxThreads = cores < MAX_THREADS ? cores : MAX_THREADS;
+    Op* ops[MAX_THREADS];
+    char name[64];
+
+    printf("\nThread scaling (small blocks, per-thread traces)\n");
+    for (int i = 0; i < maxThreads; i++) {
+        ops[i] = makeOps(SIZES_SMALL, slotCount, count, 1000 + i);
+        if (ops[i] == NULL) {
+            maxThreads = i;
+            break;
+        }
+    }
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double heapRate = runThreads(true, threads, ops, count, slotCount);
+        double mallocRate = runThreads(false, threads, ops, count, slotCount);
+        if (heapRate >= 0) {
+            snprintf(name, sizeof(name), "threads.%d.heap", threads);
+            addResult(name, "ops/us", heapRate, false, true);
+        }
+        if (mallocRate >= 0) {
+            snprintf(name, sizeof(name), "threads.%d.malloc", threads);
+            addResult(name, "ops/us", mallocRate, false, false);
+        }
+    }
+
+    for (int i = 0; i < maxThreads; i++) free(ops[i]);
+}
+
+// A recorded trace, replayed with heapReplayTrace and, for comparison,
+// through malloc with heapReplayTraceMalloc
+static bool benchTrace(const char* path) {
+    Heap* heap = initializeGrowableHeap(16000, (size_t)1 << 34, false);
+    if (heap == NULL) return false;
+
+    HeapReplayStats stats;
+    HeapStatus status = heapReplayTrace(heap, path, &stats);
+    destroyHeap(heap);
+    if (status != HEAP_OK) {
+        fprintf(stderr, "%s: could not be replayed\n", path);
+        return false;
+    }
+
+    printf("\nTrace replay (%s)\n", path);
+    addResult("trace.replay", "ns/op", stats.operations > 0 ? (double)stats.replayNanos / stats.operations : 0.0,
+              true, true);
+    addResult("trace.recorded", "ns/op", stats.operations > 0 ? (double)stats.recordedNanos / stats.operations : 0.0,
+              true, false);
+    addResult("trace.diverged", "operations", (double)stats.diverged, true, true);
+
+    if (heapReplayTraceMalloc(path, &stats) != HEAP_OK) {
+        fprintf(stderr, "%s: could not be replayed through malloc\n", path);
+        return true;
+    }
+    addResult("trace.replay.malloc", "ns/op",
+              stats.operations > 0 ? (double)stats.replayNanos / stats.operations : 0.0, true, false);
+    if (stats.diverged > 0) {
+        addResult("trace.replay.malloc.diverged", "operations", (double)stats.diverged, true, false);
+    }
+    return true;
+}
+
+static bool writeJson(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "{\n  \"benchmark\": \"heap_bench\",\n  \"version\": 1,\n  \"quick\": %s,\n  \"results\": [\n",
+            quick ? "true" : "false");
+    for (int i = 0; i < resultCount; i++) {
+        const Result* result = &results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.6g, \"lowerIsBetter\": %s, \"tracked\": %s",
+                result->name, result->unit, result->value, result->lowerIsBetter ? "true" : "false",
+                result->tracked ? "true" : "false");
+        if (result->sampleCount > 0) {
+            fprintf(file, ", \"samples\": [");
+            for (int s = 0; s < result->sampleCount; s++) {
+                fprintf(file, "%s%.4g", s > 0 ? ", " : "", result->samples[s]);
+            }
+            fprintf(file, "]");
+        }
+        fprintf(file, "}%s\n", i + 1 < resultCount ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// Compare with a file written by writeJson, which puts each result on a
+// line of its own. Returns the number of regressions, or -1 if the file
+// could not be read.
+static int compareBaseline(const char* path, double threshold) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    char line[1024];
+    int regressions = 0;
+    printf("\nAgainst baseline %s (threshold %.1f%%)\n", path, threshold);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* name = strstr(line, "\"name\": \"");
+        char* value = strstr(line, "\"value\": ");
+        if (name == NULL || value == NULL) continue;
+        name += strlen("\"name\": \"");
+        char* end = strchr(name, '"');
+        if (end == NULL) continue;
+        *end = '\0';
+        double before = strtod(value + strlen("\"value\": "), NULL);
+
+        for (int i = 0; i < resultCount; i++) {
+            const Result* result = &results[i];
+            if (!result->tracked || strcmp(result->name, name) != 0) continue;
+
+            double change = before != 0.0 ? (result->value - before) / before * 100.0 : 0.0;
+            bool worse = result->lowerIsBetter ? change > threshold : change < -threshold;
+            // Counts that were zero regress as soon as they are not
+            if (before == 0.0 && result->lowerIsBetter && result->value > 0.0) worse = true;
+            printf("  %-40s %14.2f -> %14.2f %+8.1f%%%s\n", name, before, result->value, change,
+                   worse ? "  REGRESSION" : "");
+            regressions += worse;
+            break;
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [--quick] [--json file] [--baseline file] [--threshold percent] [--trace file]\n", program);
+}
+
+int main(int argc, char** argv) {
+    const char* jsonPath = NULL;
+    const char* baselinePath = NULL;
+    const char* tracePath = NULL;
+    double threshold = 10.0;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (strcmp(argv[i], "--json") == 0 && hasValue) {
+            jsonPath = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && hasValue) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && hasValue) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--trace") == 0 && hasValue) {
+            tracePath = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+
+    printf("heap_bench%s, %ld cores\n", quick ? " (quick)" : "", cores);
+    benchThroughput();
+    benchFragmentation(false);
+    benchFragmentation(true);
+    benchCollection((int)cores);
+    benchThreads((int)cores);
+    if (tracePath != NULL && !benchTrace(tracePath)) {
+        return 1;
+    }
+    fflush(stdout);
+
+    if (jsonPath != NULL && !writeJson(jsonPath)) {
+        fprintf(stderr, "Could not write %s\n", jsonPath);
+        return 1;
+    }
+    if (baselinePath != NULL) {
+        int regressions = compareBaseline(baselinePath, threshold);
+        if (regressions < 0) {
+            fprintf(stderr, "Could not read %s\n", baselinePath);
+            return 1;
+        }
+        return regressions > 0 ? 1 : 0;
+    }
+    return 0;
+}
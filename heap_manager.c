@@ -0,0 +1,5151 @@
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap_manager.h"
+
+// Blocks are identified by an index into the descriptor tables
+#define NO_BLOCK HEAP_NO_BLOCK
+#define NO_OFFSET ((size_t)-1)
+
+// Position of a block within its parent. A block of class k splits into a
+// LEFT half of class k-1 at the same offset and a RIGHT half of class k-2
+// right after it. TOP blocks are the roots of the arena's buddy trees.
+typedef enum {
+    BUDDY_TOP,
+    BUDDY_LEFT,
+    BUDDY_RIGHT
+} BuddySide;
+
+// Bits of a block's state byte. The side and the parent's side (restored
+// when the buddies merge) are packed in alongside the flags. Mark bits live
+// in a separate bitmap indexed by block id.
+#define BLOCK_FREE    0x01
+#define BLOCK_SPARE   0x02    // Descriptor on the spare chain, describing no block
+#define BLOCK_ROOT    0x04
+#define BLOCK_CACHED  0x80    // Free, but held in a thread cache rather than on a free list
+#define SIDE_SHIFT    3
+#define INHERIT_SHIFT 5
+#define SIDE_MASK     0x03
+
+// Every distinct Fibonacci number that fits in 64 bits is a size class
+#define MAX_FIB_CLASSES 92
+#define FIB_BITMAP_WORDS ((MAX_FIB_CLASSES + 63) / 64)
+
+// Cold per-block data, only touched by name lookups, reference edits and
+// tracing
+typedef struct BlockInfo {
+    char name[20];
+    size_t allocated_size;
+    HeapRef* references;
+    int numReferences;
+    int refCapacity;
+    int refCount;      // Live references to this block, when reference counting is on
+    unsigned char shard;    // Name shard that guards the block while it is allocated
+    unsigned char alignShift;    // log2 of the alignment the block was allocated with
+} BlockInfo;
+
+// Block descriptors live in fixed-size chunks laid out as a structure of
+// arrays, so walks over the hot fields stay dense and growing the table
+// never moves existing descriptors.
+#define BLOCK_CHUNK_SHIFT 12
+#define BLOCK_CHUNK_SIZE  (1 << BLOCK_CHUNK_SHIFT)
+#define BLOCK_CHUNK_MASK  (BLOCK_CHUNK_SIZE - 1)
+#define MAX_BLOCK_CHUNKS  65536
+
+typedef struct BlockChunk {
+    // Hot allocation state
+    size_t offset[BLOCK_CHUNK_SIZE];
+    unsigned char sizeClass[BLOCK_CHUNK_SIZE];
+    unsigned char state[BLOCK_CHUNK_SIZE];
+
+    // Neighbours in address order; blocks tile the arena
+    int next[BLOCK_CHUNK_SIZE];
+    int prev[BLOCK_CHUNK_SIZE];
+
+    // Segregated free list links (valid only while free). Unused
+    // descriptors are chained through nextFree.
+    int nextFree[BLOCK_CHUNK_SIZE];
+    int prevFree[BLOCK_CHUNK_SIZE];
+
+    // Bumped whenever the block stops being allocated, so references to
+    // it go stale
+    unsigned int generation[BLOCK_CHUNK_SIZE];
+
+    // Generational collection: minor collections survived plus flags (see
+    // AGE_MASK), and the block's slot in the nursery while young
+    unsigned char age[BLOCK_CHUNK_SIZE];
+    int nurserySlot[BLOCK_CHUNK_SIZE];
+
+    // Lazy sweeping: classes allocated here since the chunk was last swept,
+    // and whether a finished mark has left it unswept
+    unsigned long long usedClasses[FIB_BITMAP_WORDS];
+    bool unswept;
+
+    // Cold table
+    BlockInfo info[BLOCK_CHUNK_SIZE];
+} BlockChunk;
+
+#define BLOCK_CHUNK(heap, id) ((heap)->chunks[(id) >> BLOCK_CHUNK_SHIFT])
+#define BLK_OFFSET(heap, id)    (BLOCK_CHUNK(heap, id)->offset[(id) & BLOCK_CHUNK_MASK])
+#define BLK_CLASS(heap, id)     (BLOCK_CHUNK(heap, id)->sizeClass[(id) & BLOCK_CHUNK_MASK])
+#define BLK_STATE(heap, id)     (BLOCK_CHUNK(heap, id)->state[(id) & BLOCK_CHUNK_MASK])
+#define BLK_NEXT(heap, id)      (BLOCK_CHUNK(heap, id)->next[(id) & BLOCK_CHUNK_MASK])
+#define BLK_PREV(heap, id)      (BLOCK_CHUNK(heap, id)->prev[(id) & BLOCK_CHUNK_MASK])
+#define BLK_NEXT_FREE(heap, id) (BLOCK_CHUNK(heap, id)->nextFree[(id) & BLOCK_CHUNK_MASK])
+#define BLK_PREV_FREE(heap, id) (BLOCK_CHUNK(heap, id)->prevFree[(id) & BLOCK_CHUNK_MASK])
+#define BLK_GEN(heap, id)       (BLOCK_CHUNK(heap, id)->generation[(id) & BLOCK_CHUNK_MASK])
+#define BLK_INFO(heap, id)      (BLOCK_CHUNK(heap, id)->info[(id) & BLOCK_CHUNK_MASK])
+#define BLK_AGE(heap, id)       (BLOCK_CHUNK(heap, id)->age[(id) & BLOCK_CHUNK_MASK])
+#define BLK_NURSERY_SLOT(heap, id) (BLOCK_CHUNK(heap, id)->nurserySlot[(id) & BLOCK_CHUNK_MASK])
+
+// Bits of a block's age byte. The low bits count minor collections survived
+// plus one while the block is young and are 0 once it is old (or free).
+#define AGE_MASK        0x3F
+#define AGE_REMEMBERED  0x40    // Old block listed in the remembered set
+#define AGE_MINOR_MARK  0x80
+#define MAX_PROMOTE_AGE (AGE_MASK - 1)
+
+#define NAME_INDEX_INITIAL_CAPACITY 64
+
+// The name index is split into shards by the top bits of the name hash,
+// each with its own lock, so threads working on different names rarely meet
+#define NAME_INDEX_SHARD_BITS 4
+#define NAME_INDEX_SHARDS     (1 << NAME_INDEX_SHARD_BITS)
+
+// Open-addressing (linear probing) index from block name to allocated
+// block; empty slots hold NO_BLOCK
+typedef struct NameShard {
+    pthread_mutex_t lock;
+    int* slots;
+    int capacity;
+    int count;
+} NameShard;
+
+// Per-thread caches of free blocks for the small size classes. A cache is
+// refilled from and flushed to the central free lists CACHE_BATCH blocks at
+// a time, so most small allocations and frees never take the central lock.
+#define CACHE_CLASSES  16    // Classes up to 1597 bytes
+#define CACHE_CAPACITY 8
+#define CACHE_BATCH    4
+
+typedef struct ThreadCache {
+    // Held by the owning thread for the whole of each operation; a
+    // collection takes every cache lock to stop the world
+    pthread_mutex_t lock;
+    struct Heap* heap;
+    int count[CACHE_CLASSES];
+    int blocks[CACHE_CLASSES][CACHE_CAPACITY];
+    struct ThreadCache* next;
+} ThreadCache;
+
+// One audit ring slot. seq is index + 1 of the record it holds, 0 while the
+// slot is unused and AUDIT_BUSY while someone is copying a record in or out.
+typedef struct AuditSlot {
+    atomic_ullong seq;
+    HeapAuditRecord record;
+} AuditSlot;
+
+// Tracing state: one frame per block on the current path of the depth-first
+// mark, and one mark bit per block id
+typedef struct MarkFrame {
+    int block;
+    int depth;
+    int nextRef;    // Next reference of block to follow
+} MarkFrame;
+
+// Heaps with fewer descriptors than this are always collected serially
+#define PARALLEL_GC_MIN_BLOCKS (2 * BLOCK_CHUNK_SIZE)
+
+#define AUDIT_MASK (HEAP_AUDIT_CAPACITY - 1)
+#define AUDIT_BUSY (~0ULL)
+
+// A stretch of the arena carved into its own buddy trees, so no block
+// spans two regions. Regions after the first start on a page boundary.
+typedef struct Region {
+    size_t start;
+    size_t size;
+    bool advised;              // Empty, and its pages already given back
+} Region;
+
+// Each region added is at least as large as the heap, so this many cover
+// any address space
+#define MAX_REGIONS 64
+
+// A heap owns a contiguous arena and the blocks that carve it up
+struct Heap {
+    unsigned char* arena;
+    size_t totalMemory;        // Bytes in all regions
+    int head;
+
+    // Address space for maxMemory bytes is reserved up front and committed
+    // one region at a time from the bottom, so the arena never moves
+    size_t maxMemory;
+    size_t reserved;           // maxMemory rounded up to a page
+    size_t mappedEnd;          // End of the last region, rounded up to a page
+    size_t pageSize;
+    Region regions[MAX_REGIONS];
+    int regionCount;
+    size_t allocatedSinceGC;   // Block bytes allocated since the last collection
+
+    // Segregated free lists, one per Fibonacci size class. Bit i of
+    // freeClassBitmap is set while freeLists[i] is non-empty.
+    int freeLists[MAX_FIB_CLASSES];
+    unsigned long long freeClassBitmap[FIB_BITMAP_WORDS];
+
+    NameShard nameShards[NAME_INDEX_SHARDS];
+
+    // Descriptor tables
+    BlockChunk** chunks;
+    int blockLimit;    // Descriptors handed out so far
+    int spareBlocks;   // Released descriptors, chained through nextFree
+
+    HeapEventHandler onEvent;
+    void* eventContext;
+
+    GCStats stats;
+
+    // Mark stack and bitmap, sized for blockLimit at the start of each
+    // collection
+    MarkFrame* markStack;
+    unsigned long long* markBits;
+    int markCapacity;
+
+    // Incremental collection, only outside concurrent mode. While marking,
+    // markStack holds the grey blocks.
+    int sliceBudget;           // Work per allocation; 0 when off
+    bool marking;              // A cycle is under way
+    int rootCursor;            // Next descriptor to check for root status
+    int greyCount;
+    int cycleRoots;
+    size_t liveBytes;          // Bytes in allocated blocks; not kept in concurrent mode
+
+    // Lazy sweeping, only outside concurrent mode. A collection started by
+    // an allocation leaves its descriptor chunks unswept, and allocations
+    // sweep them as they need space.
+    bool lazySweep;
+    bool sweeping;             // Some chunks are still unswept
+    int unsweptChunks;
+    int sweepFreed;
+    size_t sweepFreedSize;
+
+    // Generational collection, only outside concurrent mode. The nursery
+    // lists young blocks; an entry goes stale when its block is freed. The
+    // remembered set lists old blocks that may reference young ones.
+    size_t nurseryBytes;       // Young bytes that trigger a minor collection; 0 when off
+    int promoteAge;            // Minor collections survived before promotion
+    size_t youngBytes;
+    int* nursery;
+    int nurseryCount;
+    int nurseryCapacity;
+    int* remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+    int* minorStack;
+    int minorCapacity;
+
+    // Reference counting, only outside concurrent mode. Blocks whose count
+    // drops to zero wait on rcStack while they are freed in turn.
+    bool refCounting;
+    int* rcStack;
+    int rcCount;
+    int rcCapacity;
+
+    // Compaction after full collections that sweep
+    bool compaction;
+    bool compacting;           // Under way; guarded by the central lock
+
+    // Concurrent mode. Lock order: gcLock, thread caches, name shards, lock.
+    // gcLock also guards the list of caches.
+    bool concurrent;
+    int gcThreads;             // Collector threads; 1 collects serially
+    pthread_mutex_t lock;      // Free lists, block list and descriptor tables
+    pthread_mutex_t gcLock;
+    pthread_key_t cacheKey;
+    ThreadCache* caches;
+
+    // Trace under way, or NULL. Records are appended under traceLock, which
+    // is always taken last.
+    FILE* trace;
+    bool traceFailed;          // Some record could not be written
+    unsigned long long traceLast;    // When the last record's operation started
+    pthread_mutex_t traceLock;
+
+    // Heap image the heap was loaded from, mapped copy-on-write. The first
+    // imageChunks descriptor chunks and the loaded reference lists live in it.
+    unsigned char* image;
+    size_t imageSize;
+    int imageChunks;
+
+    // Audit ring. Writers claim a slot with a single fetch-and-add on
+    // auditNext and publish it through the slot's seq.
+    AuditSlot audit[HEAP_AUDIT_CAPACITY];
+    atomic_ullong auditNext;
+};
+
+// Locks are only taken by heaps created in concurrent mode
+#define HEAP_LOCK(heap, mutex)                                       \
+    do {                                                             \
+        if ((heap)->concurrent) pthread_mutex_lock(mutex);           \
+    } while (0)
+
+#define HEAP_UNLOCK(heap, mutex)                                     \
+    do {                                                             \
+        if ((heap)->concurrent) pthread_mutex_unlock(mutex);         \
+    } while (0)
+
+// Counters bumped outside the central lock
+#define STAT_ADD(heap, field, n) __atomic_fetch_add(&(heap)->stats.field, (n), __ATOMIC_RELAXED)
+
+// Events are only built when someone is listening
+#define EMIT(heap, ...)                                              \
+    do {                                                             \
+        if ((heap)->onEvent != NULL) {                               \
+            HeapEvent heapEvent_ = { __VA_ARGS__ };                  \
+            (heap)->onEvent(&heapEvent_, (heap)->eventContext);      \
+        }                                                            \
+    } while (0)
+
+// Splits made while compacting rebuild the layout rather than serve an
+// allocation, so they are not reported. Central lock held.
+#define EMIT_SPLIT(heap, ...)                                        \
+    do {                                                             \
+        if (!(heap)->compacting) EMIT(heap, __VA_ARGS__);            \
+    } while (0)
+
+static unsigned long long monotonicNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+static void copyName(char* dest, const char* name) {
+    if (name == NULL) {
+        dest[0] = '\0';
+        return;
+    }
+    strncpy(dest, name, 19);
+    dest[19] = '\0';
+}
+
+// Take a slot for copying. Two parties only meet on a slot when a writer is
+// a whole lap behind another or a reader is copying it out, so the wait is
+// short and rare. Returns the seq the slot held.
+static unsigned long long claimAuditSlot(AuditSlot* slot) {
+    unsigned long long seq;
+    while ((seq = atomic_exchange_explicit(&slot->seq, AUDIT_BUSY, memory_order_acquire)) == AUDIT_BUSY) {
+    }
+    return seq;
+}
+
+// Append a record to the audit ring. No allocation, no formatting; writers
+// claim distinct slots with one fetch-and-add.
+static void audit(Heap* heap, HeapAuditOp op, int block, const char* name, const char* target,
+                  size_t size, int count, bool isRoot) {
+    unsigned long long index = atomic_fetch_add_explicit(&heap->auditNext, 1, memory_order_relaxed);
+    AuditSlot* slot = &heap->audit[index & AUDIT_MASK];
+
+    unsigned long long seq = claimAuditSlot(slot);
+    if (seq > index + 1) {
+        // A writer from a later lap got here first; this record is already stale
+        atomic_store_explicit(&slot->seq, seq, memory_order_release);
+        return;
+    }
+
+    HeapAuditRecord* record = &slot->record;
+    record->timestamp = monotonicNanos();
+    record->op = (unsigned char)op;
+    record->isRoot = isRoot;
+    record->block = block;
+    record->size = size;
+    record->count = count;
+    copyName(record->name, name);
+    copyName(record->target, target);
+
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+}
+
+// Traces. A trace file is a TraceFileHeader followed by records, each a
+// TraceRecord, then argCount 64-bit arguments, then the name and target
+// bytes without terminators. The arguments by op:
+//   TRACE_ALLOC        size, handle returned (HEAP_NULL_REF for batch entries)
+//   TRACE_FREE         handle, with TRACE_HANDLES
+//   TRACE_REF_ADD      from, to handles, with TRACE_HANDLES
+//   TRACE_REF_REMOVE   from, to handles, with TRACE_HANDLES
+//   TRACE_ROOT         handle, with TRACE_HANDLES
+//   TRACE_GC           blocks freed
+//   TRACE_RESIZE       new size, then the handle with TRACE_HANDLES
+//   TRACE_ALLOC_BATCH  entry count; the TRACE_ALLOC entries follow
+//   TRACE_FREE_BATCH   entry count; the TRACE_FREE entries follow
+#define TRACE_MAGIC   "FIBTRACE"
+#define TRACE_VERSION 1
+
+typedef enum {
+    TRACE_ALLOC,
+    TRACE_FREE,
+    TRACE_REF_ADD,
+    TRACE_REF_REMOVE,
+    TRACE_ROOT,
+    TRACE_GC,
+    TRACE_RESIZE,
+    TRACE_ALLOC_BATCH,
+    TRACE_FREE_BATCH,
+    TRACE_OP_COUNT
+} TraceOpCode;
+
+// Record flags
+#define TRACE_HANDLES     0x01    // Made through the handle API
+#define TRACE_ROOT_FLAG   0x02    // isRoot
+#define TRACE_FAILED      0x04
+#define TRACE_ALIGNED     0x08    // Aligned allocation; alignShift holds log2 of the alignment
+#define TRACE_EXACT_CLASS 0x10
+
+typedef struct TraceFileHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int recordBytes;    // sizeof(TraceRecord)
+} TraceFileHeader;
+
+typedef struct TraceRecord {
+    unsigned char op;            // TraceOpCode
+    unsigned char flags;
+    unsigned char nameLength;
+    unsigned char targetLength;
+    unsigned char argCount;
+    unsigned char alignShift;
+    unsigned short reserved;
+    unsigned int gap;            // Nanoseconds since the previous record's operation started, saturated
+    unsigned int duration;       // Nanoseconds the operation took, saturated
+} TraceRecord;
+
+#define TRACE_MAX_ARGS 2
+#define TRACE_MAX_NAME 255
+
+// An operation to record
+typedef struct TraceOp {
+    TraceOpCode op;
+    unsigned char flags;
+    unsigned char alignShift;
+    const char* name;
+    const char* target;
+    int argCount;
+    unsigned long long args[TRACE_MAX_ARGS];
+} TraceOp;
+
+// When an operation starts, or 0 if nothing is being traced
+static inline unsigned long long traceStart(Heap* heap) {
+    return __atomic_load_n(&heap->trace, __ATOMIC_RELAXED) != NULL ? monotonicNanos() : 0;
+}
+
+static inline unsigned int saturate32(unsigned long long value) {
+    return value > UINT_MAX ? UINT_MAX : (unsigned int)value;
+}
+
+static size_t traceNameLength(const char* name) {
+    if (name == NULL) return 0;
+    size_t length = strlen(name);
+    return length > TRACE_MAX_NAME ? TRACE_MAX_NAME : length;
+}
+
+// Append a record. Trace lock held.
+static void traceWrite(Heap* heap, unsigned long long started, unsigned long long finished, const TraceOp* op) {
+    unsigned char buffer[sizeof(TraceRecord) + TRACE_MAX_ARGS * sizeof(unsigned long long) + 2 * TRACE_MAX_NAME];
+    size_t nameLength = traceNameLength(op->name);
+    size_t targetLength = traceNameLength(op->target);
+    TraceRecord record = {
+        .op = (unsigned char)op->op,
+        .flags = op->flags,
+        .nameLength = (unsigned char)nameLength,
+        .targetLength = (unsigned char)targetLength,
+        .argCount = (unsigned char)op->argCount,
+        .alignShift = op->alignShift,
+        .gap = saturate32(started > heap->traceLast ? started - heap->traceLast : 0),
+        .duration = saturate32(finished > started ? finished - started : 0),
+    };
+    if (started > heap->traceLast) {
+        heap->traceLast = started;
+    }
+
+    size_t length = 0;
+    memcpy(buffer, &record, sizeof(record));
+    length += sizeof(record);
+    memcpy(buffer + length, op->args, op->argCount * sizeof(unsigned long long));
+    length += op->argCount * sizeof(unsigned long long);
+    if (nameLength > 0) {
+        memcpy(buffer + length, op->name, nameLength);
+        length += nameLength;
+    }
+    if (targetLength > 0) {
+        memcpy(buffer + length, op->target, targetLength);
+        length += targetLength;
+    }
+
+    if (fwrite(buffer, 1, length, heap->trace) != length) {
+        heap->traceFailed = true;
+    }
+}
+
+static void traceRecord(Heap* heap, unsigned long long started, const TraceOp* op) {
+    unsigned long long finished = monotonicNanos();
+    HEAP_LOCK(heap, &heap->traceLock);
+    if (heap->trace != NULL) {
+        traceWrite(heap, started, finished, op);
+    }
+    HEAP_UNLOCK(heap, &heap->traceLock);
+}
+
+// Record an operation that started at started, if anything is being traced
+#define TRACE(heap, started, ...)                                    \
+    do {                                                             \
+        if ((started) != 0) {                                        \
+            TraceOp traceOp_ = { __VA_ARGS__ };                      \
+            traceRecord((heap), (started), &traceOp_);               \
+        }                                                            \
+    } while (0)
+
+// Record a batch allocation and its entries together
+static void traceAllocBatch(Heap* heap, unsigned long long started, const HeapAllocRequest* requests, int count) {
+    unsigned long long finished = monotonicNanos();
+    HEAP_LOCK(heap, &heap->traceLock);
+    if (heap->trace != NULL) {
+        TraceOp batch = { .op = TRACE_ALLOC_BATCH, .argCount = 1, .args = { (unsigned long long)count } };
+        traceWrite(heap, started, finished, &batch);
+        for (int i = 0; i < count; i++) {
+            TraceOp entry = { .op = TRACE_ALLOC, .name = requests[i].name, .argCount = 2,
+                              .args = { requests[i].size, HEAP_NULL_REF } };
+            entry.flags = (requests[i].isRoot ? TRACE_ROOT_FLAG : 0) | (requests[i].memory == NULL ? TRACE_FAILED : 0);
+            traceWrite(heap, finished, finished, &entry);
+        }
+    }
+    HEAP_UNLOCK(heap, &heap->traceLock);
+}
+
+// Record a batch free and its entries together, by name or, when names is
+// NULL, by handle. Entries are recorded as freed if statuses is NULL.
+static void traceFreeBatch(Heap* heap, unsigned long long started, char** names, const HeapRef* handles,
+                           int count, const HeapStatus* statuses) {
+    unsigned long long finished = monotonicNanos();
+    unsigned char flags = names == NULL ? TRACE_HANDLES : 0;
+    HEAP_LOCK(heap, &heap->traceLock);
+    if (heap->trace != NULL) {
+        TraceOp batch = { .op = TRACE_FREE_BATCH, .flags = flags, .argCount = 1,
+                          .args = { (unsigned long long)count } };
+        traceWrite(heap, started, finished, &batch);
+        for (int i = 0; i < count; i++) {
+            TraceOp entry = { .op = TRACE_FREE, .flags = flags };
+            if (statuses != NULL && statuses[i] != HEAP_OK) {
+                entry.flags |= TRACE_FAILED;
+            }
+            if (names != NULL) {
+                entry.name = names[i];
+            } else {
+                entry.argCount = 1;
+                entry.args[0] = handles[i];
+            }
+            traceWrite(heap, finished, finished, &entry);
+        }
+    }
+    HEAP_UNLOCK(heap, &heap->traceLock);
+}
+
+HeapStatus heapStartTrace(Heap* heap, const char* path) {
+    if (path == NULL || path[0] == '\0') return HEAP_ERR_INVALID;
+
+    // The trace under way is closed first, since it may be the same file
+    heapStopTrace(heap);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return HEAP_ERR_SYSTEM;
+    TraceFileHeader header = { .version = TRACE_VERSION, .recordBytes = sizeof(TraceRecord) };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    // Another thread may have started a trace meanwhile; this one replaces it
+    HEAP_LOCK(heap, &heap->traceLock);
+    FILE* replaced = heap->trace;
+    heap->traceFailed = false;
+    heap->traceLast = monotonicNanos();
+    __atomic_store_n(&heap->trace, file, __ATOMIC_RELAXED);
+    HEAP_UNLOCK(heap, &heap->traceLock);
+    if (replaced != NULL) {
+        fclose(replaced);
+    }
+    return HEAP_OK;
+}
+
+HeapStatus heapStopTrace(Heap* heap) {
+    HEAP_LOCK(heap, &heap->traceLock);
+    FILE* file = heap->trace;
+    bool failed = heap->traceFailed;
+    __atomic_store_n(&heap->trace, NULL, __ATOMIC_RELAXED);
+    HEAP_UNLOCK(heap, &heap->traceLock);
+
+    if (file == NULL) return HEAP_OK;
+    if (fclose(file) != 0) {
+        failed = true;
+    }
+    return failed ? HEAP_ERR_SYSTEM : HEAP_OK;
+}
+
+// Size of each Fibonacci class: 1, 2, 3, 5, 8, ... up to the 64-bit limit.
+// A class k block splits into classes k-1 and k-2.
+static const unsigned long long FIB_SIZES[MAX_FIB_CLASSES] = {
+    1ULL, 2ULL, 3ULL, 5ULL,
+    8ULL, 13ULL, 21ULL, 34ULL,
+    55ULL, 89ULL, 144ULL, 233ULL,
+    377ULL, 610ULL, 987ULL, 1597ULL,
+    2584ULL, 4181ULL, 6765ULL, 10946ULL,
+    17711ULL, 28657ULL, 46368ULL, 75025ULL,
+    121393ULL, 196418ULL, 317811ULL, 514229ULL,
+    832040ULL, 1346269ULL, 2178309ULL, 3524578ULL,
+    5702887ULL, 9227465ULL, 14930352ULL, 24157817ULL,
+    39088169ULL, 63245986ULL, 102334155ULL, 165580141ULL,
+    267914296ULL, 433494437ULL, 701408733ULL, 1134903170ULL,
+    1836311903ULL, 2971215073ULL, 4807526976ULL, 7778742049ULL,
+    12586269025ULL, 20365011074ULL, 32951280099ULL, 53316291173ULL,
+    86267571272ULL, 139583862445ULL, 225851433717ULL, 365435296162ULL,
+    591286729879ULL, 956722026041ULL, 1548008755920ULL, 2504730781961ULL,
+    4052739537881ULL, 6557470319842ULL, 10610209857723ULL, 17167680177565ULL,
+    27777890035288ULL, 44945570212853ULL, 72723460248141ULL, 117669030460994ULL,
+    190392490709135ULL, 308061521170129ULL, 498454011879264ULL, 806515533049393ULL,
+    1304969544928657ULL, 2111485077978050ULL, 3416454622906707ULL, 5527939700884757ULL,
+    8944394323791464ULL, 14472334024676221ULL, 23416728348467685ULL, 37889062373143906ULL,
+    61305790721611591ULL, 99194853094755497ULL, 160500643816367088ULL, 259695496911122585ULL,
+    420196140727489673ULL, 679891637638612258ULL, 1100087778366101931ULL, 1779979416004714189ULL,
+    2880067194370816120ULL, 4660046610375530309ULL, 7540113804746346429ULL, 12200160415121876738ULL,
+};
+
+// First class whose size is at least 2^(bits-1), indexed by bit length
+static const unsigned char FIB_CLASS_BY_BITS[65] = {
+    0, 0, 1, 3, 4, 6, 7, 9, 10, 12, 13, 15, 16, 17, 19, 20,
+    22, 23, 25, 26, 28, 29, 30, 32, 33, 35, 36, 38, 39, 41, 42, 43,
+    45, 46, 48, 49, 51, 52, 53, 55, 56, 58, 59, 61, 62, 64, 65, 66,
+    68, 69, 71, 72, 74, 75, 77, 78, 79, 81, 82, 84, 85, 87, 88, 89,
+    91,
+};
+
+// Smallest class that holds size bytes, or MAX_FIB_CLASSES if none does.
+// The bit length is a log2 estimate of the class; a factor-of-two range
+// holds at most two Fibonacci numbers, so at most two correction steps follow.
+static int fibClassFor(unsigned long long size) {
+    if (size <= 1) return 0;
+
+    int cls = FIB_CLASS_BY_BITS[64 - __builtin_clzll(size)];
+    while (cls < MAX_FIB_CLASSES && FIB_SIZES[cls] < size) {
+        cls++;
+    }
+    return cls;
+}
+
+// State byte helpers. Allocated and cached blocks belong to the thread that
+// holds them, but the central heap reads their state when it checks buddies,
+// so those accesses are atomic.
+static inline unsigned char loadBlockState(Heap* heap, int id) {
+    return __atomic_load_n(&BLK_STATE(heap, id), __ATOMIC_RELAXED);
+}
+
+static inline void storeBlockState(Heap* heap, int id, unsigned char state) {
+    __atomic_store_n(&BLK_STATE(heap, id), state, __ATOMIC_RELAXED);
+}
+
+static inline bool blockIsFree(Heap* heap, int id) {
+    return (loadBlockState(heap, id) & BLOCK_FREE) != 0;
+}
+
+static inline BuddySide blockSide(Heap* heap, int id) {
+    return (BuddySide)((loadBlockState(heap, id) >> SIDE_SHIFT) & SIDE_MASK);
+}
+
+static inline BuddySide blockInherit(Heap* heap, int id) {
+    return (BuddySide)((loadBlockState(heap, id) >> INHERIT_SHIFT) & SIDE_MASK);
+}
+
+static inline void setBlockSides(Heap* heap, int id, BuddySide side, BuddySide inherit) {
+    unsigned char flags = BLK_STATE(heap, id) & ~((SIDE_MASK << SIDE_SHIFT) | (SIDE_MASK << INHERIT_SHIFT));
+    BLK_STATE(heap, id) = flags | (side << SIDE_SHIFT) | (inherit << INHERIT_SHIFT);
+}
+
+static inline size_t blockSize(Heap* heap, int id) {
+    return (size_t)FIB_SIZES[BLK_CLASS(heap, id)];
+}
+
+static inline bool blockIsYoung(Heap* heap, int id) {
+    return (BLK_AGE(heap, id) & AGE_MASK) != 0;
+}
+
+// Free list maintenance
+static void pushFreeBlock(Heap* heap, int id) {
+    int cls = BLK_CLASS(heap, id);
+    BLK_PREV_FREE(heap, id) = NO_BLOCK;
+    BLK_NEXT_FREE(heap, id) = heap->freeLists[cls];
+    if (heap->freeLists[cls] != NO_BLOCK) {
+        BLK_PREV_FREE(heap, heap->freeLists[cls]) = id;
+    }
+    heap->freeLists[cls] = id;
+    heap->freeClassBitmap[cls / 64] |= 1ULL << (cls % 64);
+}
+
+static void removeFreeBlock(Heap* heap, int id) {
+    int cls = BLK_CLASS(heap, id);
+    int prevFree = BLK_PREV_FREE(heap, id);
+    int nextFree = BLK_NEXT_FREE(heap, id);
+
+    if (prevFree != NO_BLOCK) {
+        BLK_NEXT_FREE(heap, prevFree) = nextFree;
+    } else {
+        heap->freeLists[cls] = nextFree;
+    }
+    if (nextFree != NO_BLOCK) {
+        BLK_PREV_FREE(heap, nextFree) = prevFree;
+    }
+    BLK_PREV_FREE(heap, id) = NO_BLOCK;
+    BLK_NEXT_FREE(heap, id) = NO_BLOCK;
+    if (heap->freeLists[cls] == NO_BLOCK) {
+        heap->freeClassBitmap[cls / 64] &= ~(1ULL << (cls % 64));
+    }
+}
+
+// FNV-1a hash of a block name
+static unsigned int hashName(const char* name) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < 20 && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static NameShard* nameShard(Heap* heap, const char* name) {
+    return &heap->nameShards[hashName(name) >> (32 - NAME_INDEX_SHARD_BITS)];
+}
+
+static int indexLookup(Heap* heap, NameShard* shard, const char* name) {
+    if (shard->count == 0) return NO_BLOCK;
+
+    int mask = shard->capacity - 1;
+    int slot = hashName(name) & mask;
+    while (shard->slots[slot] != NO_BLOCK) {
+        if (strcmp(BLK_INFO(heap, shard->slots[slot]).name, name) == 0) {
+            return shard->slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NO_BLOCK;
+}
+
+static void indexInsert(Heap* heap, NameShard* shard, int id);
+
+static void growNameIndex(Heap* heap, NameShard* shard) {
+    int* oldSlots = shard->slots;
+    int oldCapacity = shard->capacity;
+
+    shard->capacity = oldCapacity == 0 ? NAME_INDEX_INITIAL_CAPACITY : oldCapacity * 2;
+    shard->slots = (int*)malloc(shard->capacity * sizeof(int));
+    memset(shard->slots, 0xff, shard->capacity * sizeof(int));
+    shard->count = 0;
+
+    for (int i = 0; i < oldCapacity; i++) {
+        if (oldSlots[i] != NO_BLOCK) {
+            indexInsert(heap, shard, oldSlots[i]);
+        }
+    }
+    free(oldSlots);
+}
+
+static void indexInsert(Heap* heap, NameShard* shard, int id) {
+    // Keep the load factor below 70% so probe sequences stay short
+    if ((shard->count + 1) * 10 > shard->capacity * 7) {
+        growNameIndex(heap, shard);
+    }
+
+    int mask = shard->capacity - 1;
+    int slot = hashName(BLK_INFO(heap, id).name) & mask;
+    while (shard->slots[slot] != NO_BLOCK) {
+        slot = (slot + 1) & mask;
+    }
+    shard->slots[slot] = id;
+    shard->count++;
+}
+
+// Remove by backward-shift deletion, so no tombstones are needed
+static void indexRemove(Heap* heap, NameShard* shard, int id) {
+    if (shard->count == 0) return;
+
+    int* index = shard->slots;
+    int mask = shard->capacity - 1;
+    int slot = hashName(BLK_INFO(heap, id).name) & mask;
+    while (index[slot] != id) {
+        if (index[slot] == NO_BLOCK) return;
+        slot = (slot + 1) & mask;
+    }
+
+    int hole = slot;
+    index[hole] = NO_BLOCK;
+    shard->count--;
+
+    for (slot = (hole + 1) & mask; index[slot] != NO_BLOCK; slot = (slot + 1) & mask) {
+        int home = hashName(BLK_INFO(heap, index[slot]).name) & mask;
+        // Move the entry back if its home lies cyclically outside (hole, slot]
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            index[hole] = index[slot];
+            index[slot] = NO_BLOCK;
+            hole = slot;
+        }
+    }
+}
+
+// Look a name up under its shard lock
+static int findBlockByName(Heap* heap, const char* name) {
+    NameShard* shard = nameShard(heap, name);
+    HEAP_LOCK(heap, &shard->lock);
+    int id = indexLookup(heap, shard, name);
+    HEAP_UNLOCK(heap, &shard->lock);
+    return id;
+}
+
+static inline HeapRef makeRef(Heap* heap, int id);
+
+// Reference to a named block, taken under its shard lock so the generation
+// read cannot race with a free. Returns false if there is no such block.
+static bool findRefByName(Heap* heap, const char* name, HeapRef* ref) {
+    NameShard* shard = nameShard(heap, name);
+    HEAP_LOCK(heap, &shard->lock);
+    int id = indexLookup(heap, shard, name);
+    if (id != NO_BLOCK) {
+        *ref = makeRef(heap, id);
+    }
+    HEAP_UNLOCK(heap, &shard->lock);
+    return id != NO_BLOCK;
+}
+
+// Take a descriptor, reusing released ones first and adding a chunk to the
+// tables when the current ones are exhausted
+static int allocBlockId(Heap* heap) {
+    int id = heap->spareBlocks;
+    if (id != NO_BLOCK) {
+        heap->spareBlocks = BLK_NEXT_FREE(heap, id);
+        return id;
+    }
+
+    id = heap->blockLimit;
+    if (BLOCK_CHUNK(heap, id) == NULL) {
+        BLOCK_CHUNK(heap, id) = (BlockChunk*)calloc(1, sizeof(BlockChunk));
+    }
+    // Published after the chunk, since handles are checked against it
+    // without the central lock
+    __atomic_store_n(&heap->blockLimit, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+static void releaseBlockId(Heap* heap, int id) {
+    storeBlockState(heap, id, BLOCK_FREE | BLOCK_SPARE);
+    BLK_NEXT_FREE(heap, id) = heap->spareBlocks;
+    heap->spareBlocks = id;
+}
+
+// Release a block's reference list. A list with no capacity still lives in
+// the heap image it was loaded from.
+static void clearReferences(BlockInfo* info) {
+    if (info->refCapacity > 0) {
+        free(info->references);
+    }
+    info->references = NULL;
+    info->numReferences = 0;
+    info->refCapacity = 0;
+}
+
+// Create a free block descriptor
+static int newBlock(Heap* heap, size_t offset, int sizeClass, BuddySide side, BuddySide inherit) {
+    int id = allocBlockId(heap);
+
+    BLK_OFFSET(heap, id) = offset;
+    BLK_CLASS(heap, id) = (unsigned char)sizeClass;
+    BLK_STATE(heap, id) = BLOCK_FREE;
+    setBlockSides(heap, id, side, inherit);
+    BLK_NEXT(heap, id) = NO_BLOCK;
+    BLK_PREV(heap, id) = NO_BLOCK;
+    BLK_NEXT_FREE(heap, id) = NO_BLOCK;
+    BLK_PREV_FREE(heap, id) = NO_BLOCK;
+
+    BlockInfo* info = &BLK_INFO(heap, id);
+    memset(info->name, 0, sizeof(info->name));
+    info->allocated_size = 0;
+    info->references = NULL;
+    info->numReferences = 0;
+    info->refCapacity = 0;
+    info->alignShift = 0;
+    return id;
+}
+
+static void releaseThreadCache(void* arg);
+static void shadeBlock(Heap* heap, int id);
+static void writeBarrier(Heap* heap, int id);
+static void rememberEdge(Heap* heap, int from, int to);
+static void linkNeighbours(Heap* heap, int prev, int next);
+
+// Carve a region into its Zeckendorf decomposition: the largest Fibonacci
+// block that fits, then the largest that fits the remainder, and so on.
+// Each of those is the root of its own buddy tree. The blocks are linked
+// after prev but not put on the free lists. Returns the last one.
+static int carveRegion(Heap* heap, const Region* region, int prev, int* blockCount) {
+    size_t remaining = region->size;
+    size_t offset = region->start;
+
+    while (remaining > 0) {
+        int cls = fibClassFor(remaining);
+        if (FIB_SIZES[cls] > remaining) cls--;
+
+        int id = newBlock(heap, offset, cls, BUDDY_TOP, BUDDY_TOP);
+        linkNeighbours(heap, prev, id);
+        prev = id;
+
+        offset += blockSize(heap, id);
+        remaining -= blockSize(heap, id);
+        (*blockCount)++;
+    }
+    return prev;
+}
+
+// Put the blocks from first to last on the free lists, the last first, so
+// takes prefer the lowest addresses
+static void pushCarved(Heap* heap, int first, int last) {
+    for (int id = last; id != NO_BLOCK; id = BLK_PREV(heap, id)) {
+        pushFreeBlock(heap, id);
+        if (id == first) break;
+    }
+}
+
+// Carve every region of an empty block list. Returns the block count.
+static int carveArena(Heap* heap) {
+    int blockCount = 0;
+    int last = NO_BLOCK;
+
+    for (int r = 0; r < heap->regionCount; r++) {
+        last = carveRegion(heap, &heap->regions[r], last, &blockCount);
+    }
+    pushCarved(heap, heap->head, last);
+    return blockCount;
+}
+
+// Regions start on this boundary; never less than HEAP_MAX_ALIGNMENT
+static size_t systemPageSize(void) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    return pageSize < HEAP_MAX_ALIGNMENT ? HEAP_MAX_ALIGNMENT : (size_t)pageSize;
+}
+
+static inline size_t roundToPage(Heap* heap, size_t size) {
+    return (size + heap->pageSize - 1) & ~(heap->pageSize - 1);
+}
+
+// A heap with no regions or blocks yet and the first committed bytes of its
+// arena mapped. The arena is mapped, so it starts on a page boundary and
+// offsets aligned to HEAP_MAX_ALIGNMENT or less are aligned addresses.
+static Heap* newHeap(size_t committed, size_t maxMemory, bool concurrent) {
+    Heap* heap = (Heap*)calloc(1, sizeof(Heap));
+    if (heap == NULL) return NULL;
+
+    heap->pageSize = systemPageSize();
+    heap->maxMemory = maxMemory < committed ? committed : maxMemory;
+    heap->reserved = roundToPage(heap, heap->maxMemory > 0 ? heap->maxMemory : 1);
+    heap->mappedEnd = roundToPage(heap, committed);
+
+    void* arena = mmap(NULL, heap->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        free(heap);
+        return NULL;
+    }
+    if (heap->mappedEnd > 0 && mprotect(arena, heap->mappedEnd, PROT_READ | PROT_WRITE) != 0) {
+        munmap(arena, heap->reserved);
+        free(heap);
+        return NULL;
+    }
+    heap->arena = (unsigned char*)arena;
+    heap->head = NO_BLOCK;
+    heap->chunks = (BlockChunk**)calloc(MAX_BLOCK_CHUNKS, sizeof(BlockChunk*));
+    heap->spareBlocks = NO_BLOCK;
+    atomic_init(&heap->auditNext, 0);
+    for (int i = 0; i < MAX_FIB_CLASSES; i++) {
+        heap->freeLists[i] = NO_BLOCK;
+    }
+
+    heap->concurrent = concurrent;
+    heap->gcThreads = 1;
+    pthread_mutex_init(&heap->lock, NULL);
+    pthread_mutex_init(&heap->gcLock, NULL);
+    pthread_mutex_init(&heap->traceLock, NULL);
+    for (int i = 0; i < NAME_INDEX_SHARDS; i++) {
+        pthread_mutex_init(&heap->nameShards[i].lock, NULL);
+    }
+    if (concurrent && pthread_key_create(&heap->cacheKey, releaseThreadCache) != 0) {
+        heap->concurrent = false;
+        destroyHeap(heap);
+        return NULL;
+    }
+    return heap;
+}
+
+// Initialize heap, with its first region free
+static Heap* createHeap(size_t totalMemory, size_t maxMemory, bool concurrent) {
+    Heap* heap = newHeap(totalMemory, maxMemory, concurrent);
+    if (heap == NULL) return NULL;
+
+    heap->totalMemory = totalMemory;
+    heap->regions[0] = (Region){ 0, totalMemory, false };
+    heap->regionCount = 1;
+    int blockCount = carveArena(heap);
+    audit(heap, HEAP_AUDIT_INIT, NO_BLOCK, NULL, NULL, totalMemory, blockCount, false);
+    return heap;
+}
+
+Heap* initializeHeap(size_t totalMemory) {
+    return createHeap(totalMemory, totalMemory, false);
+}
+
+Heap* initializeConcurrentHeap(size_t totalMemory) {
+    return createHeap(totalMemory, totalMemory, true);
+}
+
+Heap* initializeGrowableHeap(size_t initialMemory, size_t maxMemory, bool concurrent) {
+    return createHeap(initialMemory, maxMemory, concurrent);
+}
+
+void destroyHeap(Heap* heap) {
+    heapStopTrace(heap);
+    if (heap->concurrent) {
+        pthread_key_delete(heap->cacheKey);
+    }
+    while (heap->caches != NULL) {
+        ThreadCache* cache = heap->caches;
+        heap->caches = cache->next;
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+
+    for (int id = 0; id < heap->blockLimit; id++) {
+        clearReferences(&BLK_INFO(heap, id));
+    }
+    for (int i = heap->imageChunks; i < MAX_BLOCK_CHUNKS && heap->chunks[i] != NULL; i++) {
+        free(heap->chunks[i]);
+    }
+    free(heap->chunks);
+    if (heap->image != NULL) {
+        munmap(heap->image, heap->imageSize);
+    }
+    free(heap->markStack);
+    free(heap->markBits);
+    free(heap->nursery);
+    free(heap->remembered);
+    free(heap->minorStack);
+    free(heap->rcStack);
+    for (int i = 0; i < NAME_INDEX_SHARDS; i++) {
+        free(heap->nameShards[i].slots);
+        pthread_mutex_destroy(&heap->nameShards[i].lock);
+    }
+    pthread_mutex_destroy(&heap->lock);
+    pthread_mutex_destroy(&heap->gcLock);
+    pthread_mutex_destroy(&heap->traceLock);
+    munmap(heap->arena, heap->reserved);
+    free(heap);
+}
+
+void heapSetEventHandler(Heap* heap, HeapEventHandler handler, void* context) {
+    heap->onEvent = handler;
+    heap->eventContext = context;
+}
+
+void heapSetGCThreads(Heap* heap, int threads) {
+    heap->gcThreads = threads < 1 ? 1 : threads;
+}
+
+void heapSetLazySweep(Heap* heap, bool lazy) {
+    heap->lazySweep = lazy && !heap->concurrent;
+}
+
+static void tenureAll(Heap* heap);
+
+void heapSetGenerational(Heap* heap, size_t nurseryBytes, int promoteAge) {
+    if (heap->concurrent) return;
+
+    if (nurseryBytes == 0) {
+        tenureAll(heap);
+        heap->nurseryBytes = 0;
+        return;
+    }
+    heap->nurseryBytes = nurseryBytes;
+    heap->promoteAge = promoteAge < 1 ? 1 : promoteAge > MAX_PROMOTE_AGE ? MAX_PROMOTE_AGE : promoteAge;
+}
+
+void heapSetCompaction(Heap* heap, bool enabled) {
+    heap->compaction = enabled;
+}
+
+void heapSetIncrementalGC(Heap* heap, int sliceBudget) {
+    if (heap->concurrent) return;
+
+    heap->sliceBudget = sliceBudget < 0 ? 0 : sliceBudget;
+    if (heap->sliceBudget == 0) {
+        heap->marking = false;
+    }
+}
+
+// Heap walking for callers outside the core
+int heapFirstBlock(Heap* heap) {
+    return heap->head;
+}
+
+int heapNextBlock(Heap* heap, int block) {
+    return BLK_NEXT(heap, block);
+}
+
+void heapInspectBlock(Heap* heap, int block, HeapBlockView* view) {
+    BlockInfo* info = &BLK_INFO(heap, block);
+    unsigned char state = BLK_STATE(heap, block);
+
+    view->name = info->name;
+    view->offset = BLK_OFFSET(heap, block);
+    view->size = blockSize(heap, block);
+    view->allocatedSize = info->allocated_size;
+    view->isFree = (state & (BLOCK_FREE | BLOCK_CACHED)) != 0;
+    view->isRoot = (state & BLOCK_ROOT) != 0;
+    view->numReferences = info->numReferences;
+    view->references = info->references;
+}
+
+// References hold the target's id in the low 32 bits and its generation
+// in the high 32
+static inline HeapRef makeRef(Heap* heap, int id) {
+    return ((HeapRef)BLK_GEN(heap, id) << 32) | (unsigned int)id;
+}
+
+// The allocated block a reference points to, or NO_BLOCK if it was freed
+static inline int resolveRef(Heap* heap, HeapRef ref) {
+    unsigned int id = (unsigned int)(ref & 0xffffffffu);
+    if (id >= (unsigned int)heap->blockLimit || BLK_GEN(heap, id) != (unsigned int)(ref >> 32)) return NO_BLOCK;
+    return (int)id;
+}
+
+// The allocated block a handle names, or NO_BLOCK. In concurrent mode the
+// block may be freed at any moment, so callers that act on it check again
+// under its shard lock.
+static inline int resolveHandle(Heap* heap, HeapRef handle) {
+    unsigned int id = (unsigned int)(handle & 0xffffffffu);
+    if (id >= (unsigned int)__atomic_load_n(&heap->blockLimit, __ATOMIC_ACQUIRE)) return NO_BLOCK;
+    if (__atomic_load_n(&BLK_GEN(heap, id), __ATOMIC_RELAXED) != (unsigned int)(handle >> 32)) return NO_BLOCK;
+    if (__atomic_load_n(&BLK_STATE(heap, id), __ATOMIC_RELAXED) & (BLOCK_FREE | BLOCK_CACHED)) return NO_BLOCK;
+    return (int)id;
+}
+
+// Shard guarding an allocated block: its name's, or one picked by id for
+// unnamed blocks
+static inline NameShard* blockShard(Heap* heap, int id) {
+    return &heap->nameShards[__atomic_load_n(&BLK_INFO(heap, id).shard, __ATOMIC_RELAXED)];
+}
+
+// Lock the shard of the block a handle names. Returns the block, with its
+// shard locked and stored in *shard, or NO_BLOCK with nothing locked.
+static int lockHandle(Heap* heap, HeapRef handle, NameShard** shard) {
+    int id = resolveHandle(heap, handle);
+    if (id == NO_BLOCK) return NO_BLOCK;
+
+    *shard = blockShard(heap, id);
+    HEAP_LOCK(heap, &(*shard)->lock);
+    // Blocks are freed under their shard lock, so a handle still valid
+    // here stays valid until the shard is unlocked
+    if (resolveHandle(heap, handle) != id) {
+        HEAP_UNLOCK(heap, &(*shard)->lock);
+        return NO_BLOCK;
+    }
+    return id;
+}
+
+const char* heapRefName(Heap* heap, HeapRef ref) {
+    int id = resolveRef(heap, ref);
+    return id == NO_BLOCK ? NULL : BLK_INFO(heap, id).name;
+}
+
+void* heapHandleMemory(Heap* heap, HeapRef handle) {
+    int id = resolveHandle(heap, handle);
+    return id == NO_BLOCK ? NULL : heap->arena + BLK_OFFSET(heap, id);
+}
+
+// Slots already overwritten by a later lap are skipped
+int heapAuditRead(Heap* heap, HeapAuditRecord* records, int max) {
+    unsigned long long next = atomic_load_explicit(&heap->auditNext, memory_order_acquire);
+    unsigned long long oldest = next > HEAP_AUDIT_CAPACITY ? next - HEAP_AUDIT_CAPACITY : 0;
+    int copied = 0;
+
+    for (unsigned long long index = next; index > oldest && copied < max; index--) {
+        AuditSlot* slot = &heap->audit[(index - 1) & AUDIT_MASK];
+
+        unsigned long long seq = claimAuditSlot(slot);
+        if (seq == index) {
+            records[copied++] = slot->record;
+        }
+        atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    }
+    return copied;
+}
+
+unsigned long long heapAuditTotal(Heap* heap) {
+    return atomic_load_explicit(&heap->auditNext, memory_order_acquire);
+}
+
+size_t heapTotalMemory(Heap* heap) {
+    return heap->totalMemory;
+}
+
+const GCStats* heapGetStats(Heap* heap) {
+    return &heap->stats;
+}
+
+// Locate a block's buddy by address arithmetic. The buddy of a LEFT block of
+// class k starts F(k) bytes after it with class k-1; the buddy of a RIGHT
+// block of class k starts F(k+1) bytes before it with class k+1. Since blocks
+// tile the arena, that address is always the block's neighbour in the list;
+// it is the buddy only if it is that exact, unsplit block.
+static int findBuddy(Heap* heap, int id) {
+    int cls = BLK_CLASS(heap, id);
+    BuddySide side = blockSide(heap, id);
+
+    if (side == BUDDY_LEFT) {
+        int buddy = BLK_NEXT(heap, id);
+        if (buddy != NO_BLOCK && blockSide(heap, buddy) == BUDDY_RIGHT &&
+            BLK_CLASS(heap, buddy) == cls - 1 &&
+            BLK_OFFSET(heap, buddy) == BLK_OFFSET(heap, id) + FIB_SIZES[cls]) {
+            return buddy;
+        }
+    } else if (side == BUDDY_RIGHT) {
+        int buddy = BLK_PREV(heap, id);
+        if (buddy != NO_BLOCK && blockSide(heap, buddy) == BUDDY_LEFT &&
+            BLK_CLASS(heap, buddy) == cls + 1 &&
+            BLK_OFFSET(heap, buddy) == BLK_OFFSET(heap, id) - FIB_SIZES[cls + 1]) {
+            return buddy;
+        }
+    }
+    return NO_BLOCK;
+}
+
+// Fold a free RIGHT block back into its free LEFT buddy, restoring the
+// parent block. Both must already be off their free lists.
+static void mergeBuddies(Heap* heap, int left, int right) {
+    BLK_CLASS(heap, left)++;
+    setBlockSides(heap, left, blockInherit(heap, left), blockInherit(heap, right));
+
+    int next = BLK_NEXT(heap, right);
+    BLK_NEXT(heap, left) = next;
+    if (next != NO_BLOCK) {
+        BLK_PREV(heap, next) = left;
+    }
+    releaseBlockId(heap, right);
+}
+
+// Coalesce a free block with its buddy for as long as the buddy is free,
+// walking up the buddy tree. Only the block's neighbours are examined, so a
+// free costs at most one step per tree level. Returns the merged block.
+static int coalesceBlock(Heap* heap, int id, int* mergeCount) {
+    int buddy = findBuddy(heap, id);
+
+    while (buddy != NO_BLOCK && blockIsFree(heap, buddy)) {
+        int left = blockSide(heap, id) == BUDDY_LEFT ? id : buddy;
+        int right = blockSide(heap, id) == BUDDY_LEFT ? buddy : id;
+        size_t oldSize1 = blockSize(heap, left);
+        size_t oldSize2 = blockSize(heap, right);
+
+        removeFreeBlock(heap, left);
+        removeFreeBlock(heap, right);
+        mergeBuddies(heap, left, right);
+        pushFreeBlock(heap, left);
+
+        EMIT(heap, .type = HEAP_EVENT_MERGE, .size = oldSize1, .otherSize = oldSize2);
+
+        (*mergeCount)++;
+        id = left;
+        buddy = findBuddy(heap, id);
+    }
+    return id;
+}
+
+static void reportMerges(Heap* heap, int mergeCount) {
+    if (mergeCount > 0) {
+        audit(heap, HEAP_AUDIT_MERGE, NO_BLOCK, NULL, NULL, 0, mergeCount, false);
+        EMIT(heap, .type = HEAP_EVENT_COALESCED, .count = mergeCount);
+    }
+}
+
+// Merge all free buddies. A single pass in address order is
+// enough: coalescing a block also folds it into any earlier block that was
+// waiting for it as a buddy.
+static void mergeBlock(Heap* heap) {
+    int mergeCount = 0;
+
+    for (int id = heap->head; id != NO_BLOCK; id = BLK_NEXT(heap, id)) {
+        if (blockIsFree(heap, id)) {
+            id = coalesceBlock(heap, id, &mergeCount);
+        }
+    }
+    
+    reportMerges(heap, mergeCount);
+}
+
+// Split a block down to targetClass. We keep descending into the smallest half that
+// still holds targetClass and return it; the other halves go back on the
+// free lists. Blocks of size 1 and 2 are never split. The block must already
+// be off its free list.
+static int splitBlock(Heap* heap, int id, int targetClass) {
+    if (id == NO_BLOCK || BLK_CLASS(heap, id) <= targetClass || BLK_CLASS(heap, id) < 2) return id;
+
+    EMIT_SPLIT(heap, .type = HEAP_EVENT_SPLIT, .size = blockSize(heap, id));
+
+    while (BLK_CLASS(heap, id) > targetClass && BLK_CLASS(heap, id) >= 2) {
+        int cls = BLK_CLASS(heap, id);
+        int right = newBlock(heap, BLK_OFFSET(heap, id) + FIB_SIZES[cls - 1], cls - 2,
+                             BUDDY_RIGHT, blockInherit(heap, id));
+
+        int next = BLK_NEXT(heap, id);
+        BLK_PREV(heap, right) = id;
+        BLK_NEXT(heap, right) = next;
+        if (next != NO_BLOCK) {
+            BLK_PREV(heap, next) = right;
+        }
+        BLK_NEXT(heap, id) = right;
+
+        setBlockSides(heap, id, BUDDY_LEFT, blockSide(heap, id));
+        BLK_CLASS(heap, id) = (unsigned char)(cls - 1);
+
+        if (cls - 2 >= targetClass) {
+            pushFreeBlock(heap, id);
+            EMIT_SPLIT(heap, .type = HEAP_EVENT_SPLIT_FREE, .size = blockSize(heap, id));
+            id = right;
+        } else {
+            pushFreeBlock(heap, right);
+            EMIT_SPLIT(heap, .type = HEAP_EVENT_SPLIT_FREE, .size = blockSize(heap, right));
+        }
+    }
+    return id;
+}
+
+// Best fit is the head of the first non-empty free list at or above the
+// requested class, so the search costs one probe per bitmap word.
+static int findBestFit_by_buddy_system(Heap* heap, int cls) {
+    if (cls >= MAX_FIB_CLASSES) return NO_BLOCK;
+
+    for (int word = cls / 64; word < FIB_BITMAP_WORDS; word++) {
+        unsigned long long candidates = heap->freeClassBitmap[word];
+        if (word == cls / 64) {
+            candidates &= ~0ULL << (cls % 64);
+        }
+        if (candidates != 0) {
+            return heap->freeLists[word * 64 + __builtin_ctzll(candidates)];
+        }
+    }
+    return NO_BLOCK;
+}
+
+// Put a free block back on its free list and coalesce it. Central lock held.
+static void returnBlock(Heap* heap, int id, int* mergeCount) {
+    BLK_STATE(heap, id) = (BLK_STATE(heap, id) & ~(BLOCK_ROOT | BLOCK_CACHED)) | BLOCK_FREE;
+    pushFreeBlock(heap, id);
+    coalesceBlock(heap, id, mergeCount);
+}
+
+// Take up to CACHE_BATCH blocks of class cls from the central free lists
+static void refillCache(Heap* heap, ThreadCache* cache, int cls) {
+    HEAP_LOCK(heap, &heap->lock);
+    while (cache->count[cls] < CACHE_BATCH) {
+        int id = findBestFit_by_buddy_system(heap, cls);
+        if (id == NO_BLOCK) break;
+
+        removeFreeBlock(heap, id);
+        id = splitBlock(heap, id, cls);
+        BLK_STATE(heap, id) = (BLK_STATE(heap, id) & ~BLOCK_FREE) | BLOCK_CACHED;
+        cache->blocks[cls][cache->count[cls]++] = id;
+    }
+    HEAP_UNLOCK(heap, &heap->lock);
+}
+
+// Move up to n cached blocks of class cls back to the central free lists.
+// Central lock held.
+static void flushCache(Heap* heap, ThreadCache* cache, int cls, int n) {
+    int mergeCount = 0;
+
+    while (n-- > 0 && cache->count[cls] > 0) {
+        returnBlock(heap, cache->blocks[cls][--cache->count[cls]], &mergeCount);
+    }
+    reportMerges(heap, mergeCount);
+}
+
+static void flushAllCaches(Heap* heap) {
+    for (ThreadCache* cache = heap->caches; cache != NULL; cache = cache->next) {
+        for (int cls = 0; cls < CACHE_CLASSES; cls++) {
+            flushCache(heap, cache, cls, CACHE_CAPACITY);
+        }
+    }
+}
+
+// Lock the calling thread's cache, creating it on first use. *cache is left
+// NULL for heaps not in concurrent mode. Returns false if no cache could be
+// created.
+static bool acquireCache(Heap* heap, ThreadCache** cache) {
+    *cache = NULL;
+    if (!heap->concurrent) return true;
+
+    ThreadCache* own = (ThreadCache*)pthread_getspecific(heap->cacheKey);
+    if (own == NULL) {
+        own = (ThreadCache*)calloc(1, sizeof(ThreadCache));
+        if (own == NULL) return false;
+        pthread_mutex_init(&own->lock, NULL);
+        own->heap = heap;
+
+        pthread_mutex_lock(&heap->gcLock);
+        own->next = heap->caches;
+        heap->caches = own;
+        pthread_mutex_unlock(&heap->gcLock);
+
+        pthread_setspecific(heap->cacheKey, own);
+    }
+
+    pthread_mutex_lock(&own->lock);
+    *cache = own;
+    return true;
+}
+
+static void releaseCache(ThreadCache* cache) {
+    if (cache != NULL) {
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+// Thread exit: hand the cached blocks back and drop the cache
+static void releaseThreadCache(void* arg) {
+    ThreadCache* cache = (ThreadCache*)arg;
+    Heap* heap = cache->heap;
+
+    pthread_mutex_lock(&heap->gcLock);
+    pthread_mutex_lock(&heap->lock);
+    for (int cls = 0; cls < CACHE_CLASSES; cls++) {
+        flushCache(heap, cache, cls, CACHE_CAPACITY);
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    for (ThreadCache** link = &heap->caches; *link != NULL; link = &(*link)->next) {
+        if (*link == cache) {
+            *link = cache->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&heap->gcLock);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// With gcLock and every cache lock held no operation is in flight, since
+// each one holds its thread's cache lock from start to finish
+static void stopTheWorld(Heap* heap) {
+    if (!heap->concurrent) return;
+
+    pthread_mutex_lock(&heap->gcLock);
+    for (ThreadCache* cache = heap->caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+    }
+    pthread_mutex_lock(&heap->lock);
+}
+
+static void resumeTheWorld(Heap* heap) {
+    if (!heap->concurrent) return;
+
+    pthread_mutex_unlock(&heap->lock);
+    for (ThreadCache* cache = heap->caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_unlock(&cache->lock);
+    }
+    pthread_mutex_unlock(&heap->gcLock);
+}
+
+// Take a block of class cls off the central free lists, splitting as needed.
+// Central lock held.
+static int takeFreeBlock(Heap* heap, int cls) {
+    int id = findBestFit_by_buddy_system(heap, cls);
+    if (id != NO_BLOCK) {
+        removeFreeBlock(heap, id);
+        id = splitBlock(heap, id, cls);
+        // Clear the free bit before unlocking so no one coalesces with it
+        storeBlockState(heap, id, BLK_STATE(heap, id) & ~BLOCK_FREE);
+    }
+    return id;
+}
+
+// Placement constraints of an allocation. Takes without one go anywhere.
+typedef struct Placement {
+    size_t alignment;  // Power of two
+    bool exactClass;   // Only blocks already of the requested class
+} Placement;
+
+// Offset of a descendant of the block at offset with class cls that starts
+// on an alignment boundary and can be split down to class target, or
+// NO_OFFSET.
+// The left half of a block starts where it does, so only the right halves
+// along its chain of left halves can start anywhere new; regions with no
+// boundary that leaves room for class target are skipped.
+static size_t alignedOffset(size_t offset, int cls, int target, size_t alignment) {
+    while (cls >= target) {
+        size_t aligned = (offset + alignment - 1) & ~(alignment - 1);
+        if (aligned + FIB_SIZES[target] > offset + FIB_SIZES[cls]) return NO_OFFSET;
+        if (aligned == offset) return offset;
+        if (cls < 2) return NO_OFFSET;
+
+        size_t found = alignedOffset(offset + FIB_SIZES[cls - 1], cls - 2, target, alignment);
+        if (found != NO_OFFSET) return found;
+        cls--;
+    }
+    return NO_OFFSET;
+}
+
+// Split a free block, already off its free list, down to the class target
+// block at offset, putting every half not on the way back on the free lists
+static int splitToward(Heap* heap, int id, size_t offset, int targetClass) {
+    if (BLK_CLASS(heap, id) <= targetClass || BLK_CLASS(heap, id) < 2) return id;
+
+    EMIT_SPLIT(heap, .type = HEAP_EVENT_SPLIT, .size = blockSize(heap, id));
+
+    while (BLK_CLASS(heap, id) > targetClass && BLK_CLASS(heap, id) >= 2) {
+        int cls = BLK_CLASS(heap, id);
+        size_t rightOffset = BLK_OFFSET(heap, id) + FIB_SIZES[cls - 1];
+        int right = newBlock(heap, rightOffset, cls - 2, BUDDY_RIGHT, blockInherit(heap, id));
+
+        int next = BLK_NEXT(heap, id);
+        BLK_PREV(heap, right) = id;
+        BLK_NEXT(heap, right) = next;
+        if (next != NO_BLOCK) {
+            BLK_PREV(heap, next) = right;
+        }
+        BLK_NEXT(heap, id) = right;
+
+        setBlockSides(heap, id, BUDDY_LEFT, blockSide(heap, id));
+        BLK_CLASS(heap, id) = (unsigned char)(cls - 1);
+
+        int spare = offset >= rightOffset ? id : right;
+        pushFreeBlock(heap, spare);
+        EMIT_SPLIT(heap, .type = HEAP_EVENT_SPLIT_FREE, .size = blockSize(heap, spare));
+        if (spare == id) {
+            id = right;
+        }
+    }
+    return id;
+}
+
+// Take a block of class cls that satisfies a placement off the central free
+// lists, preferring the smallest class that has one. Central lock held.
+static int takePlacedBlock(Heap* heap, int cls, const Placement* placement) {
+    int lastClass = placement->exactClass ? cls : MAX_FIB_CLASSES - 1;
+
+    for (int c = cls; c <= lastClass; c++) {
+        if (!(heap->freeClassBitmap[c / 64] & (1ULL << (c % 64)))) continue;
+
+        for (int id = heap->freeLists[c]; id != NO_BLOCK; id = BLK_NEXT_FREE(heap, id)) {
+            size_t offset = alignedOffset(BLK_OFFSET(heap, id), c, cls, placement->alignment);
+            if (offset == NO_OFFSET) continue;
+
+            removeFreeBlock(heap, id);
+            id = splitToward(heap, id, offset, cls);
+            storeBlockState(heap, id, BLK_STATE(heap, id) & ~BLOCK_FREE);
+            return id;
+        }
+    }
+    return NO_BLOCK;
+}
+
+// Take a free block of class cls for an allocation: from the thread's cache
+// for small classes, otherwise from the central free lists. Blocks with a
+// placement always come from the central free lists.
+static int takeBlock(Heap* heap, ThreadCache* cache, int cls, const Placement* placement) {
+    if (cls >= MAX_FIB_CLASSES) return NO_BLOCK;
+
+    if (placement != NULL) {
+        HEAP_LOCK(heap, &heap->lock);
+        int id = takePlacedBlock(heap, cls, placement);
+        HEAP_UNLOCK(heap, &heap->lock);
+        return id;
+    }
+
+    if (cache != NULL && cls < CACHE_CLASSES) {
+        if (cache->count[cls] == 0) {
+            refillCache(heap, cache, cls);
+        }
+        return cache->count[cls] > 0 ? cache->blocks[cls][--cache->count[cls]] : NO_BLOCK;
+    }
+
+    HEAP_LOCK(heap, &heap->lock);
+    int id = takeFreeBlock(heap, cls);
+    HEAP_UNLOCK(heap, &heap->lock);
+    return id;
+}
+
+// Give a block the caller owns back: to the thread's cache for small
+// classes, flushing a batch to the central heap when the cache is full;
+// otherwise straight onto the free lists, coalescing with its buddies.
+static void putBlock(Heap* heap, ThreadCache* cache, int id) {
+    int cls = BLK_CLASS(heap, id);
+
+    if (cache != NULL && cls < CACHE_CLASSES) {
+        if (cache->count[cls] == CACHE_CAPACITY) {
+            HEAP_LOCK(heap, &heap->lock);
+            flushCache(heap, cache, cls, CACHE_BATCH);
+            HEAP_UNLOCK(heap, &heap->lock);
+        }
+        storeBlockState(heap, id, (BLK_STATE(heap, id) & ~(BLOCK_FREE | BLOCK_ROOT)) | BLOCK_CACHED);
+        cache->blocks[cls][cache->count[cls]++] = id;
+        return;
+    }
+
+    int mergeCount = 0;
+    HEAP_LOCK(heap, &heap->lock);
+    returnBlock(heap, id, &mergeCount);
+    reportMerges(heap, mergeCount);
+    HEAP_UNLOCK(heap, &heap->lock);
+}
+
+static bool reserveIds(int** ids, int* capacity, int count) {
+    if (count <= *capacity) return true;
+
+    int newCapacity = *capacity == 0 ? 256 : *capacity;
+    while (newCapacity < count) newCapacity *= 2;
+
+    int* grown = (int*)realloc(*ids, newCapacity * sizeof(int));
+    if (grown == NULL) return false;
+    *ids = grown;
+    *capacity = newCapacity;
+    return true;
+}
+
+// Drop a block's name data and invalidate references to it. The block must
+// already be out of the name index.
+static void resetBlockInfo(Heap* heap, int id) {
+    BlockInfo* info = &BLK_INFO(heap, id);
+
+    // Handles are checked without a lock before their shard is taken
+    __atomic_fetch_add(&BLK_GEN(heap, id), 1, __ATOMIC_RELAXED);
+    BLK_AGE(heap, id) = 0;
+    info->refCount = 0;
+    clearReferences(info);
+    memset(info->name, 0, sizeof(info->name));
+    info->allocated_size = 0;
+    info->alignShift = 0;
+}
+
+// Return an unreachable block to its free list. The caller coalesces.
+// Only used while the world is stopped.
+static void dropReferences(Heap* heap, int id, bool cascade);
+
+static void releaseBlock(Heap* heap, int id) {
+    if (heap->refCounting) {
+        dropReferences(heap, id, false);
+    }
+    indexRemove(heap, nameShard(heap, BLK_INFO(heap, id).name), id);
+    if (blockIsYoung(heap, id)) {
+        heap->youngBytes -= blockSize(heap, id);
+    }
+    resetBlockInfo(heap, id);
+
+    BLK_STATE(heap, id) = (BLK_STATE(heap, id) & ~BLOCK_ROOT) | BLOCK_FREE;
+    pushFreeBlock(heap, id);
+}
+
+// Reference counting. Each block counts the other live blocks that
+// reference it.
+// A block whose count drops to zero while it is not a root is freed on the
+// spot, and the blocks it referenced are released in turn. Cycles never
+// reach zero and are left to the tracing collector. Counts err only on the
+// high side: if the stack of blocks to free cannot grow, they simply wait
+// for the next collection.
+static void recountReferences(Heap* heap) {
+    for (int id = 0; id < heap->blockLimit; id++) {
+        BLK_INFO(heap, id).refCount = 0;
+    }
+    for (int id = 0; id < heap->blockLimit; id++) {
+        if (BLK_STATE(heap, id) & (BLOCK_FREE | BLOCK_CACHED | BLOCK_SPARE)) continue;
+
+        BlockInfo* info = &BLK_INFO(heap, id);
+        for (int i = 0; i < info->numReferences; i++) {
+            int target = resolveRef(heap, info->references[i]);
+            if (target != NO_BLOCK && target != id) {
+                BLK_INFO(heap, target).refCount++;
+            }
+        }
+    }
+}
+
+void heapSetRefCounting(Heap* heap, bool enabled) {
+    if (heap->concurrent) return;
+
+    if (enabled && !heap->refCounting) {
+        recountReferences(heap);
+    }
+    heap->refCounting = enabled;
+}
+
+// Queue a block for freeing if nothing references it and it is not a root
+static void releaseIfUnreferenced(Heap* heap, int id) {
+    if (BLK_INFO(heap, id).refCount > 0 || (BLK_STATE(heap, id) & (BLOCK_FREE | BLOCK_ROOT))) return;
+    if (!reserveIds(&heap->rcStack, &heap->rcCapacity, heap->rcCount + 1)) return;
+
+    heap->rcStack[heap->rcCount++] = id;
+}
+
+// Uncount the references a block is about to lose
+static void dropReferences(Heap* heap, int id, bool cascade) {
+    BlockInfo* info = &BLK_INFO(heap, id);
+
+    for (int i = 0; i < info->numReferences; i++) {
+        int target = resolveRef(heap, info->references[i]);
+        if (target == NO_BLOCK || target == id) continue;
+
+        BLK_INFO(heap, target).refCount--;
+        if (cascade) {
+            releaseIfUnreferenced(heap, target);
+        }
+    }
+}
+
+// Free every queued block. A block can be queued twice, once by each of its
+// last two referrers; the second entry finds it free.
+static void freeUnreferenced(Heap* heap) {
+    while (heap->rcCount > 0) {
+        int id = heap->rcStack[--heap->rcCount];
+        if (BLK_INFO(heap, id).refCount > 0 || (BLK_STATE(heap, id) & (BLOCK_FREE | BLOCK_ROOT))) continue;
+
+        BlockInfo* info = &BLK_INFO(heap, id);
+        size_t size = blockSize(heap, id);
+        EMIT(heap, .type = HEAP_EVENT_RC_FREE, .name = info->name, .size = size);
+        audit(heap, HEAP_AUDIT_RC_FREE, id, info->name, NULL, size, 0, false);
+
+        dropReferences(heap, id, true);
+        indexRemove(heap, nameShard(heap, info->name), id);
+        heap->liveBytes -= size;
+        if (blockIsYoung(heap, id)) {
+            heap->youngBytes -= size;
+        }
+        resetBlockInfo(heap, id);
+        heap->stats.totalRefCountFrees++;
+
+        putBlock(heap, NULL, id);
+    }
+}
+
+// Add a reference between two blocks. The shard of fromName is locked.
+static HeapStatus linkBlocks(Heap* heap, int fromBlock, bool toExists, HeapRef ref, char* fromName, char* toName) {
+    if (fromBlock == NO_BLOCK) {
+        EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_NOT_FOUND, .name = fromName, .target = toName);
+        return HEAP_ERR_NOT_FOUND;
+    }
+    
+    if (!toExists) {
+        EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_NOT_FOUND, .name = toName, .target = toName);
+        return HEAP_ERR_NOT_FOUND;
+    }
+
+    BlockInfo* from = &BLK_INFO(heap, fromBlock);
+    
+    for (int i = 0; i < from->numReferences; i++) {
+        if (from->references[i] == ref) {
+            EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_REF_EXISTS, .name = fromName, .target = toName);
+            return HEAP_ERR_REF_EXISTS;
+        }
+    }
+    
+    if (from->numReferences >= from->refCapacity) {
+        // A list loaded from an image is copied out on its first growth
+        int newCapacity = from->refCapacity > 0 ? from->refCapacity * 2 : from->numReferences + 4;
+        HeapRef* newRefs = (HeapRef*)(from->refCapacity > 0 ? realloc(from->references, newCapacity * sizeof(HeapRef))
+                                                            : malloc(newCapacity * sizeof(HeapRef)));
+        if (newRefs == NULL) {
+            EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_SYSTEM, .name = fromName, .target = toName);
+            return HEAP_ERR_SYSTEM;
+        }
+        if (from->refCapacity == 0 && from->numReferences > 0) {
+            memcpy(newRefs, from->references, from->numReferences * sizeof(HeapRef));
+        }
+        from->references = newRefs;
+        from->refCapacity = newCapacity;
+    }
+    
+    from->references[from->numReferences++] = ref;
+    
+    audit(heap, HEAP_AUDIT_REF_ADD, fromBlock, fromName, toName, 0, 0, false);
+    EMIT(heap, .type = HEAP_EVENT_REF_ADD, .name = fromName, .target = toName);
+    return HEAP_OK;
+}
+
+// Bookkeeping after a reference is added: the remembered set, reference
+// counts and the write barrier. The target may have been reachable only
+// from blocks the incremental mark has not scanned yet, or be garbage the
+// lazy sweep has not reached.
+static void referenceAdded(Heap* heap, int fromBlock, HeapRef ref) {
+    // None of these run in concurrent mode
+    if (heap->concurrent) return;
+
+    int target = resolveRef(heap, ref);
+
+    if (heap->nurseryBytes > 0) {
+        rememberEdge(heap, fromBlock, target);
+    }
+    if (heap->refCounting && target != fromBlock) {
+        BLK_INFO(heap, target).refCount++;
+    }
+    if (heap->marking || heap->sweeping) {
+        writeBarrier(heap, target);
+    }
+}
+
+static HeapStatus linkByName(Heap* heap, char* fromName, char* toName) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_SYSTEM, .name = fromName, .target = toName);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    NameShard* shard = nameShard(heap, fromName);
+    HeapRef ref = 0;
+    bool toExists = findRefByName(heap, toName, &ref);
+
+    // A target freed from here on only leaves a stale reference behind
+    HEAP_LOCK(heap, &shard->lock);
+    int fromBlock = indexLookup(heap, shard, fromName);
+    HeapStatus status = linkBlocks(heap, fromBlock, toExists, ref, fromName, toName);
+    HEAP_UNLOCK(heap, &shard->lock);
+
+    if (status == HEAP_OK) {
+        referenceAdded(heap, fromBlock, ref);
+    }
+
+    releaseCache(cache);
+    return status;
+}
+
+// Add a reference from one block to another
+HeapStatus addReference(Heap* heap, char* fromName, char* toName) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = linkByName(heap, fromName, toName);
+    TRACE(heap, started, .op = TRACE_REF_ADD, .flags = status != HEAP_OK ? TRACE_FAILED : 0,
+          .name = fromName, .target = toName);
+    return status;
+}
+
+// Event name of a block a handle named. NULL for stale handles.
+static char* handleName(Heap* heap, int id) {
+    return id == NO_BLOCK ? NULL : BLK_INFO(heap, id).name;
+}
+
+static HeapStatus linkByHandle(Heap* heap, HeapRef from, HeapRef to) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_SYSTEM);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    NameShard* shard = NULL;
+    int fromBlock = lockHandle(heap, from, &shard);
+    int toBlock = resolveHandle(heap, to);
+    HeapStatus status = linkBlocks(heap, fromBlock, toBlock != NO_BLOCK, to, handleName(heap, fromBlock),
+                                   handleName(heap, toBlock));
+    if (fromBlock != NO_BLOCK) {
+        HEAP_UNLOCK(heap, &shard->lock);
+    }
+
+    if (status == HEAP_OK) {
+        referenceAdded(heap, fromBlock, to);
+    }
+
+    releaseCache(cache);
+    return status;
+}
+
+HeapStatus addReferenceByHandle(Heap* heap, HeapRef from, HeapRef to) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = linkByHandle(heap, from, to);
+    TRACE(heap, started, .op = TRACE_REF_ADD, .flags = TRACE_HANDLES | (status != HEAP_OK ? TRACE_FAILED : 0),
+          .argCount = 2, .args = { from, to });
+    return status;
+}
+
+// Remove a reference between two blocks. The shard of fromName is locked.
+static HeapStatus unlinkBlocks(Heap* heap, int fromBlock, bool toExists, HeapRef ref, char* fromName, char* toName) {
+    if (fromBlock == NO_BLOCK) {
+        EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_NOT_FOUND, .name = fromName, .target = toName);
+        return HEAP_ERR_NOT_FOUND;
+    }
+
+    BlockInfo* from = &BLK_INFO(heap, fromBlock);
+    
+    for (int i = 0; toExists && i < from->numReferences; i++) {
+        if (from->references[i] == ref) {
+            for (int j = i; j < from->numReferences - 1; j++) {
+                from->references[j] = from->references[j + 1];
+            }
+            from->numReferences--;
+            
+            audit(heap, HEAP_AUDIT_REF_REMOVE, fromBlock, fromName, toName, 0, 0, false);
+            EMIT(heap, .type = HEAP_EVENT_REF_REMOVE, .name = fromName, .target = toName);
+            return HEAP_OK;
+        }
+    }
+    
+    EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_REF_NOT_FOUND, .name = fromName, .target = toName);
+    return HEAP_ERR_REF_NOT_FOUND;
+}
+
+// Bookkeeping after a reference is removed. The deletion barrier keeps what
+// was reachable when the cycle began.
+static void referenceRemoved(Heap* heap, int fromBlock, HeapRef ref) {
+    if (heap->concurrent) return;
+
+    int target = resolveRef(heap, ref);
+
+    if (heap->marking) {
+        shadeBlock(heap, target);
+    }
+    if (heap->refCounting && target != fromBlock) {
+        BLK_INFO(heap, target).refCount--;
+        releaseIfUnreferenced(heap, target);
+        freeUnreferenced(heap);
+    }
+}
+
+static HeapStatus unlinkByName(Heap* heap, char* fromName, char* toName) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_SYSTEM, .name = fromName, .target = toName);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    NameShard* shard = nameShard(heap, fromName);
+    HeapRef ref = 0;
+    bool toExists = findRefByName(heap, toName, &ref);
+
+    HEAP_LOCK(heap, &shard->lock);
+    int fromBlock = indexLookup(heap, shard, fromName);
+    HeapStatus status = unlinkBlocks(heap, fromBlock, toExists, ref, fromName, toName);
+    HEAP_UNLOCK(heap, &shard->lock);
+
+    if (status == HEAP_OK) {
+        referenceRemoved(heap, fromBlock, ref);
+    }
+
+    releaseCache(cache);
+    return status;
+}
+
+// Remove a reference between two blocks
+HeapStatus removeReference(Heap* heap, char* fromName, char* toName) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = unlinkByName(heap, fromName, toName);
+    TRACE(heap, started, .op = TRACE_REF_REMOVE, .flags = status != HEAP_OK ? TRACE_FAILED : 0,
+          .name = fromName, .target = toName);
+    return status;
+}
+
+static HeapStatus unlinkByHandle(Heap* heap, HeapRef from, HeapRef to) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_REF_FAILED, .status = HEAP_ERR_SYSTEM);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    NameShard* shard = NULL;
+    int fromBlock = lockHandle(heap, from, &shard);
+    int toBlock = resolveHandle(heap, to);
+    HeapStatus status = unlinkBlocks(heap, fromBlock, toBlock != NO_BLOCK, to, handleName(heap, fromBlock),
+                                     handleName(heap, toBlock));
+    if (fromBlock != NO_BLOCK) {
+        HEAP_UNLOCK(heap, &shard->lock);
+    }
+
+    if (status == HEAP_OK) {
+        referenceRemoved(heap, fromBlock, to);
+    }
+
+    releaseCache(cache);
+    return status;
+}
+
+HeapStatus removeReferenceByHandle(Heap* heap, HeapRef from, HeapRef to) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = unlinkByHandle(heap, from, to);
+    TRACE(heap, started, .op = TRACE_REF_REMOVE, .flags = TRACE_HANDLES | (status != HEAP_OK ? TRACE_FAILED : 0),
+          .argCount = 2, .args = { from, to });
+    return status;
+}
+
+// Change a block's root status. Its shard is locked.
+static void changeRoot(Heap* heap, int id, bool isRoot) {
+    unsigned char state = BLK_STATE(heap, id);
+    storeBlockState(heap, id, isRoot ? (state | BLOCK_ROOT) : (state & ~BLOCK_ROOT));
+    audit(heap, HEAP_AUDIT_ROOT, id, BLK_INFO(heap, id).name, NULL, 0, 0, isRoot);
+    if (isRoot && (heap->marking || heap->sweeping)) {
+        writeBarrier(heap, id);
+    }
+}
+
+// Report a root change once the shard is unlocked, freeing the block if
+// reference counting finds it unreferenced
+static HeapStatus rootChanged(Heap* heap, int id, char* name, bool isRoot) {
+    if (id == NO_BLOCK) {
+        EMIT(heap, .type = HEAP_EVENT_ROOT_FAILED, .status = HEAP_ERR_NOT_FOUND, .name = name);
+        return HEAP_ERR_NOT_FOUND;
+    }
+    EMIT(heap, .type = HEAP_EVENT_ROOT, .name = name, .isRoot = isRoot);
+
+    if (!isRoot && heap->refCounting) {
+        releaseIfUnreferenced(heap, id);
+        freeUnreferenced(heap);
+    }
+    return HEAP_OK;
+}
+
+static HeapStatus rootByName(Heap* heap, char* name, bool isRoot) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_ROOT_FAILED, .status = HEAP_ERR_SYSTEM, .name = name);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    NameShard* shard = nameShard(heap, name);
+    HEAP_LOCK(heap, &shard->lock);
+
+    int id = indexLookup(heap, shard, name);
+    if (id != NO_BLOCK) {
+        changeRoot(heap, id, isRoot);
+    }
+
+    HEAP_UNLOCK(heap, &shard->lock);
+    releaseCache(cache);
+
+    return rootChanged(heap, id, name, isRoot);
+}
+
+// Set or clear root status
+HeapStatus setRoot(Heap* heap, char* name, bool isRoot) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = rootByName(heap, name, isRoot);
+    TRACE(heap, started, .op = TRACE_ROOT,
+          .flags = (isRoot ? TRACE_ROOT_FLAG : 0) | (status != HEAP_OK ? TRACE_FAILED : 0), .name = name);
+    return status;
+}
+
+static HeapStatus rootByHandle(Heap* heap, HeapRef block, bool isRoot) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_ROOT_FAILED, .status = HEAP_ERR_SYSTEM);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    NameShard* shard = NULL;
+    int id = lockHandle(heap, block, &shard);
+    if (id != NO_BLOCK) {
+        changeRoot(heap, id, isRoot);
+        HEAP_UNLOCK(heap, &shard->lock);
+    }
+    releaseCache(cache);
+
+    return rootChanged(heap, id, handleName(heap, id), isRoot);
+}
+
+HeapStatus setRootByHandle(Heap* heap, HeapRef block, bool isRoot) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = rootByHandle(heap, block, isRoot);
+    TRACE(heap, started, .op = TRACE_ROOT,
+          .flags = TRACE_HANDLES | (isRoot ? TRACE_ROOT_FLAG : 0) | (status != HEAP_OK ? TRACE_FAILED : 0),
+          .argCount = 1, .args = { block });
+    return status;
+}
+
+static inline bool isMarked(Heap* heap, int id) {
+    return (heap->markBits[id / 64] >> (id % 64)) & 1;
+}
+
+// Size the mark stack and bitmap for every descriptor handed out so far.
+// Each block is pushed at most once, so the stack cannot overflow during the
+// trace. Bits for new descriptors start clear.
+static bool growMarkSpace(Heap* heap) {
+    if (heap->blockLimit <= heap->markCapacity) return true;
+
+    int capacity = heap->markCapacity == 0 ? BLOCK_CHUNK_SIZE : heap->markCapacity;
+    while (capacity < heap->blockLimit) capacity *= 2;
+
+    MarkFrame* stack = (MarkFrame*)realloc(heap->markStack, capacity * sizeof(MarkFrame));
+    if (stack == NULL) return false;
+    heap->markStack = stack;
+
+    int oldWords = (heap->markCapacity + 63) / 64;
+    int words = (capacity + 63) / 64;
+    unsigned long long* bits = (unsigned long long*)realloc(heap->markBits, words * sizeof(unsigned long long));
+    if (bits == NULL) return false;
+    memset(bits + oldWords, 0, (words - oldWords) * sizeof(unsigned long long));
+    heap->markBits = bits;
+    heap->markCapacity = capacity;
+    return true;
+}
+
+// Size the mark space and clear the bitmap
+static bool prepareMark(Heap* heap) {
+    if (!growMarkSpace(heap)) return false;
+
+    memset(heap->markBits, 0, (heap->blockLimit + 63) / 64 * sizeof(unsigned long long));
+    return true;
+}
+
+static void pushMark(Heap* heap, int id, int depth, int* top) {
+    heap->markBits[id / 64] |= 1ULL << (id % 64);
+    heap->markStack[(*top)++] = (MarkFrame){ id, depth, 0 };
+
+    EMIT(heap, .type = HEAP_EVENT_MARK, .name = BLK_INFO(heap, id).name, .size = blockSize(heap, id), .count = depth);
+}
+
+// Mark phase: depth-first trace from one root with an explicit stack.
+// References to blocks that have since been freed are dropped on the way.
+static void markFrom(Heap* heap, int root) {
+    int top = 0;
+
+    if (isMarked(heap, root)) return;
+    pushMark(heap, root, 1, &top);
+
+    while (top > 0) {
+        MarkFrame* frame = &heap->markStack[top - 1];
+        BlockInfo* info = &BLK_INFO(heap, frame->block);
+
+        if (frame->nextRef == info->numReferences) {
+            top--;
+            continue;
+        }
+
+        int target = resolveRef(heap, info->references[frame->nextRef]);
+        if (target == NO_BLOCK) {
+            info->numReferences--;
+            memmove(&info->references[frame->nextRef], &info->references[frame->nextRef + 1],
+                    (info->numReferences - frame->nextRef) * sizeof(HeapRef));
+            continue;
+        }
+        frame->nextRef++;
+
+        EMIT(heap, .type = HEAP_EVENT_MARK_FOLLOW, .target = BLK_INFO(heap, target).name, .count = frame->depth);
+        if (!isMarked(heap, target)) {
+            pushMark(heap, target, frame->depth + 1, &top);
+        }
+    }
+}
+
+// Sweep phase
+static int sweepBlocks(Heap* heap) {
+    int freedCount = 0;
+    size_t totalFreedSize = 0;
+    
+    EMIT(heap, .type = HEAP_EVENT_SWEEP_START);
+    
+    for (int id = heap->head; id != NO_BLOCK; id = BLK_NEXT(heap, id)) {
+        unsigned char state = BLK_STATE(heap, id);
+
+        if (!(state & (BLOCK_FREE | BLOCK_CACHED)) && !isMarked(heap, id)) {
+            BlockInfo* info = &BLK_INFO(heap, id);
+            EMIT(heap, .type = HEAP_EVENT_SWEEP_FREE, .name = info->name, .size = blockSize(heap, id),
+                 .requestedSize = info->allocated_size);
+            
+            totalFreedSize += blockSize(heap, id);
+            releaseBlock(heap, id);
+            freedCount++;
+        }
+    }
+    heap->liveBytes -= totalFreedSize;
+    
+    EMIT(heap, .type = HEAP_EVENT_SWEEP_END, .count = freedCount, .size = totalFreedSize);
+    return freedCount;
+}
+
+// Drop an incremental cycle or lazy sweep under way. Blocks it would have
+// freed are found again by the next collection.
+static void abandonCycle(Heap* heap) {
+    heap->marking = false;
+    heap->sweeping = false;
+}
+
+// Lazy sweep. Once marking is over every descriptor chunk is flagged
+// unswept; allocations that find no free block sweep chunks one at a time
+// until one does.
+static void startSweep(Heap* heap) {
+    int chunks = (heap->blockLimit + BLOCK_CHUNK_MASK) >> BLOCK_CHUNK_SHIFT;
+
+    for (int c = 0; c < chunks; c++) {
+        heap->chunks[c]->unswept = true;
+    }
+    heap->unsweptChunks = chunks;
+    heap->sweepFreed = 0;
+    heap->sweepFreedSize = 0;
+    heap->sweeping = chunks > 0;
+
+    EMIT(heap, .type = HEAP_EVENT_SWEEP_START);
+}
+
+// Free the unmarked blocks of one chunk, coalescing each as it goes, and
+// recompute the chunk's class summary from the blocks that stay
+static void sweepChunk(Heap* heap, int c) {
+    BlockChunk* chunk = heap->chunks[c];
+    int first = c << BLOCK_CHUNK_SHIFT;
+    int last = first + BLOCK_CHUNK_SIZE < heap->blockLimit ? first + BLOCK_CHUNK_SIZE : heap->blockLimit;
+    int mergeCount = 0;
+
+    // The chunk is walked by id, so spare descriptors are skipped whatever
+    // else their state says
+    memset(chunk->usedClasses, 0, sizeof(chunk->usedClasses));
+    for (int id = first; id < last; id++) {
+        if (BLK_STATE(heap, id) & (BLOCK_FREE | BLOCK_CACHED | BLOCK_SPARE)) continue;
+
+        int cls = BLK_CLASS(heap, id);
+        if (isMarked(heap, id)) {
+            chunk->usedClasses[cls / 64] |= 1ULL << (cls % 64);
+            continue;
+        }
+
+        BlockInfo* info = &BLK_INFO(heap, id);
+        EMIT(heap, .type = HEAP_EVENT_SWEEP_FREE, .name = info->name, .size = blockSize(heap, id),
+             .requestedSize = info->allocated_size);
+
+        heap->sweepFreed++;
+        heap->sweepFreedSize += blockSize(heap, id);
+        heap->liveBytes -= blockSize(heap, id);
+        heap->stats.totalFreed++;
+        releaseBlock(heap, id);
+        coalesceBlock(heap, id, &mergeCount);
+    }
+    reportMerges(heap, mergeCount);
+
+    chunk->unswept = false;
+    if (--heap->unsweptChunks == 0) {
+        heap->sweeping = false;
+        heap->stats.lastFreedCount = heap->sweepFreed;
+        EMIT(heap, .type = HEAP_EVENT_SWEEP_END, .count = heap->sweepFreed, .size = heap->sweepFreedSize);
+    }
+}
+
+static bool hasClassAtLeast(const unsigned long long* classes, int cls) {
+    for (int word = cls / 64; word < FIB_BITMAP_WORDS; word++) {
+        unsigned long long candidates = classes[word];
+        if (word == cls / 64) {
+            candidates &= ~0ULL << (cls % 64);
+        }
+        if (candidates != 0) return true;
+    }
+    return false;
+}
+
+// Sweep until a free block of class cls or larger exists. Chunks that hold
+// blocks of such a class go first, since freeing one of them is enough; the
+// others can only help through coalescing.
+static void sweepFor(Heap* heap, int cls) {
+    int chunks = (heap->blockLimit + BLOCK_CHUNK_MASK) >> BLOCK_CHUNK_SHIFT;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int c = 0; c < chunks && heap->sweeping; c++) {
+            BlockChunk* chunk = heap->chunks[c];
+            if (!chunk->unswept || (pass == 0 && !hasClassAtLeast(chunk->usedClasses, cls))) continue;
+
+            sweepChunk(heap, c);
+            if (hasClassAtLeast(heap->freeClassBitmap, cls)) return;
+        }
+    }
+}
+
+// Parallel collection. Each worker owns a mark deque: it pushes and pops
+// block ids at the top under its own lock, and idle workers steal half of
+// another worker's entries from the bottom. Blocks are claimed with an
+// atomic test-and-set on the mark bitmap, so each is scanned exactly once.
+// The sweep then hands out descriptor chunks to the workers, which build
+// private free lists that are spliced into the heap's once all are done.
+// Per-block MARK, MARK_FOLLOW and SWEEP_FREE events are not reported.
+typedef struct GCWorker {
+    pthread_mutex_t lock;
+    int* stack;
+    int bottom;
+    int top;
+    int capacity;
+
+    // Sweep results
+    int freeHead[MAX_FIB_CLASSES];
+    int freeTail[MAX_FIB_CLASSES];
+    int freedCount;
+    size_t freedSize;
+    size_t freedYoungSize;
+
+    struct ParallelGC* gc;
+    pthread_t thread;
+    bool started;
+} GCWorker;
+
+typedef struct ParallelGC {
+    Heap* heap;
+    GCWorker* workers;
+    int count;
+    atomic_int idle;         // Workers with an empty deque looking for work
+    atomic_int nextChunk;    // Next descriptor chunk to sweep
+    atomic_bool failed;      // A mark deque could not grow; the trace is incomplete
+} ParallelGC;
+
+#define GC_STACK_INITIAL 1024
+#define GC_STEAL_MAX     256
+
+static bool tryMark(Heap* heap, int id) {
+    unsigned long long bit = 1ULL << (id % 64);
+    return (__atomic_fetch_or(&heap->markBits[id / 64], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+
+// Worker lock held
+static bool workerPush(GCWorker* worker, int id) {
+    if (worker->top == worker->capacity) {
+        if (worker->bottom > 0) {
+            memmove(worker->stack, worker->stack + worker->bottom, (worker->top - worker->bottom) * sizeof(int));
+            worker->top -= worker->bottom;
+            worker->bottom = 0;
+        } else {
+            int* stack = (int*)realloc(worker->stack, worker->capacity * 2 * sizeof(int));
+            if (stack == NULL) return false;
+            worker->stack = stack;
+            worker->capacity *= 2;
+        }
+    }
+    worker->stack[worker->top++] = id;
+    return true;
+}
+
+static int workerPop(GCWorker* worker) {
+    int id = NO_BLOCK;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->top > worker->bottom) {
+        id = worker->stack[--worker->top];
+        if (worker->top == worker->bottom) {
+            worker->top = worker->bottom = 0;
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return id;
+}
+
+// Steal up to half of some other worker's entries into an idle worker's
+// deque. The idle count drops before the entries leave the victim, so the
+// workers can never all look idle while work remains. Only one deque is
+// locked at a time.
+static bool stealWork(GCWorker* thief) {
+    ParallelGC* gc = thief->gc;
+    int self = (int)(thief - gc->workers);
+    int taken[GC_STEAL_MAX];
+
+    for (int i = 1; i < gc->count; i++) {
+        GCWorker* victim = &gc->workers[(self + i) % gc->count];
+
+        pthread_mutex_lock(&victim->lock);
+        int available = victim->top - victim->bottom;
+        if (available == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+
+        atomic_fetch_sub(&gc->idle, 1);
+        int take = (available + 1) / 2;
+        if (take > GC_STEAL_MAX) take = GC_STEAL_MAX;
+        memcpy(taken, victim->stack + victim->bottom, take * sizeof(int));
+        victim->bottom += take;
+        if (victim->top == victim->bottom) {
+            victim->top = victim->bottom = 0;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&thief->lock);
+        for (int j = 0; j < take; j++) {
+            if (!workerPush(thief, taken[j])) {
+                atomic_store(&gc->failed, true);
+            }
+        }
+        pthread_mutex_unlock(&thief->lock);
+        return true;
+    }
+    return false;
+}
+
+// Queue every unmarked target of a block, dropping stale references. Only
+// the worker that marked a block scans it, so the list can be pruned in place.
+static void scanBlock(GCWorker* worker, int id) {
+    Heap* heap = worker->gc->heap;
+    BlockInfo* info = &BLK_INFO(heap, id);
+
+    pthread_mutex_lock(&worker->lock);
+    for (int i = 0; i < info->numReferences; ) {
+        int target = resolveRef(heap, info->references[i]);
+        if (target == NO_BLOCK) {
+            info->numReferences--;
+            memmove(&info->references[i], &info->references[i + 1], (info->numReferences - i) * sizeof(HeapRef));
+            continue;
+        }
+        i++;
+        if (tryMark(heap, target) && !workerPush(worker, target)) {
+            atomic_store(&worker->gc->failed, true);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void* markWorker(void* arg) {
+    GCWorker* worker = (GCWorker*)arg;
+    ParallelGC* gc = worker->gc;
+
+    for (;;) {
+        int id;
+        while ((id = workerPop(worker)) != NO_BLOCK) {
+            scanBlock(worker, id);
+        }
+
+        atomic_fetch_add(&gc->idle, 1);
+        while (!stealWork(worker)) {
+            if (atomic_load(&gc->idle) == gc->count) return NULL;
+            sched_yield();
+        }
+    }
+}
+
+static void* sweepWorker(void* arg) {
+    GCWorker* worker = (GCWorker*)arg;
+    Heap* heap = worker->gc->heap;
+    int chunks = (heap->blockLimit + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+
+    for (int chunk = atomic_fetch_add(&worker->gc->nextChunk, 1); chunk < chunks;
+         chunk = atomic_fetch_add(&worker->gc->nextChunk, 1)) {
+        int end = (chunk + 1) * BLOCK_CHUNK_SIZE;
+        if (end > heap->blockLimit) end = heap->blockLimit;
+
+        // Spare descriptors describe no block, whatever else their state says
+        for (int id = chunk * BLOCK_CHUNK_SIZE; id < end; id++) {
+            unsigned char state = BLK_STATE(heap, id);
+            if ((state & (BLOCK_FREE | BLOCK_CACHED | BLOCK_SPARE)) || isMarked(heap, id)) continue;
+
+            NameShard* shard = nameShard(heap, BLK_INFO(heap, id).name);
+            pthread_mutex_lock(&shard->lock);
+            indexRemove(heap, shard, id);
+            pthread_mutex_unlock(&shard->lock);
+            if (blockIsYoung(heap, id)) {
+                worker->freedYoungSize += blockSize(heap, id);
+            }
+            resetBlockInfo(heap, id);
+
+            int cls = BLK_CLASS(heap, id);
+            BLK_STATE(heap, id) = (state & ~BLOCK_ROOT) | BLOCK_FREE;
+            BLK_PREV_FREE(heap, id) = NO_BLOCK;
+            BLK_NEXT_FREE(heap, id) = worker->freeHead[cls];
+            if (worker->freeHead[cls] != NO_BLOCK) {
+                BLK_PREV_FREE(heap, worker->freeHead[cls]) = id;
+            } else {
+                worker->freeTail[cls] = id;
+            }
+            worker->freeHead[cls] = id;
+
+            worker->freedCount++;
+            worker->freedSize += blockSize(heap, id);
+        }
+    }
+    return NULL;
+}
+
+// Run fn on every worker, the calling thread acting as worker 0. A worker
+// whose thread cannot be started counts as idle from the outset; its
+// seeded entries are stolen and its sweep chunks claimed by the others.
+static void runWorkers(ParallelGC* gc, void* (*fn)(void*)) {
+    for (int i = 1; i < gc->count; i++) {
+        gc->workers[i].started = pthread_create(&gc->workers[i].thread, NULL, fn, &gc->workers[i]) == 0;
+        if (!gc->workers[i].started && fn == markWorker) {
+            atomic_fetch_add(&gc->idle, 1);
+        }
+    }
+    fn(&gc->workers[0]);
+    for (int i = 1; i < gc->count; i++) {
+        if (gc->workers[i].started) {
+            pthread_join(gc->workers[i].thread, NULL);
+        }
+    }
+}
+
+static void destroyWorkers(ParallelGC* gc) {
+    for (int i = 0; i < gc->count; i++) {
+        pthread_mutex_destroy(&gc->workers[i].lock);
+        free(gc->workers[i].stack);
+    }
+    free(gc->workers);
+}
+
+// Parallel mark and, unless the sweep is left to allocations, sweep.
+// Returns the number of blocks freed, or -1 if the workers could not be set
+// up or the trace could not complete, in which case nothing has been freed
+// and the caller collects serially.
+static int collectParallel(Heap* heap, bool sweep) {
+    ParallelGC gc = { .heap = heap, .count = heap->gcThreads };
+    atomic_init(&gc.idle, 0);
+    atomic_init(&gc.nextChunk, 0);
+    atomic_init(&gc.failed, false);
+
+    gc.workers = (GCWorker*)calloc(gc.count, sizeof(GCWorker));
+    if (gc.workers == NULL) return -1;
+    for (int i = 0; i < gc.count; i++) {
+        GCWorker* worker = &gc.workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->gc = &gc;
+        worker->capacity = GC_STACK_INITIAL;
+        worker->stack = (int*)malloc(GC_STACK_INITIAL * sizeof(int));
+        if (worker->stack == NULL) atomic_store(&gc.failed, true);
+        for (int cls = 0; cls < MAX_FIB_CLASSES; cls++) {
+            worker->freeHead[cls] = worker->freeTail[cls] = NO_BLOCK;
+        }
+    }
+
+    // Seed the deques with the roots, round robin
+    int rootCount = 0;
+    for (int id = heap->head; id != NO_BLOCK && !atomic_load(&gc.failed); id = BLK_NEXT(heap, id)) {
+        if ((BLK_STATE(heap, id) & (BLOCK_FREE | BLOCK_ROOT)) == BLOCK_ROOT) {
+            EMIT(heap, .type = HEAP_EVENT_GC_ROOT, .name = BLK_INFO(heap, id).name);
+            if (tryMark(heap, id) && !workerPush(&gc.workers[rootCount % gc.count], id)) {
+                atomic_store(&gc.failed, true);
+            }
+            rootCount++;
+        }
+    }
+
+    if (!atomic_load(&gc.failed)) {
+        runWorkers(&gc, markWorker);
+    }
+    if (atomic_load(&gc.failed)) {
+        destroyWorkers(&gc);
+        return -1;
+    }
+
+    if (rootCount == 0) {
+        EMIT(heap, .type = HEAP_EVENT_GC_NO_ROOTS);
+    }
+    if (!sweep) {
+        destroyWorkers(&gc);
+        return 0;
+    }
+
+    EMIT(heap, .type = HEAP_EVENT_SWEEP_START);
+    runWorkers(&gc, sweepWorker);
+
+    int freedCount = 0;
+    size_t freedSize = 0;
+    size_t freedYoungSize = 0;
+    for (int i = 0; i < gc.count; i++) {
+        GCWorker* worker = &gc.workers[i];
+        for (int cls = 0; cls < MAX_FIB_CLASSES; cls++) {
+            if (worker->freeHead[cls] == NO_BLOCK) continue;
+
+            BLK_NEXT_FREE(heap, worker->freeTail[cls]) = heap->freeLists[cls];
+            if (heap->freeLists[cls] != NO_BLOCK) {
+                BLK_PREV_FREE(heap, heap->freeLists[cls]) = worker->freeTail[cls];
+            }
+            heap->freeLists[cls] = worker->freeHead[cls];
+            heap->freeClassBitmap[cls / 64] |= 1ULL << (cls % 64);
+        }
+        freedCount += worker->freedCount;
+        freedSize += worker->freedSize;
+        freedYoungSize += worker->freedYoungSize;
+    }
+    destroyWorkers(&gc);
+    heap->liveBytes -= freedSize;
+    heap->youngBytes -= freedYoungSize;
+
+    EMIT(heap, .type = HEAP_EVENT_SWEEP_END, .count = freedCount, .size = freedSize);
+    return freedCount;
+}
+
+// Serial mark and, unless the sweep is left to allocations, sweep
+static int collectSerial(Heap* heap, bool sweep) {
+    int rootCount = 0;
+    
+    for (int id = heap->head; id != NO_BLOCK; id = BLK_NEXT(heap, id)) {
+        if ((BLK_STATE(heap, id) & (BLOCK_FREE | BLOCK_ROOT)) == BLOCK_ROOT) {
+            EMIT(heap, .type = HEAP_EVENT_GC_ROOT, .name = BLK_INFO(heap, id).name);
+            markFrom(heap, id);
+            rootCount++;
+        }
+    }
+    
+    if (rootCount == 0) {
+        EMIT(heap, .type = HEAP_EVENT_GC_NO_ROOTS);
+    }
+    
+    return sweep ? sweepBlocks(heap) : 0;
+}
+
+// Regions. A growable heap maps in a new region when it runs out of free
+// blocks and gives regions back once a collection leaves them empty. Each
+// region is carved into buddy trees of its own, so regions never merge and
+// the topmost one can always be unmapped whole.
+
+// Map in a region with room for a block of class cls: as large as the heap
+// is already, so the heap doubles, but no larger than maxMemory allows.
+// Returns false if the heap is at its limit.
+static bool growHeap(Heap* heap, int cls) {
+    HEAP_LOCK(heap, &heap->lock);
+    size_t need = (size_t)FIB_SIZES[cls];
+    size_t start = heap->mappedEnd;
+    size_t room = heap->maxMemory - heap->totalMemory;
+    if (heap->reserved - start < room) {
+        room = heap->reserved - start;
+    }
+
+    size_t size = heap->totalMemory > need ? heap->totalMemory : need;
+    size = roundToPage(heap, size);
+    if (size > room) {
+        size = room;
+    }
+    if (heap->regionCount == MAX_REGIONS || size < need ||
+        mprotect(heap->arena + start, roundToPage(heap, size), PROT_READ | PROT_WRITE) != 0) {
+        HEAP_UNLOCK(heap, &heap->lock);
+        return false;
+    }
+
+    Region* region = &heap->regions[heap->regionCount++];
+    *region = (Region){ start, size, false };
+    int last = heap->head;
+    while (last != NO_BLOCK && BLK_NEXT(heap, last) != NO_BLOCK) {
+        last = BLK_NEXT(heap, last);
+    }
+    int blockCount = 0;
+    int tail = carveRegion(heap, region, last, &blockCount);
+    pushCarved(heap, last != NO_BLOCK ? BLK_NEXT(heap, last) : heap->head, tail);
+
+    __atomic_store_n(&heap->totalMemory, heap->totalMemory + size, __ATOMIC_RELAXED);
+    heap->mappedEnd = roundToPage(heap, start + size);
+    heap->stats.regionsAdded++;
+    HEAP_UNLOCK(heap, &heap->lock);
+
+    audit(heap, HEAP_AUDIT_GROW, NO_BLOCK, NULL, NULL, size, heap->regionCount, false);
+    EMIT(heap, .type = HEAP_EVENT_GROW, .size = size, .offset = start);
+    return true;
+}
+
+// Give back the memory of regions with no blocks in use. Empty regions at
+// the top are unmapped and dropped; other empty regions keep their blocks
+// but their pages are released with madvise, once per spell of being empty.
+// Only called with the world stopped and the thread caches empty.
+static void trimRegions(Heap* heap) {
+    bool busy[MAX_REGIONS] = { false };
+    int first[MAX_REGIONS];
+    int r = -1;
+
+    for (int id = heap->head; id != NO_BLOCK; id = BLK_NEXT(heap, id)) {
+        while (r < 0 || (r + 1 < heap->regionCount && BLK_OFFSET(heap, id) >= heap->regions[r].start + heap->regions[r].size)) {
+            first[++r] = id;
+        }
+        if (!(BLK_STATE(heap, id) & BLOCK_FREE)) {
+            busy[r] = true;
+        }
+    }
+
+    size_t givenBack = 0;
+    int unmapped = 0;
+    while (heap->regionCount > 1 && !busy[heap->regionCount - 1]) {
+        Region* region = &heap->regions[heap->regionCount - 1];
+        int id = first[heap->regionCount - 1];
+        linkNeighbours(heap, BLK_PREV(heap, id), NO_BLOCK);
+        while (id != NO_BLOCK) {
+            int next = BLK_NEXT(heap, id);
+            removeFreeBlock(heap, id);
+            releaseBlockId(heap, id);
+            id = next;
+        }
+
+        mmap(heap->arena + region->start, roundToPage(heap, region->size), PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (!region->advised) {
+            givenBack += region->size;
+        }
+        heap->totalMemory -= region->size;
+        heap->mappedEnd = region->start;
+        heap->regionCount--;
+        unmapped++;
+    }
+
+    for (int i = 0; i < heap->regionCount; i++) {
+        Region* region = &heap->regions[i];
+        if (busy[i] || region->size < heap->pageSize) {
+            region->advised = false;
+        } else if (!region->advised) {
+            // Regions after the first start on a page; the first starts the arena
+            madvise(heap->arena + region->start, region->size & ~(heap->pageSize - 1), MADV_DONTNEED);
+            region->advised = true;
+            givenBack += region->size;
+        }
+    }
+
+    if (givenBack == 0 && unmapped == 0) return;
+    heap->stats.regionsUnmapped += unmapped;
+    audit(heap, HEAP_AUDIT_SHRINK, NO_BLOCK, NULL, NULL, givenBack, unmapped, false);
+    EMIT(heap, .type = HEAP_EVENT_SHRINK, .size = givenBack, .count = unmapped);
+}
+
+// Compaction. Buddies only merge when both halves are free, so a long run
+// can leave free space scattered in blocks too small to use. Compaction
+// rebuilds the buddy trees from scratch and places the allocated blocks
+// again, aligned blocks first and then the largest first, so they pack
+// together and the free space left over forms large blocks. Blocks keep
+// their descriptors, so the id is the forwarding address: handles, names
+// and references stay valid and only offsets and contents move.
+
+// Where a block sat before compaction, so a layout can be put back
+typedef struct LayoutEntry {
+    int block;                 // NO_BLOCK for a free block
+    size_t offset;
+    unsigned char sizeClass;
+    unsigned char side;
+    unsigned char inherit;
+} LayoutEntry;
+
+// An allocated block to place, and where its contents are
+typedef struct CompactMove {
+    int block;
+    size_t oldOffset;
+    unsigned char sizeClass;
+    unsigned char alignShift;
+} CompactMove;
+
+// Aligned blocks first, then by class from the largest, then in address
+// order so blocks of one class slide down together
+static int compareMoves(const void* a, const void* b) {
+    const CompactMove* x = (const CompactMove*)a;
+    const CompactMove* y = (const CompactMove*)b;
+
+    if (x->alignShift != y->alignShift) return y->alignShift - x->alignShift;
+    if (x->sizeClass != y->sizeClass) return y->sizeClass - x->sizeClass;
+    return x->oldOffset < y->oldOffset ? -1 : x->oldOffset > y->oldOffset;
+}
+
+// Drop every free block, leaving only the allocated ones in the block list
+static void dropFreeBlocks(Heap* heap) {
+    int next;
+    for (int id = heap->head; id != NO_BLOCK; id = next) {
+        next = BLK_NEXT(heap, id);
+        if (blockIsFree(heap, id)) {
+            removeFreeBlock(heap, id);
+            releaseBlockId(heap, id);
+        }
+    }
+}
+
+// Change the class of an allocated block being placed, keeping the live
+// and young byte counts right
+static void setPlacedClass(Heap* heap, int id, int cls) {
+    size_t oldSize = blockSize(heap, id);
+    BLK_CLASS(heap, id) = (unsigned char)cls;
+
+    if (!heap->concurrent) {
+        heap->liveBytes = heap->liveBytes - oldSize + blockSize(heap, id);
+    }
+    if (blockIsYoung(heap, id)) {
+        heap->youngBytes = heap->youngBytes - oldSize + blockSize(heap, id);
+    }
+}
+
+// Give an allocated block the place of a block just taken for it, whose
+// descriptor is released. Blocks of size 2 are never split, so the place
+// may be one class larger than the block.
+static void adoptPlacement(Heap* heap, int id, int place) {
+    linkNeighbours(heap, BLK_PREV(heap, place), id);
+    linkNeighbours(heap, id, BLK_NEXT(heap, place));
+    BLK_OFFSET(heap, id) = BLK_OFFSET(heap, place);
+    setPlacedClass(heap, id, BLK_CLASS(heap, place));
+    setBlockSides(heap, id, blockSide(heap, place), blockInherit(heap, place));
+    releaseBlockId(heap, place);
+}
+
+// Put back the layout saved before a compaction that could not place
+// every block
+static void restoreLayout(Heap* heap, const LayoutEntry* layout, int count) {
+    dropFreeBlocks(heap);
+    heap->head = NO_BLOCK;
+
+    int prev = NO_BLOCK;
+    for (int i = 0; i < count; i++) {
+        const LayoutEntry* entry = &layout[i];
+        int id = entry->block;
+
+        if (id == NO_BLOCK) {
+            id = newBlock(heap, entry->offset, entry->sizeClass, (BuddySide)entry->side, (BuddySide)entry->inherit);
+            pushFreeBlock(heap, id);
+        } else {
+            BLK_OFFSET(heap, id) = entry->offset;
+            setPlacedClass(heap, id, entry->sizeClass);
+            setBlockSides(heap, id, (BuddySide)entry->side, (BuddySide)entry->inherit);
+        }
+        linkNeighbours(heap, prev, id);
+        prev = id;
+    }
+    linkNeighbours(heap, prev, NO_BLOCK);
+}
+
+// Compact the heap. Only called with the world stopped and the thread
+// caches empty. Returns false, leaving the heap as it was, if there is
+// nothing to gain or the blocks would not all fit in the new layout.
+static bool compactHeap(Heap* heap) {
+    int blockCount = 0;
+    int freeCount = 0;
+    size_t liveSize = 0;
+
+    for (int id = heap->head; id != NO_BLOCK; id = BLK_NEXT(heap, id)) {
+        blockCount++;
+        if (blockIsFree(heap, id)) {
+            freeCount++;
+        } else {
+            liveSize += BLK_INFO(heap, id).allocated_size;
+        }
+    }
+    if (freeCount < 2) return false;
+
+    int liveCount = blockCount - freeCount;
+    LayoutEntry* layout = (LayoutEntry*)malloc(blockCount * sizeof(LayoutEntry));
+    CompactMove* moves = (CompactMove*)malloc((liveCount > 0 ? liveCount : 1) * sizeof(CompactMove));
+    unsigned char* scratch = (unsigned char*)malloc(liveSize > 0 ? liveSize : 1);
+    if (layout == NULL || moves == NULL || scratch == NULL) {
+        free(layout);
+        free(moves);
+        free(scratch);
+        return false;
+    }
+
+    int n = 0;
+    int m = 0;
+    for (int id = heap->head; id != NO_BLOCK; id = BLK_NEXT(heap, id)) {
+        bool isFree = blockIsFree(heap, id);
+        layout[n++] = (LayoutEntry){ isFree ? NO_BLOCK : id, BLK_OFFSET(heap, id), BLK_CLASS(heap, id),
+                                     blockSide(heap, id), blockInherit(heap, id) };
+        if (!isFree) {
+            moves[m++] = (CompactMove){ id, BLK_OFFSET(heap, id), BLK_CLASS(heap, id), BLK_INFO(heap, id).alignShift };
+        }
+    }
+    qsort(moves, liveCount, sizeof(CompactMove), compareMoves);
+
+    heap->compacting = true;
+
+    dropFreeBlocks(heap);
+    heap->head = NO_BLOCK;
+    carveArena(heap);
+
+    bool placed = true;
+    for (int i = 0; i < liveCount && placed; i++) {
+        Placement placement = { (size_t)1 << moves[i].alignShift, false };
+        int place = moves[i].alignShift > 0 ? takePlacedBlock(heap, moves[i].sizeClass, &placement)
+                                            : takeFreeBlock(heap, moves[i].sizeClass);
+        placed = place != NO_BLOCK;
+        if (placed) {
+            adoptPlacement(heap, moves[i].block, place);
+        }
+    }
+    if (!placed) {
+        restoreLayout(heap, layout, blockCount);
+    }
+    heap->compacting = false;
+
+    // Stage the contents of the blocks that moved, since their new places
+    // may overlap the old places of others
+    int movedCount = 0;
+    size_t movedSize = 0;
+    for (int i = 0; i < liveCount && placed; i++) {
+        int id = moves[i].block;
+        if (BLK_OFFSET(heap, id) != moves[i].oldOffset) {
+            size_t size = BLK_INFO(heap, id).allocated_size;
+            memcpy(scratch + movedSize, heap->arena + moves[i].oldOffset, size);
+            movedSize += size;
+            movedCount++;
+        }
+    }
+    movedSize = 0;
+    for (int i = 0; i < liveCount && placed; i++) {
+        int id = moves[i].block;
+        if (BLK_OFFSET(heap, id) != moves[i].oldOffset) {
+            size_t size = BLK_INFO(heap, id).allocated_size;
+            memcpy(heap->arena + BLK_OFFSET(heap, id), scratch + movedSize, size);
+            movedSize += size;
+        }
+    }
+
+    free(layout);
+    free(moves);
+    free(scratch);
+    if (!placed) return false;
+
+    heap->stats.totalCompactions++;
+    audit(heap, HEAP_AUDIT_COMPACT, NO_BLOCK, NULL, NULL, movedSize, movedCount, false);
+    EMIT(heap, .type = HEAP_EVENT_COMPACT, .count = movedCount, .size = movedSize);
+    return true;
+}
+
+// Coalesce, or compact, after a sweep and record the collection
+static void endCollection(Heap* heap, int freedCount, bool compact) {
+    if (!(compact && compactHeap(heap)) && freedCount > 0) {
+        mergeBlock(heap);
+    }
+    
+    heap->stats.totalCollections++;
+    heap->stats.totalFreed += freedCount;
+    heap->stats.lastFreedCount = freedCount;
+    __atomic_store_n(&heap->allocatedSinceGC, 0, __ATOMIC_RELAXED);
+    
+    audit(heap, HEAP_AUDIT_GC, NO_BLOCK, NULL, NULL, heap->stats.totalCollections, freedCount, false);
+    EMIT(heap, .type = HEAP_EVENT_GC_END, .count = freedCount);
+}
+
+// Mark from the roots, sweep everything unreachable and coalesce or compact. In
+// concurrent mode every other thread is stopped first and the thread caches
+// are emptied, so the collection sees the whole heap. With lazy sweeping, a
+// collection started by an allocation stops after marking. The caller must
+// not hold its own cache. Returns the number of blocks freed.
+static int collect(Heap* heap, bool triggered) {
+    stopTheWorld(heap);
+
+    // A full collection supersedes any incremental cycle under way
+    abandonCycle(heap);
+    bool lazy = triggered && heap->lazySweep;
+
+    if (!prepareMark(heap)) {
+        resumeTheWorld(heap);
+        return 0;
+    }
+
+    EMIT(heap, .type = HEAP_EVENT_GC_START, .triggered = triggered);
+
+    flushAllCaches(heap);
+
+    int freedCount = -1;
+    if (heap->gcThreads > 1 && heap->blockLimit >= PARALLEL_GC_MIN_BLOCKS) {
+        freedCount = collectParallel(heap, !lazy);
+        if (freedCount < 0) {
+            // Start the trace over from a clean bitmap
+            memset(heap->markBits, 0, (heap->blockLimit + 63) / 64 * sizeof(unsigned long long));
+        } else if (heap->refCounting) {
+            // The sweep workers free blocks without uncounting their references
+            recountReferences(heap);
+        }
+    }
+    if (freedCount < 0) {
+        freedCount = collectSerial(heap, !lazy);
+    }
+    if (lazy) {
+        startSweep(heap);
+    }
+    
+    endCollection(heap, freedCount, heap->compaction && !lazy);
+    if (!lazy) {
+        trimRegions(heap);
+    }
+
+    resumeTheWorld(heap);
+    return freedCount;
+}
+
+int garbageCollect(Heap* heap) {
+    unsigned long long started = traceStart(heap);
+    int freedCount = collect(heap, false);
+    TRACE(heap, started, .op = TRACE_GC, .argCount = 1, .args = { (unsigned long long)freedCount });
+    return freedCount;
+}
+
+// Incremental collection. Once live data passes INCREMENTAL_TRIGGER_PERCENT
+// of the heap a cycle starts, and every allocation then does sliceBudget
+// units of marking: one per descriptor checked for root status, block
+// scanned or reference followed. Blocks are white while unmarked, grey while
+// marked and waiting on the stack, and black once scanned. No black block
+// may point to a white one: blocks allocated during the cycle start black,
+// and adding or removing a reference, or making a block a root, shades the
+// block concerned grey. The slice that empties the stack sweeps, or starts
+// a lazy sweep.
+#define INCREMENTAL_TRIGGER_PERCENT 75
+
+// Make a white block grey
+static void shadeBlock(Heap* heap, int id) {
+    if (id == NO_BLOCK || isMarked(heap, id)) return;
+
+    heap->markBits[id / 64] |= 1ULL << (id % 64);
+    heap->markStack[heap->greyCount++].block = id;
+}
+
+// Blocks allocated during a cycle or lazy sweep survive it
+static void blackenBlock(Heap* heap, int id) {
+    if (!growMarkSpace(heap)) {
+        abandonCycle(heap);
+        return;
+    }
+    heap->markBits[id / 64] |= 1ULL << (id % 64);
+}
+
+static void startCycle(Heap* heap) {
+    if (!prepareMark(heap)) return;
+
+    heap->marking = true;
+    heap->rootCursor = 0;
+    heap->greyCount = 0;
+    heap->cycleRoots = 0;
+    EMIT(heap, .type = HEAP_EVENT_GC_START);
+}
+
+// Scan grey blocks until the stack is empty or the budget runs out.
+// Returns the budget left.
+static int drainGrey(Heap* heap, int budget) {
+    while (budget > 0 && heap->greyCount > 0) {
+        int id = heap->markStack[--heap->greyCount].block;
+        budget--;
+
+        // Freed since it was shaded
+        if (BLK_STATE(heap, id) & BLOCK_FREE) continue;
+
+        BlockInfo* info = &BLK_INFO(heap, id);
+        EMIT(heap, .type = HEAP_EVENT_MARK, .name = info->name, .size = blockSize(heap, id));
+
+        for (int i = 0; i < info->numReferences; budget--) {
+            int target = resolveRef(heap, info->references[i]);
+            if (target == NO_BLOCK) {
+                info->numReferences--;
+                memmove(&info->references[i], &info->references[i + 1],
+                        (info->numReferences - i) * sizeof(HeapRef));
+                continue;
+            }
+            i++;
+
+            EMIT(heap, .type = HEAP_EVENT_MARK_FOLLOW, .target = BLK_INFO(heap, target).name);
+            shadeBlock(heap, target);
+        }
+    }
+    return budget;
+}
+
+// Barrier for a block that just gained a referrer or became a root. While
+// marking, shading it is enough. During a lazy sweep it may be unswept
+// garbage, so it and everything it reaches are marked on the spot.
+static void writeBarrier(Heap* heap, int id) {
+    if (id == NO_BLOCK) return;
+
+    if (heap->marking) {
+        shadeBlock(heap, id);
+    } else if (heap->sweeping && !isMarked(heap, id)) {
+        shadeBlock(heap, id);
+        drainGrey(heap, INT_MAX);
+    }
+}
+
+static void markSlice(Heap* heap, int budget) {
+    while (budget > 0 && heap->rootCursor < heap->blockLimit) {
+        int id = heap->rootCursor++;
+        budget--;
+
+        if ((BLK_STATE(heap, id) & (BLOCK_FREE | BLOCK_ROOT)) == BLOCK_ROOT) {
+            EMIT(heap, .type = HEAP_EVENT_GC_ROOT, .name = BLK_INFO(heap, id).name);
+            shadeBlock(heap, id);
+            heap->cycleRoots++;
+        }
+    }
+    drainGrey(heap, budget);
+
+    if (heap->rootCursor == heap->blockLimit && heap->greyCount == 0) {
+        heap->marking = false;
+        if (heap->cycleRoots == 0) {
+            EMIT(heap, .type = HEAP_EVENT_GC_NO_ROOTS);
+        }
+        if (heap->lazySweep) {
+            startSweep(heap);
+            endCollection(heap, 0, false);
+        } else {
+            endCollection(heap, sweepBlocks(heap), false);
+        }
+    }
+}
+
+// Run after every successful allocation in incremental mode, with the
+// budget of the allocations made
+static void incrementalStep(Heap* heap, int budget) {
+    if (heap->marking) {
+        markSlice(heap, budget);
+    } else if (heap->liveBytes * 100 >= heap->totalMemory * INCREMENTAL_TRIGGER_PERCENT) {
+        // Finish the last cycle's lazy sweep, a chunk at a time, before
+        // marking again
+        if (heap->sweeping) {
+            sweepFor(heap, 0);
+        } else {
+            startCycle(heap);
+        }
+    }
+}
+
+// Generational collection. New blocks are young and listed in the nursery.
+// Once young blocks add up to nurseryBytes, a minor collection traces from
+// the young roots and from the remembered old blocks, following references
+// only into young blocks. It then frees the unmarked young blocks and ages
+// the rest; a block that has survived promoteAge minor collections becomes
+// old. addReference remembers old blocks that gain a young target, and a
+// promoted block that still points at young ones is remembered too, so a
+// minor collection never looks at the rest of the old generation. Blocks
+// are not moved: the nursery is a set of blocks, not a region of the arena.
+static inline bool inNursery(Heap* heap, int id, int slot) {
+    return blockIsYoung(heap, id) && BLK_NURSERY_SLOT(heap, id) == slot;
+}
+
+// Make every block old and empty both lists. Used when generational
+// collection is switched off or one of its lists cannot grow; with no young
+// blocks there is nothing to remember.
+static void tenureAll(Heap* heap) {
+    for (int i = 0; i < heap->nurseryCount; i++) {
+        int id = heap->nursery[i];
+        if (inNursery(heap, id, i)) {
+            BLK_AGE(heap, id) = 0;
+        }
+    }
+    for (int i = 0; i < heap->rememberedCount; i++) {
+        BLK_AGE(heap, heap->remembered[i]) &= ~AGE_REMEMBERED;
+    }
+    heap->nurseryCount = 0;
+    heap->rememberedCount = 0;
+    heap->youngBytes = 0;
+}
+
+static void addToNursery(Heap* heap, int id) {
+    if (!reserveIds(&heap->nursery, &heap->nurseryCapacity, heap->nurseryCount + 1)) {
+        tenureAll(heap);
+        return;
+    }
+    BLK_AGE(heap, id) = 1;
+    BLK_NURSERY_SLOT(heap, id) = heap->nurseryCount;
+    heap->nursery[heap->nurseryCount++] = id;
+    heap->youngBytes += blockSize(heap, id);
+}
+
+static void remember(Heap* heap, int id) {
+    if (BLK_AGE(heap, id) & AGE_REMEMBERED) return;
+
+    if (!reserveIds(&heap->remembered, &heap->rememberedCapacity, heap->rememberedCount + 1)) {
+        tenureAll(heap);
+        return;
+    }
+    BLK_AGE(heap, id) |= AGE_REMEMBERED;
+    heap->remembered[heap->rememberedCount++] = id;
+}
+
+static void rememberEdge(Heap* heap, int from, int to) {
+    if (from != NO_BLOCK && to != NO_BLOCK && !blockIsYoung(heap, from) && blockIsYoung(heap, to)) {
+        remember(heap, from);
+    }
+}
+
+static bool referencesYoung(Heap* heap, int id) {
+    BlockInfo* info = &BLK_INFO(heap, id);
+
+    for (int i = 0; i < info->numReferences; i++) {
+        int target = resolveRef(heap, info->references[i]);
+        if (target != NO_BLOCK && blockIsYoung(heap, target)) return true;
+    }
+    return false;
+}
+
+static void minorShade(Heap* heap, int id, int* top) {
+    if (!blockIsYoung(heap, id) || (BLK_AGE(heap, id) & AGE_MINOR_MARK)) return;
+
+    BLK_AGE(heap, id) |= AGE_MINOR_MARK;
+    heap->minorStack[(*top)++] = id;
+}
+
+// Shade the young targets of a block, dropping stale references
+static void minorScan(Heap* heap, int id, int* top) {
+    BlockInfo* info = &BLK_INFO(heap, id);
+
+    for (int i = 0; i < info->numReferences;) {
+        int target = resolveRef(heap, info->references[i]);
+        if (target == NO_BLOCK) {
+            info->numReferences--;
+            memmove(&info->references[i], &info->references[i + 1],
+                    (info->numReferences - i) * sizeof(HeapRef));
+            continue;
+        }
+        i++;
+        minorShade(heap, target, top);
+    }
+}
+
+// Returns the number of blocks freed
+static int minorCollect(Heap* heap) {
+    // Each young block is pushed at most once and each can be promoted into
+    // the remembered set, so neither list grows during the collection
+    if (!reserveIds(&heap->minorStack, &heap->minorCapacity, heap->nurseryCount) ||
+        !reserveIds(&heap->remembered, &heap->rememberedCapacity, heap->rememberedCount + heap->nurseryCount)) {
+        tenureAll(heap);
+        return 0;
+    }
+
+    EMIT(heap, .type = HEAP_EVENT_MINOR_GC_START);
+
+    int top = 0;
+    for (int i = 0; i < heap->nurseryCount; i++) {
+        int id = heap->nursery[i];
+        if (inNursery(heap, id, i) && (BLK_STATE(heap, id) & BLOCK_ROOT)) {
+            minorShade(heap, id, &top);
+        }
+    }
+    for (int i = 0; i < heap->rememberedCount; i++) {
+        if (BLK_AGE(heap, heap->remembered[i]) & AGE_REMEMBERED) {
+            minorScan(heap, heap->remembered[i], &top);
+        }
+    }
+    while (top > 0) {
+        minorScan(heap, heap->minorStack[--top], &top);
+    }
+
+    // Free, age or promote every young block, compacting the nursery. The
+    // young bytes are counted afresh from the blocks kept.
+    int freedCount = 0;
+    int promotedCount = 0;
+    int kept = 0;
+    int mergeCount = 0;
+    size_t youngBytes = 0;
+
+    for (int i = 0; i < heap->nurseryCount; i++) {
+        int id = heap->nursery[i];
+        if (!inNursery(heap, id, i)) continue;
+
+        unsigned char age = BLK_AGE(heap, id);
+        if (!(age & AGE_MINOR_MARK)) {
+            BlockInfo* info = &BLK_INFO(heap, id);
+            EMIT(heap, .type = HEAP_EVENT_SWEEP_FREE, .name = info->name, .size = blockSize(heap, id),
+                 .requestedSize = info->allocated_size);
+
+            heap->liveBytes -= blockSize(heap, id);
+            releaseBlock(heap, id);
+            coalesceBlock(heap, id, &mergeCount);
+            freedCount++;
+            continue;
+        }
+
+        age = (age & AGE_MASK) + 1;
+        if (age > heap->promoteAge) {
+            EMIT(heap, .type = HEAP_EVENT_PROMOTE, .name = BLK_INFO(heap, id).name, .size = blockSize(heap, id));
+            BLK_AGE(heap, id) = 0;
+            remember(heap, id);
+            promotedCount++;
+        } else {
+            BLK_AGE(heap, id) = age;
+            BLK_NURSERY_SLOT(heap, id) = kept;
+            heap->nursery[kept++] = id;
+            youngBytes += blockSize(heap, id);
+        }
+    }
+    heap->nurseryCount = kept;
+    heap->youngBytes = youngBytes;
+    reportMerges(heap, mergeCount);
+
+    // Keep only the old blocks that still point into the nursery. Clearing
+    // the flag first drops duplicate entries left by freed blocks.
+    int remembered = 0;
+    for (int i = 0; i < heap->rememberedCount; i++) {
+        int id = heap->remembered[i];
+        if (!(BLK_AGE(heap, id) & AGE_REMEMBERED)) continue;
+
+        BLK_AGE(heap, id) &= ~AGE_REMEMBERED;
+        if (referencesYoung(heap, id)) {
+            heap->remembered[remembered++] = id;
+        }
+    }
+    for (int i = 0; i < remembered; i++) {
+        BLK_AGE(heap, heap->remembered[i]) |= AGE_REMEMBERED;
+    }
+    heap->rememberedCount = remembered;
+
+    heap->stats.minorCollections++;
+    heap->stats.totalFreed += freedCount;
+    heap->stats.totalPromoted += promotedCount;
+
+    audit(heap, HEAP_AUDIT_MINOR_GC, NO_BLOCK, NULL, NULL, heap->stats.minorCollections, freedCount, false);
+    EMIT(heap, .type = HEAP_EVENT_MINOR_GC_END, .count = freedCount);
+    return freedCount;
+}
+
+// Take a block, sweeping first if a lazy sweep is under way
+static int takeSwept(Heap* heap, ThreadCache* cache, int cls, const Placement* placement) {
+    if (heap->sweeping) {
+        sweepFor(heap, cls);
+    }
+    return takeBlock(heap, cache, cls, placement);
+}
+
+// Grow the heap by a region and take from it
+static int growAndTake(Heap* heap, ThreadCache* cache, int cls, const Placement* placement) {
+    return growHeap(heap, cls) ? takeBlock(heap, cache, cls, placement) : NO_BLOCK;
+}
+
+// Retry a take that found no block, freeing space step by step: a minor
+// collection, then the cycle under way and just enough of its sweep, then
+// a full collection unless *collected says one has already run for this
+// operation. The cache is released around a full collection and taken again.
+// A growable heap adds a region before collecting while less than a heap's
+// worth has been allocated since the last collection, and after it otherwise.
+static int reclaimAndTake(Heap* heap, ThreadCache** cache, int cls, const Placement* placement, bool* collected) {
+    int id = NO_BLOCK;
+    if (cls >= MAX_FIB_CLASSES) return NO_BLOCK;
+
+    if (heap->nurseryCount > 0) {
+        minorCollect(heap);
+        id = takeBlock(heap, *cache, cls, placement);
+    }
+    if (id == NO_BLOCK && (heap->marking || heap->sweeping)) {
+        if (heap->marking) {
+            markSlice(heap, INT_MAX);
+        }
+        id = takeSwept(heap, *cache, cls, placement);
+    }
+    if (id == NO_BLOCK && __atomic_load_n(&heap->allocatedSinceGC, __ATOMIC_RELAXED) <
+                              __atomic_load_n(&heap->totalMemory, __ATOMIC_RELAXED)) {
+        id = growAndTake(heap, *cache, cls, placement);
+    }
+    if (id == NO_BLOCK && !*collected) {
+        *collected = true;
+        releaseCache(*cache);
+        collect(heap, true);
+        acquireCache(heap, cache);
+        id = takeSwept(heap, *cache, cls, placement);
+    }
+    if (id == NO_BLOCK) {
+        id = growAndTake(heap, *cache, cls, placement);
+    }
+    return id;
+}
+
+// Names are optional for blocks allocated by handle
+static HeapStatus checkName(const char* name, bool optional) {
+    if (name == NULL || name[0] == '\0') return optional ? HEAP_OK : HEAP_ERR_INVALID;
+    if (strlen(name) > 19) return HEAP_ERR_NAME_TOO_LONG;
+    return HEAP_OK;
+}
+
+static inline bool hasName(const char* name) {
+    return name != NULL && name[0] != '\0';
+}
+
+// Give a block the caller has taken its name, if any, and enter it in the
+// index. Returns false, leaving the block untouched, if the name is already
+// in use. Unnamed blocks are guarded by a shard picked by id.
+static bool bindBlock(Heap* heap, int id, char* name, size_t size, bool isRoot) {
+    int shardIndex = hasName(name) ? (int)(hashName(name) >> (32 - NAME_INDEX_SHARD_BITS))
+                                   : id & (NAME_INDEX_SHARDS - 1);
+    NameShard* shard = &heap->nameShards[shardIndex];
+    HEAP_LOCK(heap, &shard->lock);
+    if (hasName(name) && indexLookup(heap, shard, name) != NO_BLOCK) {
+        HEAP_UNLOCK(heap, &shard->lock);
+        return false;
+    }
+
+    BlockInfo* info = &BLK_INFO(heap, id);
+    copyName(info->name, name);
+    info->allocated_size = size;
+    __atomic_store_n(&info->shard, (unsigned char)shardIndex, __ATOMIC_RELAXED);
+    unsigned char state = BLK_STATE(heap, id) & ~(BLOCK_FREE | BLOCK_ROOT | BLOCK_CACHED);
+    storeBlockState(heap, id, isRoot ? (state | BLOCK_ROOT) : state);
+    if (hasName(name)) {
+        indexInsert(heap, shard, id);
+    }
+    HEAP_UNLOCK(heap, &shard->lock);
+
+    if (!heap->concurrent) {
+        heap->liveBytes += blockSize(heap, id);
+    }
+    __atomic_fetch_add(&heap->allocatedSinceGC, blockSize(heap, id), __ATOMIC_RELAXED);
+    if (heap->nurseryBytes > 0) {
+        addToNursery(heap, id);
+    }
+    if (heap->lazySweep) {
+        int blockClass = BLK_CLASS(heap, id);
+        BLOCK_CHUNK(heap, id)->usedClasses[blockClass / 64] |= 1ULL << (blockClass % 64);
+    }
+    if (heap->marking || heap->sweeping) {
+        blackenBlock(heap, id);
+    }
+    return true;
+}
+
+// Run a minor collection once the nursery is full. Allocations do this
+// before taking their block: a block just allocated is young and may be
+// neither a root nor referenced yet, so collecting after binding it would
+// free it before the caller had it.
+static void collectFullNursery(Heap* heap) {
+    if (heap->nurseryBytes > 0 && heap->youngBytes >= heap->nurseryBytes) {
+        minorCollect(heap);
+    }
+}
+
+static HeapRef placeBlock(Heap* heap, char* name, size_t size, bool isRoot, bool anonymous,
+                          const Placement* placement, void** memory) {
+    EMIT(heap, .type = HEAP_EVENT_ALLOC_REQUEST, .name = name, .requestedSize = size, .isRoot = isRoot);
+    collectFullNursery(heap);
+
+    ThreadCache* cache = NULL;
+    HeapStatus status = checkName(name, anonymous);
+    if (status == HEAP_OK && !acquireCache(heap, &cache)) {
+        status = HEAP_ERR_SYSTEM;
+    } else if (status == HEAP_OK && hasName(name) && findBlockByName(heap, name) != NO_BLOCK) {
+        status = HEAP_ERR_DUPLICATE_NAME;
+        releaseCache(cache);
+    }
+    if (status != HEAP_OK) {
+        EMIT(heap, .type = HEAP_EVENT_ALLOC_FAILED, .status = status, .name = name, .requestedSize = size);
+        return HEAP_NULL_REF;
+    }
+
+    int cls = fibClassFor(size);
+    int bestFit = takeBlock(heap, cache, cls, placement);
+
+    if (bestFit == NO_BLOCK) {
+        bool collected = false;
+        bestFit = reclaimAndTake(heap, &cache, cls, placement, &collected);
+        if (bestFit == NO_BLOCK) {
+            releaseCache(cache);
+            EMIT(heap, .type = HEAP_EVENT_ALLOC_FAILED, .status = HEAP_ERR_NO_SPACE, .name = name, .requestedSize = size);
+            return HEAP_NULL_REF;
+        }
+    }
+
+    // Another thread may have taken the name since the check above
+    if (!bindBlock(heap, bestFit, name, size, isRoot)) {
+        putBlock(heap, cache, bestFit);
+        releaseCache(cache);
+        EMIT(heap, .type = HEAP_EVENT_ALLOC_FAILED, .status = HEAP_ERR_DUPLICATE_NAME, .name = name, .requestedSize = size);
+        return HEAP_NULL_REF;
+    }
+
+    if (placement != NULL) {
+        BLK_INFO(heap, bestFit).alignShift = (unsigned char)__builtin_ctzll(placement->alignment);
+    }
+
+    STAT_ADD(heap, totalAllocations, 1);
+    audit(heap, HEAP_AUDIT_ALLOC, bestFit, name, NULL, size, 0, isRoot);
+
+    EMIT(heap, .type = HEAP_EVENT_ALLOC, .name = name, .size = blockSize(heap, bestFit),
+         .requestedSize = size, .offset = BLK_OFFSET(heap, bestFit), .isRoot = isRoot);
+    
+    HeapRef handle = makeRef(heap, bestFit);
+    *memory = heap->arena + BLK_OFFSET(heap, bestFit);
+    releaseCache(cache);
+
+    if (heap->sliceBudget > 0) {
+        incrementalStep(heap, heap->sliceBudget);
+    }
+    return handle;
+}
+
+// Allocate a block of at least size bytes, named unless anonymous blocks
+// are allowed. Returns a handle to it and its memory, or HEAP_NULL_REF with
+// the reason reported through HEAP_EVENT_ALLOC_FAILED.
+static HeapRef allocateBlock(Heap* heap, char* name, size_t size, bool isRoot, bool anonymous,
+                             const Placement* placement, void** memory) {
+    unsigned long long started = traceStart(heap);
+    HeapRef handle = placeBlock(heap, name, size, isRoot, anonymous, placement, memory);
+    if (started != 0) {
+        unsigned char flags = (anonymous ? TRACE_HANDLES : 0) | (isRoot ? TRACE_ROOT_FLAG : 0) |
+                              (handle == HEAP_NULL_REF ? TRACE_FAILED : 0);
+        unsigned char alignShift = 0;
+        if (placement != NULL) {
+            flags |= TRACE_ALIGNED | (placement->exactClass ? TRACE_EXACT_CLASS : 0);
+            alignShift = (unsigned char)__builtin_ctzll(placement->alignment);
+        }
+        TRACE(heap, started, .op = TRACE_ALLOC, .flags = flags, .alignShift = alignShift, .name = name,
+              .argCount = 2, .args = { size, handle });
+    }
+    return handle;
+}
+
+// Allocate a named block of at least size bytes. Returns a pointer into the
+// arena, or NULL with the reason reported through HEAP_EVENT_ALLOC_FAILED.
+void* allocate_memory(Heap* heap, char* name, size_t size, bool isRoot) {
+    void* memory = NULL;
+    allocateBlock(heap, name, size, isRoot, false, NULL, &memory);
+    return memory;
+}
+
+HeapRef allocate_handle(Heap* heap, char* name, size_t size, bool isRoot) {
+    void* memory;
+    return allocateBlock(heap, name, size, isRoot, true, NULL, &memory);
+}
+
+// A placement for the given alignment and flags, or false if the alignment
+// is not a power of two up to HEAP_MAX_ALIGNMENT
+static bool makePlacement(int alignment, int flags, Placement* placement) {
+    if (alignment < 1) alignment = 1;
+    if (alignment > HEAP_MAX_ALIGNMENT || (alignment & (alignment - 1)) != 0) return false;
+
+    placement->alignment = (size_t)alignment;
+    placement->exactClass = (flags & HEAP_ALLOC_EXACT_CLASS) != 0;
+    return true;
+}
+
+void* allocate_aligned(Heap* heap, char* name, size_t size, bool isRoot, int alignment, int flags) {
+    Placement placement;
+    void* memory = NULL;
+
+    if (!makePlacement(alignment, flags, &placement)) {
+        EMIT(heap, .type = HEAP_EVENT_ALLOC_FAILED, .status = HEAP_ERR_INVALID, .name = name, .requestedSize = size);
+        return NULL;
+    }
+    allocateBlock(heap, name, size, isRoot, false, &placement, &memory);
+    return memory;
+}
+
+HeapRef allocate_handle_aligned(Heap* heap, char* name, size_t size, bool isRoot, int alignment, int flags) {
+    Placement placement;
+    void* memory;
+
+    if (!makePlacement(alignment, flags, &placement)) {
+        EMIT(heap, .type = HEAP_EVENT_ALLOC_FAILED, .status = HEAP_ERR_INVALID, .name = name, .requestedSize = size);
+        return HEAP_NULL_REF;
+    }
+    return allocateBlock(heap, name, size, isRoot, true, &placement, &memory);
+}
+
+// Take a block out of the index, drop its name data and invalidate handles
+// to it, leaving it owned by the caller to put back. The block's shard is
+// locked, so handle operations never see it half freed.
+static void retireBlock(Heap* heap, NameShard* shard, int id) {
+    if (BLK_INFO(heap, id).name[0] != '\0') {
+        indexRemove(heap, shard, id);
+    }
+
+    size_t size = blockSize(heap, id);
+    if (!heap->concurrent) {
+        heap->liveBytes -= size;
+    }
+    if (blockIsYoung(heap, id)) {
+        heap->youngBytes -= size;
+    }
+    if (heap->refCounting) {
+        dropReferences(heap, id, true);
+    }
+    resetBlockInfo(heap, id);
+}
+
+// Retire a named block. Returns NO_BLOCK if there is no such block.
+static int unbindBlock(Heap* heap, char* name) {
+    NameShard* shard = nameShard(heap, name);
+    HEAP_LOCK(heap, &shard->lock);
+    int id = indexLookup(heap, shard, name);
+    if (id != NO_BLOCK) {
+        retireBlock(heap, shard, id);
+    }
+    HEAP_UNLOCK(heap, &shard->lock);
+    return id;
+}
+
+// Retire the block a handle names, copying its name out first. Returns
+// NO_BLOCK if the handle is stale.
+static int unbindHandle(Heap* heap, HeapRef handle, char* name) {
+    NameShard* shard = NULL;
+    int id = lockHandle(heap, handle, &shard);
+    if (id != NO_BLOCK) {
+        copyName(name, BLK_INFO(heap, id).name);
+        retireBlock(heap, shard, id);
+        HEAP_UNLOCK(heap, &shard->lock);
+    }
+    return id;
+}
+
+// Record a retired block as freed and put it back. Small blocks go to the
+// thread's cache in concurrent mode; everything else is coalesced with its
+// buddies right away.
+static void finishFree(Heap* heap, ThreadCache* cache, int id, char* name) {
+    int freedSize = blockSize(heap, id);
+    STAT_ADD(heap, totalManualFrees, 1);
+    audit(heap, HEAP_AUDIT_FREE, id, name, NULL, freedSize, 0, false);
+
+    EMIT(heap, .type = HEAP_EVENT_FREE, .name = name, .size = freedSize);
+
+    putBlock(heap, cache, id);
+    releaseCache(cache);
+
+    freeUnreferenced(heap);
+}
+
+static HeapStatus freeByName(Heap* heap, char* name) {
+    EMIT(heap, .type = HEAP_EVENT_FREE_REQUEST, .name = name);
+    
+    if (name == NULL) {
+        EMIT(heap, .type = HEAP_EVENT_FREE_FAILED, .status = HEAP_ERR_INVALID, .name = name);
+        return HEAP_ERR_INVALID;
+    }
+
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_FREE_FAILED, .status = HEAP_ERR_SYSTEM, .name = name);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    int id = unbindBlock(heap, name);
+    if (id == NO_BLOCK) {
+        releaseCache(cache);
+        EMIT(heap, .type = HEAP_EVENT_FREE_FAILED, .status = HEAP_ERR_NOT_FOUND, .name = name);
+        return HEAP_ERR_NOT_FOUND;
+    }
+
+    finishFree(heap, cache, id, name);
+    return HEAP_OK;
+}
+
+// Free a named block
+HeapStatus free_memory(Heap* heap, char* name) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = freeByName(heap, name);
+    TRACE(heap, started, .op = TRACE_FREE, .flags = status != HEAP_OK ? TRACE_FAILED : 0, .name = name);
+    return status;
+}
+
+// The block's name is only known once the handle has been checked, so
+// FREE_REQUEST comes after that and carries NULL for a stale handle
+static HeapStatus freeByHandle(Heap* heap, HeapRef block) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        EMIT(heap, .type = HEAP_EVENT_FREE_FAILED, .status = HEAP_ERR_SYSTEM);
+        return HEAP_ERR_SYSTEM;
+    }
+
+    char name[20];
+    int id = unbindHandle(heap, block, name);
+    EMIT(heap, .type = HEAP_EVENT_FREE_REQUEST, .name = id == NO_BLOCK ? NULL : name);
+    if (id == NO_BLOCK) {
+        releaseCache(cache);
+        EMIT(heap, .type = HEAP_EVENT_FREE_FAILED, .status = HEAP_ERR_NOT_FOUND);
+        return HEAP_ERR_NOT_FOUND;
+    }
+
+    finishFree(heap, cache, id, name);
+    return HEAP_OK;
+}
+
+HeapStatus free_handle(Heap* heap, HeapRef block) {
+    unsigned long long started = traceStart(heap);
+    HeapStatus status = freeByHandle(heap, block);
+    TRACE(heap, started, .op = TRACE_FREE, .flags = TRACE_HANDLES | (status != HEAP_OK ? TRACE_FAILED : 0),
+          .argCount = 1, .args = { block });
+    return status;
+}
+
+// Resizing. A block shrinks in place by splitting off its right halves,
+// keeping the left half at the same offset each time, and grows in place by
+// absorbing free buddies up its buddy tree. Absorbing a left buddy moves the
+// block's start down, so its contents are moved with it. Only when neither
+// works is the block relocated: its descriptor trades places with a block
+// of the new class, so its id, name, references and handles all survive.
+
+// Link two blocks as address neighbours; either may be NO_BLOCK
+static void linkNeighbours(Heap* heap, int prev, int next) {
+    if (prev != NO_BLOCK) {
+        BLK_NEXT(heap, prev) = next;
+    } else {
+        heap->head = next;
+    }
+    if (next != NO_BLOCK) {
+        BLK_PREV(heap, next) = prev;
+    }
+}
+
+// Fold a free buddy into an allocated block, which keeps its descriptor.
+// Central lock held.
+static void absorbBuddy(Heap* heap, int id, int buddy) {
+    bool idLeft = blockSide(heap, id) == BUDDY_LEFT;
+    int left = idLeft ? id : buddy;
+    int right = idLeft ? buddy : id;
+    BuddySide side = blockInherit(heap, left);
+    BuddySide inherit = blockInherit(heap, right);
+
+    EMIT(heap, .type = HEAP_EVENT_MERGE, .size = blockSize(heap, left), .otherSize = blockSize(heap, right));
+
+    removeFreeBlock(heap, buddy);
+    if (idLeft) {
+        linkNeighbours(heap, id, BLK_NEXT(heap, buddy));
+    } else {
+        linkNeighbours(heap, BLK_PREV(heap, buddy), id);
+        BLK_OFFSET(heap, id) = BLK_OFFSET(heap, buddy);
+    }
+    BLK_CLASS(heap, id) = (unsigned char)(BLK_CLASS(heap, left) + 1);
+    setBlockSides(heap, id, side, inherit);
+    releaseBlockId(heap, buddy);
+}
+
+// Whether absorbing free buddies can take a block up to class cls. Walks
+// the buddy tree without changing it: the region the block would cover runs
+// from lo to hi in address order. Central lock held.
+static bool canGrowTo(Heap* heap, int id, int cls) {
+    int lo = id;
+    int hi = id;
+    size_t offset = BLK_OFFSET(heap, id);
+    int regionClass = BLK_CLASS(heap, id);
+    BuddySide side = blockSide(heap, id);
+    BuddySide inherit = blockInherit(heap, id);
+
+    while (regionClass < cls) {
+        int buddy;
+        if (side == BUDDY_LEFT) {
+            buddy = BLK_NEXT(heap, hi);
+            if (buddy == NO_BLOCK || !blockIsFree(heap, buddy) || blockSide(heap, buddy) != BUDDY_RIGHT ||
+                BLK_CLASS(heap, buddy) != regionClass - 1 ||
+                BLK_OFFSET(heap, buddy) != offset + FIB_SIZES[regionClass]) return false;
+            side = inherit;
+            inherit = blockInherit(heap, buddy);
+            hi = buddy;
+            regionClass++;
+        } else if (side == BUDDY_RIGHT) {
+            buddy = BLK_PREV(heap, lo);
+            if (buddy == NO_BLOCK || !blockIsFree(heap, buddy) || blockSide(heap, buddy) != BUDDY_LEFT ||
+                BLK_CLASS(heap, buddy) != regionClass + 1 ||
+                BLK_OFFSET(heap, buddy) != offset - FIB_SIZES[regionClass + 1]) return false;
+            side = blockInherit(heap, buddy);
+            lo = buddy;
+            offset = BLK_OFFSET(heap, buddy);
+            regionClass += 2;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Resize a block in place to class cls, if its buddies allow. Returns
+// false, changing nothing, if they do not. Central lock held.
+static bool resizeInPlace(Heap* heap, int id, int cls) {
+    if (BLK_CLASS(heap, id) < cls) {
+        if (!canGrowTo(heap, id, cls)) return false;
+
+        while (BLK_CLASS(heap, id) < cls) {
+            int buddy = blockSide(heap, id) == BUDDY_LEFT ? BLK_NEXT(heap, id) : BLK_PREV(heap, id);
+            absorbBuddy(heap, id, buddy);
+        }
+        return true;
+    }
+
+    if (BLK_CLASS(heap, id) - 1 < cls || BLK_CLASS(heap, id) < 2) return true;
+
+    EMIT(heap, .type = HEAP_EVENT_SPLIT, .size = blockSize(heap, id));
+    while (BLK_CLASS(heap, id) - 1 >= cls && BLK_CLASS(heap, id) >= 2) {
+        int blockClass = BLK_CLASS(heap, id);
+        int right = newBlock(heap, BLK_OFFSET(heap, id) + FIB_SIZES[blockClass - 1], blockClass - 2,
+                             BUDDY_RIGHT, blockInherit(heap, id));
+
+        linkNeighbours(heap, right, BLK_NEXT(heap, id));
+        linkNeighbours(heap, id, right);
+        setBlockSides(heap, id, BUDDY_LEFT, blockSide(heap, id));
+        BLK_CLASS(heap, id) = (unsigned char)(blockClass - 1);
+
+        pushFreeBlock(heap, right);
+        EMIT(heap, .type = HEAP_EVENT_SPLIT_FREE, .size = blockSize(heap, right));
+    }
+    return true;
+}
+
+// Swap where two blocks sit in the arena, leaving everything else about
+// them in place. Central lock held.
+static void swapPlacement(Heap* heap, int a, int b) {
+    int aPrev = BLK_PREV(heap, a), aNext = BLK_NEXT(heap, a);
+    int bPrev = BLK_PREV(heap, b), bNext = BLK_NEXT(heap, b);
+
+    if (aNext == b) {
+        linkNeighbours(heap, aPrev, b);
+        linkNeighbours(heap, b, a);
+        linkNeighbours(heap, a, bNext);
+    } else if (bNext == a) {
+        linkNeighbours(heap, bPrev, a);
+        linkNeighbours(heap, a, b);
+        linkNeighbours(heap, b, aNext);
+    } else {
+        linkNeighbours(heap, aPrev, b);
+        linkNeighbours(heap, b, aNext);
+        linkNeighbours(heap, bPrev, a);
+        linkNeighbours(heap, a, bNext);
+    }
+
+    size_t offset = BLK_OFFSET(heap, a);
+    BLK_OFFSET(heap, a) = BLK_OFFSET(heap, b);
+    BLK_OFFSET(heap, b) = offset;
+
+    unsigned char cls = BLK_CLASS(heap, a);
+    BLK_CLASS(heap, a) = BLK_CLASS(heap, b);
+    BLK_CLASS(heap, b) = cls;
+
+    BuddySide side = blockSide(heap, a), inherit = blockInherit(heap, a);
+    setBlockSides(heap, a, blockSide(heap, b), blockInherit(heap, b));
+    setBlockSides(heap, b, side, inherit);
+}
+
+// Account for a block that changed size and move its contents if it moved.
+// The block's shard is locked.
+static void finishResize(Heap* heap, int id, size_t oldOffset, size_t oldSize, size_t newSize) {
+    BlockInfo* info = &BLK_INFO(heap, id);
+    size_t size = blockSize(heap, id);
+
+    if (BLK_OFFSET(heap, id) != oldOffset) {
+        size_t keep = info->allocated_size < newSize ? info->allocated_size : newSize;
+        if (keep > 0) {
+            memmove(heap->arena + BLK_OFFSET(heap, id), heap->arena + oldOffset, keep);
+        }
+    }
+    info->allocated_size = newSize;
+
+    if (!heap->concurrent) {
+        heap->liveBytes = heap->liveBytes - oldSize + size;
+    }
+    if (blockIsYoung(heap, id)) {
+        heap->youngBytes = heap->youngBytes - oldSize + size;
+    }
+    if (heap->lazySweep) {
+        int cls = BLK_CLASS(heap, id);
+        BLOCK_CHUNK(heap, id)->usedClasses[cls / 64] |= 1ULL << (cls % 64);
+    }
+
+    audit(heap, HEAP_AUDIT_RESIZE, id, info->name, NULL, newSize, size > INT_MAX ? INT_MAX : (int)size, false);
+    EMIT(heap, .type = HEAP_EVENT_RESIZE, .name = info->name, .size = size, .otherSize = oldSize,
+         .requestedSize = newSize, .offset = BLK_OFFSET(heap, id));
+}
+
+// Resize the block a handle names, which the caller has checked is
+// allocated. In place if possible; otherwise relocated to a block of the new
+// class, reclaiming space for it as an allocation would. The block is pinned
+// as a root meanwhile, so a collection cannot take it; only being freed by
+// another thread gives HEAP_ERR_NOT_FOUND.
+static HeapStatus resizeBlock(Heap* heap, ThreadCache** cache, HeapRef handle, size_t newSize, void** memory) {
+    int cls = fibClassFor(newSize);
+    if (cls >= MAX_FIB_CLASSES) return HEAP_ERR_NO_SPACE;
+
+    NameShard* shard = NULL;
+    int id = lockHandle(heap, handle, &shard);
+    if (id == NO_BLOCK) return HEAP_ERR_NOT_FOUND;
+
+    size_t oldOffset = BLK_OFFSET(heap, id);
+    size_t oldSize = blockSize(heap, id);
+    HEAP_LOCK(heap, &heap->lock);
+    bool resized = resizeInPlace(heap, id, cls);
+    HEAP_UNLOCK(heap, &heap->lock);
+
+    if (!resized) {
+        bool pinned = !(BLK_STATE(heap, id) & BLOCK_ROOT);
+        if (pinned) {
+            storeBlockState(heap, id, BLK_STATE(heap, id) | BLOCK_ROOT);
+            if (heap->marking || heap->sweeping) {
+                writeBarrier(heap, id);
+            }
+        }
+        // Nothing may be held while space is reclaimed
+        HEAP_UNLOCK(heap, &shard->lock);
+
+        int spare = takeBlock(heap, *cache, cls, NULL);
+        if (spare == NO_BLOCK) {
+            bool collected = false;
+            spare = reclaimAndTake(heap, cache, cls, NULL, &collected);
+        }
+
+        id = lockHandle(heap, handle, &shard);
+        if (id != NO_BLOCK && pinned) {
+            storeBlockState(heap, id, BLK_STATE(heap, id) & ~BLOCK_ROOT);
+        }
+        if (id == NO_BLOCK) {
+            if (spare != NO_BLOCK) {
+                putBlock(heap, *cache, spare);
+            }
+            return spare == NO_BLOCK ? HEAP_ERR_NO_SPACE : HEAP_ERR_NOT_FOUND;
+        }
+        if (spare == NO_BLOCK) {
+            HEAP_UNLOCK(heap, &shard->lock);
+            return HEAP_ERR_NO_SPACE;
+        }
+
+        int mergeCount = 0;
+        oldOffset = BLK_OFFSET(heap, id);
+        oldSize = blockSize(heap, id);
+        HEAP_LOCK(heap, &heap->lock);
+        swapPlacement(heap, id, spare);
+        // Copy out before the old place is coalesced away
+        size_t keep = BLK_INFO(heap, id).allocated_size < newSize ? BLK_INFO(heap, id).allocated_size : newSize;
+        if (keep > 0) {
+            memcpy(heap->arena + BLK_OFFSET(heap, id), heap->arena + oldOffset, keep);
+        }
+        returnBlock(heap, spare, &mergeCount);
+        reportMerges(heap, mergeCount);
+        HEAP_UNLOCK(heap, &heap->lock);
+        oldOffset = BLK_OFFSET(heap, id);
+    }
+
+    finishResize(heap, id, oldOffset, oldSize, newSize);
+    *memory = heap->arena + BLK_OFFSET(heap, id);
+    HEAP_UNLOCK(heap, &shard->lock);
+    return HEAP_OK;
+}
+
+// Resize a named block. Returns the block's memory, which only moves if the
+// block had to be relocated or grew into a buddy before it, or NULL with the
+// reason reported through HEAP_EVENT_RESIZE_FAILED; the block is then left as
+// it was.
+void* resize_memory(Heap* heap, char* name, size_t newSize) {
+    unsigned long long started = traceStart(heap);
+    ThreadCache* cache;
+    HeapStatus status = HEAP_ERR_INVALID;
+    void* memory = NULL;
+
+    if (name != NULL && acquireCache(heap, &cache)) {
+        HeapRef handle = 0;
+        status = findRefByName(heap, name, &handle) ? resizeBlock(heap, &cache, handle, newSize, &memory)
+                                                    : HEAP_ERR_NOT_FOUND;
+        releaseCache(cache);
+    } else if (name != NULL) {
+        status = HEAP_ERR_SYSTEM;
+    }
+
+    if (status != HEAP_OK) {
+        EMIT(heap, .type = HEAP_EVENT_RESIZE_FAILED, .status = status, .name = name, .requestedSize = newSize);
+    }
+    TRACE(heap, started, .op = TRACE_RESIZE, .flags = status != HEAP_OK ? TRACE_FAILED : 0, .name = name,
+          .argCount = 1, .args = { newSize });
+    return memory;
+}
+
+HeapStatus resizeByHandle(Heap* heap, HeapRef block, size_t newSize, void** memory) {
+    unsigned long long started = traceStart(heap);
+    ThreadCache* cache;
+    HeapStatus status = HEAP_ERR_SYSTEM;
+    void* moved = NULL;
+
+    if (acquireCache(heap, &cache)) {
+        status = resizeBlock(heap, &cache, block, newSize, &moved);
+        releaseCache(cache);
+    }
+
+    if (status != HEAP_OK) {
+        EMIT(heap, .type = HEAP_EVENT_RESIZE_FAILED, .status = status, .requestedSize = newSize);
+    } else if (memory != NULL) {
+        *memory = moved;
+    }
+    TRACE(heap, started, .op = TRACE_RESIZE, .flags = TRACE_HANDLES | (status != HEAP_OK ? TRACE_FAILED : 0),
+          .argCount = 2, .args = { newSize, block });
+    return status;
+}
+
+// Batches. Each name is looked up once, when its block is bound or freed,
+// but the blocks for a whole batch are taken from, or returned to, the
+// central free lists under one lock, with one coalescing pass, one
+// statistics update and one audit record. Blocks never go through the
+// thread caches. An allocation that finds no space reclaims it as
+// allocate_memory does, with at most one full collection per batch.
+
+// Clear the root bit a batch gave one of its blocks to keep it alive
+static void unpinBlock(Heap* heap, int id) {
+    NameShard* shard = blockShard(heap, id);
+    HEAP_LOCK(heap, &shard->lock);
+    storeBlockState(heap, id, BLK_STATE(heap, id) & ~BLOCK_ROOT);
+    HEAP_UNLOCK(heap, &shard->lock);
+}
+
+int allocate_batch(Heap* heap, HeapAllocRequest* requests, int count) {
+    unsigned long long started = traceStart(heap);
+    collectFullNursery(heap);
+    int* ids = count > 0 ? (int*)malloc(count * sizeof(int)) : NULL;
+    ThreadCache* cache = NULL;
+    HeapStatus batchStatus = HEAP_OK;
+    if (count > 0 && (ids == NULL || !acquireCache(heap, &cache))) {
+        batchStatus = HEAP_ERR_SYSTEM;
+    }
+
+    for (int i = 0; i < count; i++) {
+        HeapAllocRequest* request = &requests[i];
+        EMIT(heap, .type = HEAP_EVENT_ALLOC_REQUEST, .name = request->name, .requestedSize = request->size,
+             .isRoot = request->isRoot);
+
+        // Names in use are caught when the block is bound
+        request->memory = NULL;
+        request->status = batchStatus != HEAP_OK ? batchStatus : checkName(request->name, false);
+    }
+
+    int pending = 0;
+    if (batchStatus == HEAP_OK) {
+        HEAP_LOCK(heap, &heap->lock);
+        for (int i = 0; i < count; i++) {
+            ids[i] = NO_BLOCK;
+            if (requests[i].status == HEAP_OK) {
+                ids[i] = takeFreeBlock(heap, fibClassFor(requests[i].size));
+                pending += ids[i] == NO_BLOCK;
+            }
+        }
+        HEAP_UNLOCK(heap, &heap->lock);
+    }
+
+    // Bind what was taken before reclaiming space for the rest, since a
+    // collection would free blocks taken but not bound. Nothing references
+    // the batch's blocks yet, so while a collection may run they are bound
+    // as roots and only lose that at the end if they were not asked to be.
+    bool pinned = pending > 0;
+    int allocated = 0;
+    size_t requestedBytes = 0;
+    bool collected = false;
+    for (int pass = 0; pass < 2 && batchStatus == HEAP_OK; pass++) {
+        if (pass == 1 && pending == 0) break;
+
+        for (int i = 0; i < count; i++) {
+            HeapAllocRequest* request = &requests[i];
+            if (request->status != HEAP_OK || request->memory != NULL) continue;
+            if ((pass == 0) == (ids[i] == NO_BLOCK)) continue;
+
+            if (pass == 1) {
+                // Space reclaimed for an earlier request may be enough
+                int cls = fibClassFor(request->size);
+                ids[i] = takeBlock(heap, cache, cls, NULL);
+                if (ids[i] == NO_BLOCK) {
+                    ids[i] = reclaimAndTake(heap, &cache, cls, NULL, &collected);
+                }
+                if (ids[i] == NO_BLOCK) {
+                    request->status = HEAP_ERR_NO_SPACE;
+                    continue;
+                }
+            }
+            if (!bindBlock(heap, ids[i], request->name, request->size, request->isRoot || pinned)) {
+                putBlock(heap, cache, ids[i]);
+                request->status = HEAP_ERR_DUPLICATE_NAME;
+                continue;
+            }
+
+            request->memory = heap->arena + BLK_OFFSET(heap, ids[i]);
+            allocated++;
+            requestedBytes += request->size;
+            EMIT(heap, .type = HEAP_EVENT_ALLOC, .name = request->name, .size = blockSize(heap, ids[i]),
+                 .requestedSize = request->size, .offset = BLK_OFFSET(heap, ids[i]), .isRoot = request->isRoot);
+        }
+    }
+
+    for (int i = 0; i < count && pinned; i++) {
+        if (requests[i].memory != NULL && !requests[i].isRoot) {
+            unpinBlock(heap, ids[i]);
+        }
+    }
+
+    // Compaction may have moved the blocks taken before the collection
+    for (int i = 0; i < count && collected && heap->compaction; i++) {
+        if (requests[i].memory != NULL) {
+            requests[i].memory = heap->arena + BLK_OFFSET(heap, ids[i]);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (requests[i].status != HEAP_OK) {
+            EMIT(heap, .type = HEAP_EVENT_ALLOC_FAILED, .status = requests[i].status, .name = requests[i].name,
+                 .requestedSize = requests[i].size);
+        }
+    }
+
+    if (allocated > 0) {
+        STAT_ADD(heap, totalAllocations, allocated);
+        audit(heap, HEAP_AUDIT_ALLOC_BATCH, NO_BLOCK, NULL, NULL, requestedBytes, allocated, false);
+    }
+    releaseCache(cache);
+    free(ids);
+
+    if (heap->sliceBudget > 0 && allocated > 0) {
+        long long budget = (long long)heap->sliceBudget * allocated;
+        incrementalStep(heap, budget > INT_MAX ? INT_MAX : (int)budget);
+    }
+    if (started != 0) {
+        traceAllocBatch(heap, started, requests, count);
+    }
+    return allocated;
+}
+
+// Free blocks given by name or, when names is NULL, by handle
+static int freeBatch(Heap* heap, char** names, const HeapRef* handles, int count, HeapStatus* statuses) {
+    ThreadCache* cache;
+    if (!acquireCache(heap, &cache)) {
+        for (int i = 0; i < count; i++) {
+            EMIT(heap, .type = HEAP_EVENT_FREE_FAILED, .status = HEAP_ERR_SYSTEM, .name = names != NULL ? names[i] : NULL);
+            if (statuses != NULL) statuses[i] = HEAP_ERR_SYSTEM;
+        }
+        return 0;
+    }
+
+    // Without room to hold the blocks, each goes back on its own
+    int* ids = count > 0 ? (int*)malloc(count * sizeof(int)) : NULL;
+    int freed = 0;
+    size_t freedBytes = 0;
+
+    char nameBuffer[20];
+    for (int i = 0; i < count; i++) {
+        HeapStatus status = HEAP_ERR_INVALID;
+        int id = NO_BLOCK;
+        char* name;
+        if (names != NULL) {
+            name = names[i];
+            EMIT(heap, .type = HEAP_EVENT_FREE_REQUEST, .name = name);
+            if (name != NULL) {
+                id = unbindBlock(heap, name);
+                status = id == NO_BLOCK ? HEAP_ERR_NOT_FOUND : HEAP_OK;
+            }
+        } else {
+            id = unbindHandle(heap, handles[i], nameBuffer);
+            name = id == NO_BLOCK ? NULL : nameBuffer;
+            status = id == NO_BLOCK ? HEAP_ERR_NOT_FOUND : HEAP_OK;
+            EMIT(heap, .type = HEAP_EVENT_FREE_REQUEST, .name = name);
+        }
+        if (statuses != NULL) statuses[i] = status;
+
+        if (status != HEAP_OK) {
+            EMIT(heap, .type = HEAP_EVENT_FREE_FAILED, .status = status, .name = name);
+            continue;
+        }
+
+        EMIT(heap, .type = HEAP_EVENT_FREE, .name = name, .size = blockSize(heap, id));
+        freedBytes += blockSize(heap, id);
+        if (ids != NULL) {
+            ids[freed] = id;
+        } else {
+            putBlock(heap, cache, id);
+        }
+        freed++;
+    }
+
+    // Each block coalesces with buddies freed earlier in the batch, so one
+    // pass over the batch leaves nothing to merge
+    if (ids != NULL && freed > 0) {
+        int mergeCount = 0;
+        HEAP_LOCK(heap, &heap->lock);
+        for (int i = 0; i < freed; i++) {
+            returnBlock(heap, ids[i], &mergeCount);
+        }
+        reportMerges(heap, mergeCount);
+        HEAP_UNLOCK(heap, &heap->lock);
+    }
+    free(ids);
+
+    if (freed > 0) {
+        STAT_ADD(heap, totalManualFrees, freed);
+        audit(heap, HEAP_AUDIT_FREE_BATCH, NO_BLOCK, NULL, NULL, freedBytes, freed, false);
+    }
+    releaseCache(cache);
+
+    freeUnreferenced(heap);
+    return freed;
+}
+
+// A traced batch needs every entry's status, so one is kept here if the
+// caller did not ask for them
+static int tracedFreeBatch(Heap* heap, char** names, const HeapRef* handles, int count, HeapStatus* statuses) {
+    unsigned long long started = traceStart(heap);
+    if (started == 0 || count <= 0) {
+        return freeBatch(heap, names, handles, count, statuses);
+    }
+
+    HeapStatus* kept = statuses != NULL ? statuses : (HeapStatus*)malloc(count * sizeof(HeapStatus));
+    int freed = freeBatch(heap, names, handles, count, kept);
+    traceFreeBatch(heap, started, names, handles, count, kept);
+    if (kept != statuses) {
+        free(kept);
+    }
+    return freed;
+}
+
+int free_batch(Heap* heap, char** names, int count, HeapStatus* statuses) {
+    return tracedFreeBatch(heap, names, NULL, count, statuses);
+}
+
+int free_batch_handles(Heap* heap, const HeapRef* blocks, int count, HeapStatus* statuses) {
+    return tracedFreeBatch(heap, NULL, blocks, count, statuses);
+}
+
+// Heap images. An image is a header, the descriptor chunks, the reference
+// lists and the name index slots, followed by each region of the arena on a
+// page boundary so that it can be mapped straight from the file. The chunks
+// are stored as they are in memory, except that a block's reference list is
+// stored as one plus the index of its first reference, or NULL if it has
+// none, and the per-chunk collection state is cleared.
+#define IMAGE_MAGIC   "FIBHEAP"
+#define IMAGE_VERSION 2
+
+typedef struct ImageHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int headerBytes;      // sizeof(ImageHeader) and sizeof(BlockChunk), so
+    unsigned int chunkBytes;       // images with another layout are refused
+    unsigned int pageSize;
+    int blockLimit;
+    int head;
+    int spareBlocks;
+    int regionCount;
+    size_t totalMemory;
+    size_t maxMemory;
+    size_t liveBytes;
+    Region regions[MAX_REGIONS];
+    size_t arenaOffset[MAX_REGIONS];
+    int freeLists[MAX_FIB_CLASSES];
+    unsigned long long freeClassBitmap[FIB_BITMAP_WORDS];
+    int shardCapacity[NAME_INDEX_SHARDS];
+    int shardCount[NAME_INDEX_SHARDS];
+    GCStats stats;
+    size_t chunksOffset;
+    size_t referencesOffset;
+    size_t referenceCount;
+    size_t shardsOffset;
+    size_t metadataBytes;          // Everything before the arena, a whole number of pages
+    size_t imageBytes;
+} ImageHeader;
+
+static bool writeAt(FILE* file, size_t offset, const void* data, size_t size) {
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0 && fwrite(data, 1, size, file) == size;
+}
+
+// Lay the image of a stopped heap out in header
+static void planImage(Heap* heap, ImageHeader* header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header->version = IMAGE_VERSION;
+    header->headerBytes = sizeof(ImageHeader);
+    header->chunkBytes = sizeof(BlockChunk);
+    header->pageSize = (unsigned int)heap->pageSize;
+    header->blockLimit = heap->blockLimit;
+    header->head = heap->head;
+    header->spareBlocks = heap->spareBlocks;
+    header->regionCount = heap->regionCount;
+    header->totalMemory = heap->totalMemory;
+    header->maxMemory = heap->maxMemory;
+    memcpy(header->freeLists, heap->freeLists, sizeof(header->freeLists));
+    memcpy(header->freeClassBitmap, heap->freeClassBitmap, sizeof(header->freeClassBitmap));
+    header->stats = heap->stats;
+
+    // liveBytes is not kept in concurrent mode, so it is counted here
+    for (int id = heap->head; id != NO_BLOCK; id = BLK_NEXT(heap, id)) {
+        if (!blockIsFree(heap, id)) {
+            header->liveBytes += blockSize(heap, id);
+        }
+    }
+    for (int id = 0; id < heap->blockLimit; id++) {
+        header->referenceCount += BLK_INFO(heap, id).numReferences;
+    }
+
+    size_t chunkCount = (heap->blockLimit + BLOCK_CHUNK_SIZE - 1) >> BLOCK_CHUNK_SHIFT;
+    header->chunksOffset = roundToPage(heap, sizeof(ImageHeader));
+    header->referencesOffset = header->chunksOffset + chunkCount * sizeof(BlockChunk);
+    header->shardsOffset = header->referencesOffset + header->referenceCount * sizeof(HeapRef);
+
+    size_t offset = header->shardsOffset;
+    for (int i = 0; i < NAME_INDEX_SHARDS; i++) {
+        header->shardCapacity[i] = heap->nameShards[i].capacity;
+        header->shardCount[i] = heap->nameShards[i].count;
+        offset += heap->nameShards[i].capacity * sizeof(int);
+    }
+    header->metadataBytes = roundToPage(heap, offset);
+
+    offset = header->metadataBytes;
+    for (int r = 0; r < heap->regionCount; r++) {
+        header->regions[r] = (Region){ heap->regions[r].start, heap->regions[r].size, false };
+        header->arenaOffset[r] = offset;
+        offset += roundToPage(heap, heap->regions[r].size);
+    }
+    header->imageBytes = offset;
+}
+
+// Write the descriptor chunks, reference lists, name index and arena of a
+// stopped heap where header says
+static bool writeImage(Heap* heap, FILE* file, const ImageHeader* header) {
+    BlockChunk* scratch = (BlockChunk*)malloc(sizeof(BlockChunk));
+    if (scratch == NULL) return false;
+
+    bool written = true;
+    size_t chunkCount = (heap->blockLimit + BLOCK_CHUNK_SIZE - 1) >> BLOCK_CHUNK_SHIFT;
+    size_t refIndex = 0;
+    for (size_t c = 0; c < chunkCount && written; c++) {
+        memcpy(scratch, heap->chunks[c], sizeof(BlockChunk));
+        memset(scratch->age, 0, sizeof(scratch->age));
+        memset(scratch->usedClasses, 0, sizeof(scratch->usedClasses));
+        scratch->unswept = false;
+        for (int i = 0; i < BLOCK_CHUNK_SIZE; i++) {
+            BlockInfo* info = &scratch->info[i];
+            info->references = info->numReferences > 0 ? (HeapRef*)(uintptr_t)(refIndex + 1) : NULL;
+            info->refCapacity = 0;
+            refIndex += info->numReferences;
+        }
+        written = writeAt(file, header->chunksOffset + c * sizeof(BlockChunk), scratch, sizeof(BlockChunk));
+    }
+    free(scratch);
+
+    size_t offset = header->referencesOffset;
+    for (int id = 0; id < heap->blockLimit && written; id++) {
+        BlockInfo* info = &BLK_INFO(heap, id);
+        if (info->numReferences == 0) continue;
+        written = writeAt(file, offset, info->references, info->numReferences * sizeof(HeapRef));
+        offset += info->numReferences * sizeof(HeapRef);
+    }
+
+    offset = header->shardsOffset;
+    for (int i = 0; i < NAME_INDEX_SHARDS && written; i++) {
+        NameShard* shard = &heap->nameShards[i];
+        if (shard->capacity == 0) continue;
+        written = writeAt(file, offset, shard->slots, shard->capacity * sizeof(int));
+        offset += shard->capacity * sizeof(int);
+    }
+
+    for (int r = 0; r < heap->regionCount && written; r++) {
+        written = writeAt(file, header->arenaOffset[r], heap->arena + heap->regions[r].start, heap->regions[r].size);
+    }
+    return written && writeAt(file, 0, header, sizeof(ImageHeader));
+}
+
+HeapStatus heapSaveImage(Heap* heap, const char* path) {
+    if (path == NULL || path[0] == '\0') return HEAP_ERR_INVALID;
+
+    size_t pathLength = strlen(path);
+    char* tmpPath = (char*)malloc(pathLength + sizeof(".tmp"));
+    if (tmpPath == NULL) return HEAP_ERR_SYSTEM;
+    memcpy(tmpPath, path, pathLength);
+    memcpy(tmpPath + pathLength, ".tmp", sizeof(".tmp"));
+
+    // Cached blocks are put back so every free block is on a free list
+    stopTheWorld(heap);
+    flushAllCaches(heap);
+
+    ImageHeader header;
+    planImage(heap, &header);
+    FILE* file = fopen(tmpPath, "wb");
+    bool saved = file != NULL && writeImage(heap, file, &header) && fflush(file) == 0 &&
+                 ftruncate(fileno(file), (off_t)header.imageBytes) == 0 && fsync(fileno(file)) == 0;
+    if (file != NULL && fclose(file) != 0) {
+        saved = false;
+    }
+    saved = saved && rename(tmpPath, path) == 0;
+    if (!saved) {
+        unlink(tmpPath);
+    }
+
+    resumeTheWorld(heap);
+    free(tmpPath);
+    if (!saved) return HEAP_ERR_SYSTEM;
+
+    audit(heap, HEAP_AUDIT_SAVE, NO_BLOCK, NULL, NULL, header.imageBytes, header.blockLimit, false);
+    return HEAP_OK;
+}
+
+// Whether an image header describes an image this build wrote and the file
+// holds all of it
+static bool checkImage(const ImageHeader* header, size_t fileSize) {
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || header->version != IMAGE_VERSION ||
+        header->headerBytes != sizeof(ImageHeader) || header->chunkBytes != sizeof(BlockChunk) ||
+        header->pageSize != systemPageSize() || header->imageBytes != fileSize) {
+        return false;
+    }
+    if (header->regionCount < 1 || header->regionCount > MAX_REGIONS || header->blockLimit < 0 ||
+        header->blockLimit > MAX_BLOCK_CHUNKS * BLOCK_CHUNK_SIZE) {
+        return false;
+    }
+
+    size_t chunkCount = (header->blockLimit + BLOCK_CHUNK_SIZE - 1) >> BLOCK_CHUNK_SHIFT;
+    size_t slotBytes = 0;
+    for (int i = 0; i < NAME_INDEX_SHARDS; i++) {
+        if (header->shardCapacity[i] < 0 || header->shardCount[i] > header->shardCapacity[i]) return false;
+        slotBytes += header->shardCapacity[i] * sizeof(int);
+    }
+    if (header->referencesOffset != header->chunksOffset + chunkCount * sizeof(BlockChunk) ||
+        header->shardsOffset != header->referencesOffset + header->referenceCount * sizeof(HeapRef) ||
+        header->shardsOffset + slotBytes > header->metadataBytes || header->metadataBytes % header->pageSize != 0) {
+        return false;
+    }
+
+    // Regions ascend without overlapping, and only the first may be empty
+    size_t reserved = (header->maxMemory + header->pageSize - 1) & ~((size_t)header->pageSize - 1);
+    size_t end = 0;
+    size_t totalMemory = 0;
+    for (int r = 0; r < header->regionCount; r++) {
+        const Region* region = &header->regions[r];
+        size_t mapped = (region->size + header->pageSize - 1) & ~((size_t)header->pageSize - 1);
+        if (region->start % header->pageSize != 0 || region->start < end || region->size > reserved ||
+            region->start + mapped > reserved || (r > 0 && region->size == 0) ||
+            header->arenaOffset[r] < header->metadataBytes || header->arenaOffset[r] + mapped > header->imageBytes) {
+            return false;
+        }
+        end = region->start + region->size;
+        totalMemory += region->size;
+    }
+    return totalMemory == header->totalMemory;
+}
+
+// Point the loaded reference lists into the image. Returns false if one
+// lies outside it. The lists have no capacity, so they are never freed.
+static bool attachReferences(Heap* heap, const ImageHeader* header) {
+    HeapRef* references = (HeapRef*)(heap->image + header->referencesOffset);
+    bool attached = true;
+    for (int id = 0; id < heap->blockLimit; id++) {
+        BlockInfo* info = &BLK_INFO(heap, id);
+        size_t index = (uintptr_t)info->references - 1;
+        info->refCapacity = 0;
+        if (info->references == NULL ? info->numReferences != 0
+                                     : info->numReferences < 0 || index > header->referenceCount ||
+                                           (size_t)info->numReferences > header->referenceCount - index) {
+            info->references = NULL;
+            info->numReferences = 0;
+            attached = false;
+        } else if (info->references != NULL) {
+            info->references = references + index;
+        }
+    }
+    return attached;
+}
+
+// Whether the blocks from *cursor on form the buddy tree of class cls at
+// offset: one block covering all of it, or the trees of its LEFT and RIGHT
+// halves in turn. A LEFT half holds its parent's side and a RIGHT half the
+// side its parent inherited. Leaves *cursor after the tree's last block.
+static bool matchBuddyTree(Heap* heap, int* cursor, size_t offset, int cls, BuddySide side, BuddySide inherit) {
+    int id = *cursor;
+    if (id == NO_BLOCK || BLK_OFFSET(heap, id) != offset || BLK_CLASS(heap, id) > cls) return false;
+    if (BLK_CLASS(heap, id) == cls) {
+        *cursor = BLK_NEXT(heap, id);
+        return blockSide(heap, id) == side && blockInherit(heap, id) == inherit;
+    }
+    return cls >= 2 && matchBuddyTree(heap, cursor, offset, cls - 1, BUDDY_LEFT, side) &&
+           matchBuddyTree(heap, cursor, offset + FIB_SIZES[cls - 1], cls - 2, BUDDY_RIGHT, inherit);
+}
+
+// Check the state a heap took from an image before it goes live, so no id
+// or offset read from the file can lead outside the descriptor tables or
+// the arena. The blocks must tile the regions as carved and split buddy
+// trees, the free lists must hold exactly the free blocks, every other
+// descriptor must be spare, and the name index must hold only the named
+// blocks in use, each once.
+static HeapStatus checkLoadedHeap(Heap* heap, const ImageHeader* header) {
+    int limit = heap->blockLimit;
+    // 1 for a block in the arena, 2 once found on a free list or in the
+    // name index, 3 for a spare descriptor
+    unsigned char* seen = (unsigned char*)calloc(limit + 1, 1);
+    if (seen == NULL) return HEAP_ERR_SYSTEM;
+
+    // Images are written with no young blocks and nothing left to sweep
+    bool valid = true;
+    for (int id = 0; id < limit && valid; id++) {
+        const BlockInfo* info = &BLK_INFO(heap, id);
+        valid = memchr(info->name, '\0', sizeof(info->name)) != NULL && info->shard < NAME_INDEX_SHARDS &&
+                info->alignShift <= __builtin_ctz(HEAP_MAX_ALIGNMENT) && BLK_AGE(heap, id) == 0 &&
+                !BLOCK_CHUNK(heap, id)->unswept;
+    }
+
+    // The block list first, so the walks below only meet ids in range
+    int blocks = 0;
+    int freeBlocks = 0;
+    int namedBlocks = 0;
+    size_t liveBytes = 0;
+    int prev = NO_BLOCK;
+    for (int id = heap->head; id != NO_BLOCK && valid; id = BLK_NEXT(heap, id)) {
+        valid = id >= 0 && id < limit && seen[id] == 0 && BLK_PREV(heap, id) == prev &&
+                BLK_CLASS(heap, id) < MAX_FIB_CLASSES && !(BLK_STATE(heap, id) & (BLOCK_CACHED | BLOCK_SPARE));
+        if (!valid) break;
+
+        seen[id] = 1;
+        prev = id;
+        blocks++;
+        if (blockIsFree(heap, id)) {
+            freeBlocks++;
+        } else {
+            liveBytes += blockSize(heap, id);
+            namedBlocks += BLK_INFO(heap, id).name[0] != '\0';
+            valid = BLK_INFO(heap, id).allocated_size <= blockSize(heap, id);
+        }
+    }
+    valid = valid && liveBytes == header->liveBytes;
+
+    int cursor = heap->head;
+    for (int r = 0; r < header->regionCount && valid; r++) {
+        size_t offset = header->regions[r].start;
+        size_t remaining = header->regions[r].size;
+        while (remaining > 0 && valid) {
+            int cls = fibClassFor(remaining);
+            if (FIB_SIZES[cls] > remaining) cls--;
+            valid = matchBuddyTree(heap, &cursor, offset, cls, BUDDY_TOP, BUDDY_TOP);
+            offset += FIB_SIZES[cls];
+            remaining -= FIB_SIZES[cls];
+        }
+    }
+    valid = valid && cursor == NO_BLOCK;
+
+    unsigned long long bitmap[FIB_BITMAP_WORDS] = { 0 };
+    for (int cls = 0; cls < MAX_FIB_CLASSES && valid; cls++) {
+        prev = NO_BLOCK;
+        for (int id = heap->freeLists[cls]; id != NO_BLOCK && valid; id = BLK_NEXT_FREE(heap, id)) {
+            valid = id >= 0 && id < limit && seen[id] == 1 && blockIsFree(heap, id) &&
+                    BLK_CLASS(heap, id) == cls && BLK_PREV_FREE(heap, id) == prev;
+            if (!valid) break;
+
+            seen[id] = 2;
+            prev = id;
+            freeBlocks--;
+        }
+        if (heap->freeLists[cls] != NO_BLOCK) {
+            bitmap[cls / 64] |= 1ULL << (cls % 64);
+        }
+    }
+    valid = valid && freeBlocks == 0 && memcmp(bitmap, heap->freeClassBitmap, sizeof(bitmap)) == 0;
+
+    int spare = 0;
+    for (int id = heap->spareBlocks; id != NO_BLOCK && valid; id = BLK_NEXT_FREE(heap, id)) {
+        valid = id >= 0 && id < limit && seen[id] == 0 && BLK_STATE(heap, id) == (BLOCK_FREE | BLOCK_SPARE);
+        if (!valid) break;
+
+        seen[id] = 3;
+        spare++;
+    }
+    valid = valid && blocks + spare == limit;
+
+    // Lookups probe until an empty slot, so every shard in use needs one
+    for (int i = 0; i < NAME_INDEX_SHARDS && valid; i++) {
+        NameShard* shard = &heap->nameShards[i];
+        int count = 0;
+        valid = (shard->capacity & (shard->capacity - 1)) == 0 && (shard->capacity == 0 || shard->count < shard->capacity);
+        for (int slot = 0; slot < shard->capacity && valid; slot++) {
+            int id = shard->slots[slot];
+            if (id == NO_BLOCK) continue;
+
+            valid = id >= 0 && id < limit && seen[id] == 1 && !blockIsFree(heap, id) &&
+                    BLK_INFO(heap, id).name[0] != '\0' && BLK_INFO(heap, id).shard == i &&
+                    nameShard(heap, BLK_INFO(heap, id).name) == shard;
+            if (!valid) break;
+
+            seen[id] = 2;
+            count++;
+        }
+        valid = valid && count == shard->count;
+        namedBlocks -= count;
+    }
+    valid = valid && namedBlocks == 0;
+
+    free(seen);
+    return valid ? HEAP_OK : HEAP_ERR_BAD_IMAGE;
+}
+
+// Map an image's metadata and arena into a new heap and take its state
+static HeapStatus mapImage(Heap* heap, int fd, const ImageHeader* header) {
+    void* image = mmap(NULL, header->metadataBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) return HEAP_ERR_SYSTEM;
+    heap->image = (unsigned char*)image;
+    heap->imageSize = header->metadataBytes;
+
+    for (int r = 0; r < header->regionCount; r++) {
+        const Region* region = &header->regions[r];
+        if (region->size == 0) continue;
+        if (mmap(heap->arena + region->start, roundToPage(heap, region->size), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, (off_t)header->arenaOffset[r]) == MAP_FAILED) {
+            return HEAP_ERR_SYSTEM;
+        }
+        heap->regions[r] = *region;
+        heap->regionCount = r + 1;
+        heap->mappedEnd = roundToPage(heap, region->start + region->size);
+    }
+    heap->regionCount = header->regionCount;
+
+    int chunkCount = (header->blockLimit + BLOCK_CHUNK_SIZE - 1) >> BLOCK_CHUNK_SHIFT;
+    for (int c = 0; c < chunkCount; c++) {
+        heap->chunks[c] = (BlockChunk*)(heap->image + header->chunksOffset + c * sizeof(BlockChunk));
+    }
+    heap->imageChunks = chunkCount;
+    heap->blockLimit = header->blockLimit;
+    if (!attachReferences(heap, header)) return HEAP_ERR_BAD_IMAGE;
+
+    const int* slots = (const int*)(heap->image + header->shardsOffset);
+    for (int i = 0; i < NAME_INDEX_SHARDS; i++) {
+        NameShard* shard = &heap->nameShards[i];
+        if (header->shardCapacity[i] == 0) continue;
+        shard->slots = (int*)malloc(header->shardCapacity[i] * sizeof(int));
+        if (shard->slots == NULL) return HEAP_ERR_SYSTEM;
+        memcpy(shard->slots, slots, header->shardCapacity[i] * sizeof(int));
+        shard->capacity = header->shardCapacity[i];
+        shard->count = header->shardCount[i];
+        slots += header->shardCapacity[i];
+    }
+
+    heap->totalMemory = header->totalMemory;
+    heap->liveBytes = header->liveBytes;
+    heap->head = header->head;
+    heap->spareBlocks = header->spareBlocks;
+    memcpy(heap->freeLists, header->freeLists, sizeof(heap->freeLists));
+    memcpy(heap->freeClassBitmap, header->freeClassBitmap, sizeof(heap->freeClassBitmap));
+    heap->stats = header->stats;
+    return checkLoadedHeap(heap, header);
+}
+
+Heap* heapLoadImage(const char* path, bool concurrent, HeapStatus* status) {
+    HeapStatus result = HEAP_ERR_SYSTEM;
+    Heap* heap = NULL;
+    ImageHeader header;
+    struct stat info;
+
+    int fd = path != NULL ? open(path, O_RDONLY) : -1;
+    if (fd < 0) {
+        result = path != NULL ? HEAP_ERR_SYSTEM : HEAP_ERR_INVALID;
+    } else if (fstat(fd, &info) != 0) {
+        result = HEAP_ERR_SYSTEM;
+    } else if ((size_t)info.st_size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+               !checkImage(&header, (size_t)info.st_size)) {
+        result = HEAP_ERR_BAD_IMAGE;
+    } else if ((heap = newHeap(0, header.maxMemory, concurrent)) != NULL) {
+        result = mapImage(heap, fd, &header);
+        if (result != HEAP_OK) {
+            destroyHeap(heap);
+            heap = NULL;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (status != NULL) {
+        *status = result;
+    }
+    if (heap != NULL) {
+        audit(heap, HEAP_AUDIT_LOAD, NO_BLOCK, NULL, NULL, heap->totalMemory, heap->blockLimit, false);
+    }
+    return heap;
+}
+
+// Replay. Recorded handles are mapped to the ones the replayed allocations
+// return in an open-addressing table, keyed by the recorded handle, that
+// doubles when it is half full. A handle with no entry, because its
+// allocation failed in the replay or came from a batch, is replayed as
+// HEAP_NULL_REF, which is never valid.
+#define REPLAY_BUFFER_BYTES (1 << 20)
+
+typedef struct HandleMap {
+    HeapRef* keys;       // HEAP_NULL_REF marks an empty slot
+    HeapRef* values;
+    size_t capacity;     // Power of two
+    size_t count;
+} HandleMap;
+
+static inline size_t handleSlot(const HandleMap* map, HeapRef key) {
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (map->capacity - 1);
+}
+
+static bool mapInit(HandleMap* map, size_t capacity) {
+    map->keys = (HeapRef*)malloc(capacity * sizeof(HeapRef));
+    map->values = (HeapRef*)malloc(capacity * sizeof(HeapRef));
+    if (map->keys == NULL || map->values == NULL) {
+        free(map->keys);
+        free(map->values);
+        return false;
+    }
+    memset(map->keys, 0xff, capacity * sizeof(HeapRef));
+    map->capacity = capacity;
+    map->count = 0;
+    return true;
+}
+
+static HeapRef mapLookup(const HandleMap* map, HeapRef key) {
+    for (size_t i = handleSlot(map, key);; i = (i + 1) & (map->capacity - 1)) {
+        if (map->keys[i] == key) return map->values[i];
+        if (map->keys[i] == HEAP_NULL_REF) return HEAP_NULL_REF;
+    }
+}
+
+static bool mapInsert(HandleMap* map, HeapRef key, HeapRef value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        HandleMap grown;
+        if (!mapInit(&grown, map->capacity * 2)) return false;
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i] != HEAP_NULL_REF) {
+                mapInsert(&grown, map->keys[i], map->values[i]);
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+
+    size_t i = handleSlot(map, key);
+    while (map->keys[i] != HEAP_NULL_REF && map->keys[i] != key) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    if (map->keys[i] == HEAP_NULL_REF) {
+        map->count++;
+    }
+    map->keys[i] = key;
+    map->values[i] = value;
+    return true;
+}
+
+// Remove a key, shifting later entries of its probe run back so lookups
+// never stop early at the hole
+static void mapRemove(HandleMap* map, HeapRef key) {
+    size_t mask = map->capacity - 1;
+    size_t i = handleSlot(map, key);
+    while (map->keys[i] != key) {
+        if (map->keys[i] == HEAP_NULL_REF) return;
+        i = (i + 1) & mask;
+    }
+
+    for (size_t j = (i + 1) & mask; map->keys[j] != HEAP_NULL_REF; j = (j + 1) & mask) {
+        size_t home = handleSlot(map, map->keys[j]);
+        // An entry may fill the hole if its home slot is not after the hole
+        // on its way round to j
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            map->keys[i] = map->keys[j];
+            map->values[i] = map->values[j];
+            i = j;
+        }
+    }
+    map->keys[i] = HEAP_NULL_REF;
+    map->count--;
+}
+
+// A record as read back, with its name and target terminated
+typedef struct ReplayRecord {
+    TraceRecord header;
+    unsigned long long args[TRACE_MAX_ARGS];
+    char name[TRACE_MAX_NAME + 1];
+    char target[TRACE_MAX_NAME + 1];
+} ReplayRecord;
+
+static bool readRecord(FILE* file, ReplayRecord* record, bool* ended) {
+    *ended = false;
+    if (fread(&record->header, sizeof(record->header), 1, file) != 1) {
+        *ended = feof(file) && !ferror(file);
+        return false;
+    }
+
+    const TraceRecord* header = &record->header;
+    if (header->op >= TRACE_OP_COUNT || header->argCount > TRACE_MAX_ARGS) return false;
+    memset(record->args, 0, sizeof(record->args));
+    if (fread(record->args, sizeof(unsigned long long), header->argCount, file) != header->argCount ||
+        fread(record->name, 1, header->nameLength, file) != header->nameLength ||
+        fread(record->target, 1, header->targetLength, file) != header->targetLength) {
+        return false;
+    }
+    record->name[header->nameLength] = '\0';
+    record->target[header->targetLength] = '\0';
+    return true;
+}
+
+// Replay a single record other than a batch. Returns whether its outcome
+// matched the recorded one, or HEAP_ERR_SYSTEM in *status if the handle
+// table could not grow.
+static bool replayRecord(Heap* heap, HandleMap* map, const ReplayRecord* record, HeapStatus* status) {
+    const TraceRecord* header = &record->header;
+    bool handles = (header->flags & TRACE_HANDLES) != 0;
+    bool isRoot = (header->flags & TRACE_ROOT_FLAG) != 0;
+    char* name = (char*)record->name;
+    char* target = (char*)record->target;
+    HeapRef first = handles ? mapLookup(map, record->args[0]) : HEAP_NULL_REF;
+    bool succeeded = true;
+
+    switch ((TraceOpCode)header->op) {
+    case TRACE_ALLOC: {
+        size_t size = (size_t)record->args[0];
+        int alignment = 1 << header->alignShift;
+        int flags = (header->flags & TRACE_EXACT_CLASS) ? HEAP_ALLOC_EXACT_CLASS : 0;
+        HeapRef handle = HEAP_NULL_REF;
+
+        // allocate_handle behaves as allocate_memory for a named block and
+        // also returns its handle
+        if (!handles && name[0] == '\0') {
+            succeeded = allocate_memory(heap, name, size, isRoot) != NULL;
+        } else if (header->flags & TRACE_ALIGNED) {
+            handle = allocate_handle_aligned(heap, name, size, isRoot, alignment, flags);
+            succeeded = handle != HEAP_NULL_REF;
+        } else {
+            handle = allocate_handle(heap, name, size, isRoot);
+            succeeded = handle != HEAP_NULL_REF;
+        }
+        if (succeeded && header->argCount > 1 && record->args[1] != HEAP_NULL_REF &&
+            !mapInsert(map, record->args[1], handle)) {
+            *status = HEAP_ERR_SYSTEM;
+        }
+        break;
+    }
+    case TRACE_FREE:
+        if (handles) {
+            succeeded = free_handle(heap, first) == HEAP_OK;
+            if (succeeded) {
+                mapRemove(map, record->args[0]);
+            }
+        } else {
+            succeeded = free_memory(heap, name) == HEAP_OK;
+        }
+        break;
+    case TRACE_REF_ADD:
+        succeeded = (handles ? addReferenceByHandle(heap, first, mapLookup(map, record->args[1]))
+                             : addReference(heap, name, target)) == HEAP_OK;
+        break;
+    case TRACE_REF_REMOVE:
+        succeeded = (handles ? removeReferenceByHandle(heap, first, mapLookup(map, record->args[1]))
+                             : removeReference(heap, name, target)) == HEAP_OK;
+        break;
+    case TRACE_ROOT:
+        succeeded = (handles ? setRootByHandle(heap, first, isRoot) : setRoot(heap, name, isRoot)) == HEAP_OK;
+        break;
+    case TRACE_GC:
+        garbageCollect(heap);
+        break;
+    case TRACE_RESIZE:
+        if (handles) {
+            succeeded = resizeByHandle(heap, mapLookup(map, record->args[1]), (size_t)record->args[0], NULL) == HEAP_OK;
+        } else {
+            succeeded = resize_memory(heap, name, (size_t)record->args[0]) != NULL;
+        }
+        break;
+    default:
+        break;
+    }
+    return succeeded == ((header->flags & TRACE_FAILED) == 0);
+}
+
+// Read a batch's entries and replay them as one batch. Returns the number
+// of entries whose outcome differed, or -1 if the trace is bad.
+static long long replayBatch(Heap* heap, FILE* file, HandleMap* map, const ReplayRecord* batch,
+                             HeapReplayStats* stats, HeapStatus* status) {
+    unsigned long long count = batch->header.argCount > 0 ? batch->args[0] : 0;
+    bool allocating = batch->header.op == TRACE_ALLOC_BATCH;
+    bool handles = (batch->header.flags & TRACE_HANDLES) != 0;
+    if (count > INT_MAX) return -1;
+
+    HeapAllocRequest* requests = allocating ? (HeapAllocRequest*)calloc(count + 1, sizeof(HeapAllocRequest)) : NULL;
+    char** names = !allocating && !handles ? (char**)calloc(count + 1, sizeof(char*)) : NULL;
+    // Recorded handles, then the handles they map to
+    HeapRef* blocks = !allocating && handles ? (HeapRef*)calloc(2 * count + 1, sizeof(HeapRef)) : NULL;
+    HeapStatus* statuses = (HeapStatus*)calloc(count + 1, sizeof(HeapStatus));
+    bool* failed = (bool*)calloc(count + 1, sizeof(bool));
+    ReplayRecord* entry = (ReplayRecord*)malloc(sizeof(ReplayRecord));
+    long long diverged = 0;
+    bool ended;
+
+    if ((requests == NULL && names == NULL && blocks == NULL) || statuses == NULL || failed == NULL || entry == NULL) {
+        *status = HEAP_ERR_SYSTEM;
+        count = 0;
+    }
+
+    unsigned long long read = 0;
+    for (; read < count; read++) {
+        TraceOpCode expected = allocating ? TRACE_ALLOC : TRACE_FREE;
+        if (!readRecord(file, entry, &ended) || entry->header.op != expected) {
+            diverged = -1;
+            break;
+        }
+        stats->recordedNanos += entry->header.duration;
+        failed[read] = (entry->header.flags & TRACE_FAILED) != 0;
+
+        char* copy = NULL;
+        if (allocating || names != NULL) {
+            copy = strdup(entry->name);
+            if (copy == NULL) {
+                *status = HEAP_ERR_SYSTEM;
+                break;
+            }
+        }
+        if (allocating) {
+            requests[read].name = copy;
+            requests[read].size = (size_t)entry->args[0];
+            requests[read].isRoot = (entry->header.flags & TRACE_ROOT_FLAG) != 0;
+        } else if (names != NULL) {
+            names[read] = copy;
+        } else {
+            blocks[read] = entry->args[0];
+            blocks[count + read] = mapLookup(map, entry->args[0]);
+        }
+    }
+
+    if (diverged == 0 && *status == HEAP_OK) {
+        if (allocating) {
+            allocate_batch(heap, requests, (int)count);
+        } else if (names != NULL) {
+            free_batch(heap, names, (int)count, statuses);
+        } else {
+            free_batch_handles(heap, blocks + count, (int)count, statuses);
+        }
+        for (unsigned long long i = 0; i < count; i++) {
+            bool succeeded = allocating ? requests[i].status == HEAP_OK : statuses[i] == HEAP_OK;
+            if (succeeded == failed[i]) {
+                diverged++;
+            }
+            if (succeeded && blocks != NULL) {
+                mapRemove(map, blocks[i]);
+            }
+        }
+        stats->operations += count;
+    }
+
+    for (unsigned long long i = 0; i < read; i++) {
+        free(allocating ? requests[i].name : names != NULL ? names[i] : NULL);
+    }
+    free(requests);
+    free(names);
+    free(blocks);
+    free(statuses);
+    free(failed);
+    free(entry);
+    return diverged;
+}
+
+// Open a trace for reading through a large buffer, which *buffer is set to
+// and the caller frees after closing the file
+static FILE* openTrace(const char* path, char** buffer) {
+    FILE* file = fopen(path, "rb");
+    *buffer = NULL;
+    if (file == NULL) return NULL;
+    *buffer = (char*)malloc(REPLAY_BUFFER_BYTES);
+    if (*buffer != NULL) {
+        setvbuf(file, *buffer, _IOFBF, REPLAY_BUFFER_BYTES);
+    }
+    return file;
+}
+
+static bool readTraceHeader(FILE* file) {
+    TraceFileHeader header;
+    return fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0 &&
+           header.version == TRACE_VERSION && header.recordBytes == sizeof(TraceRecord);
+}
+
+HeapStatus heapReplayTrace(Heap* heap, const char* path, HeapReplayStats* stats) {
+    HeapReplayStats local;
+    if (stats == NULL) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    if (path == NULL) return HEAP_ERR_INVALID;
+
+    char* buffer;
+    FILE* file = openTrace(path, &buffer);
+    if (file == NULL) return HEAP_ERR_SYSTEM;
+
+    unsigned long long started = monotonicNanos();
+    HeapStatus status = HEAP_OK;
+    ReplayRecord* record = (ReplayRecord*)malloc(sizeof(ReplayRecord));
+    HandleMap map = { 0 };
+
+    if (record == NULL || !mapInit(&map, 1024)) {
+        status = HEAP_ERR_SYSTEM;
+    } else if (!readTraceHeader(file)) {
+        status = HEAP_ERR_BAD_TRACE;
+    }
+
+    bool ended = false;
+    while (status == HEAP_OK) {
+        if (!readRecord(file, record, &ended)) {
+            if (!ended) {
+                status = ferror(file) ? HEAP_ERR_SYSTEM : HEAP_ERR_BAD_TRACE;
+            }
+            break;
+        }
+        stats->recordedNanos += record->header.duration;
+
+        if (record->header.op == TRACE_ALLOC_BATCH || record->header.op == TRACE_FREE_BATCH) {
+            long long diverged = replayBatch(heap, file, &map, record, stats, &status);
+            if (diverged < 0) {
+                status = HEAP_ERR_BAD_TRACE;
+            } else {
+                stats->diverged += (unsigned long long)diverged;
+            }
+            continue;
+        }
+
+        if (!replayRecord(heap, &map, record, &status)) {
+            stats->diverged++;
+        }
+        stats->operations++;
+    }
+
+    stats->replayNanos = monotonicNanos() - started;
+    free(map.keys);
+    free(map.values);
+    free(record);
+    fclose(file);
+    free(buffer);
+    return status;
+}
+
+// Replay through libc. A recorded handle maps to its block's pointer or, for
+// a named block, to the key of its name with the low bit set, and name keys
+// map to pointers, so a block can be freed by handle or by name. Name keys
+// are 64-bit hashes; a collision could only leak a block or leave a free
+// unreplayed, never free a block twice. Blocks with neither a name nor a
+// handle are kept until the end.
+typedef struct MallocReplay {
+    HandleMap handles;
+    HandleMap names;
+    void** loose;
+    size_t looseCount;
+    size_t looseCapacity;
+} MallocReplay;
+
+// Even, so it can be tagged, and never HEAP_NULL_REF
+static HeapRef nameKey(const char* name) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
+    }
+    return hash & ~1ULL;
+}
+
+static bool keepLoose(MallocReplay* replay, void* memory) {
+    if (replay->looseCount == replay->looseCapacity) {
+        size_t capacity = replay->looseCapacity == 0 ? 1024 : replay->looseCapacity * 2;
+        void** loose = (void**)realloc(replay->loose, capacity * sizeof(void*));
+        if (loose == NULL) return false;
+        replay->loose = loose;
+        replay->looseCapacity = capacity;
+    }
+    replay->loose[replay->looseCount++] = memory;
+    return true;
+}
+
+// Find the map and key holding the pointer of the block a free or resize
+// names. Returns false if there is none.
+static bool findMallocBlock(MallocReplay* replay, const ReplayRecord* record, HeapRef handle, HandleMap** map,
+                            HeapRef* key) {
+    if (record->header.flags & TRACE_HANDLES) {
+        HeapRef value = mapLookup(&replay->handles, handle);
+        if (value == HEAP_NULL_REF) return false;
+        *map = (value & 1) ? &replay->names : &replay->handles;
+        *key = (value & 1) ? value & ~1ULL : handle;
+    } else {
+        *map = &replay->names;
+        *key = nameKey(record->name);
+    }
+    return mapLookup(*map, *key) != HEAP_NULL_REF;
+}
+
+// Replay an allocation, free or resize through malloc, free or realloc.
+// Failed operations have nothing to replay, and references, roots and
+// collections are no work for malloc. Returns false if the heap succeeded
+// where malloc did not; sets *status if a map could not grow.
+static bool replayMallocRecord(MallocReplay* replay, const ReplayRecord* record, HeapStatus* status) {
+    const TraceRecord* header = &record->header;
+    bool handles = (header->flags & TRACE_HANDLES) != 0;
+    HandleMap* map;
+    HeapRef key;
+    if (header->flags & TRACE_FAILED) return true;
+
+    switch ((TraceOpCode)header->op) {
+    case TRACE_ALLOC: {
+        size_t size = (size_t)record->args[0];
+        void* memory = NULL;
+        if (header->flags & TRACE_ALIGNED) {
+            size_t alignment = (size_t)1 << header->alignShift;
+            if (posix_memalign(&memory, alignment < sizeof(void*) ? sizeof(void*) : alignment, size) != 0) {
+                memory = NULL;
+            }
+        } else {
+            memory = malloc(size);
+        }
+        if (memory == NULL) return false;
+
+        bool named = record->name[0] != '\0';
+        HeapRef handle = header->argCount > 1 ? record->args[1] : HEAP_NULL_REF;
+        bool kept = named ? mapInsert(&replay->names, nameKey(record->name), (HeapRef)(uintptr_t)memory)
+                  : handle != HEAP_NULL_REF ? mapInsert(&replay->handles, handle, (HeapRef)(uintptr_t)memory)
+                                            : keepLoose(replay, memory);
+        if (!kept) {
+            free(memory);
+            *status = HEAP_ERR_SYSTEM;
+        } else if (named && handle != HEAP_NULL_REF && !mapInsert(&replay->handles, handle, nameKey(record->name) | 1)) {
+            *status = HEAP_ERR_SYSTEM;
+        }
+        return true;
+    }
+    case TRACE_FREE: {
+        HeapRef handle = handles ? record->args[0] : HEAP_NULL_REF;
+        if (!findMallocBlock(replay, record, handle, &map, &key)) return false;
+        free((void*)(uintptr_t)mapLookup(map, key));
+        mapRemove(map, key);
+        if (handles && map != &replay->handles) {
+            mapRemove(&replay->handles, handle);
+        }
+        return true;
+    }
+    case TRACE_RESIZE: {
+        HeapRef handle = handles ? record->args[1] : HEAP_NULL_REF;
+        if (!findMallocBlock(replay, record, handle, &map, &key)) return false;
+        void* moved = realloc((void*)(uintptr_t)mapLookup(map, key), (size_t)record->args[0]);
+        if (moved == NULL) return false;
+        if (!mapInsert(map, key, (HeapRef)(uintptr_t)moved)) {
+            *status = HEAP_ERR_SYSTEM;
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+static void freeMallocReplay(MallocReplay* replay) {
+    for (size_t i = 0; i < replay->names.capacity; i++) {
+        if (replay->names.keys[i] != HEAP_NULL_REF) {
+            free((void*)(uintptr_t)replay->names.values[i]);
+        }
+    }
+    for (size_t i = 0; i < replay->handles.capacity; i++) {
+        if (replay->handles.keys[i] != HEAP_NULL_REF && !(replay->handles.values[i] & 1)) {
+            free((void*)(uintptr_t)replay->handles.values[i]);
+        }
+    }
+    for (size_t i = 0; i < replay->looseCount; i++) {
+        free(replay->loose[i]);
+    }
+    free(replay->names.keys);
+    free(replay->names.values);
+    free(replay->handles.keys);
+    free(replay->handles.values);
+    free(replay->loose);
+}
+
+HeapStatus heapReplayTraceMalloc(const char* path, HeapReplayStats* stats) {
+    HeapReplayStats local;
+    if (stats == NULL) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    if (path == NULL) return HEAP_ERR_INVALID;
+
+    char* buffer;
+    FILE* file = openTrace(path, &buffer);
+    if (file == NULL) return HEAP_ERR_SYSTEM;
+
+    unsigned long long started = monotonicNanos();
+    HeapStatus status = HEAP_OK;
+    ReplayRecord* record = (ReplayRecord*)malloc(sizeof(ReplayRecord));
+    MallocReplay replay = { 0 };
+
+    if (record == NULL || !mapInit(&replay.handles, 1024) || !mapInit(&replay.names, 1024)) {
+        status = HEAP_ERR_SYSTEM;
+    } else if (!readTraceHeader(file)) {
+        status = HEAP_ERR_BAD_TRACE;
+    }
+
+    bool ended = false;
+    while (status == HEAP_OK) {
+        if (!readRecord(file, record, &ended)) {
+            if (!ended) {
+                status = ferror(file) ? HEAP_ERR_SYSTEM : HEAP_ERR_BAD_TRACE;
+            }
+            break;
+        }
+        stats->recordedNanos += record->header.duration;
+
+        // A batch's entries follow it as records of their own
+        if (record->header.op == TRACE_ALLOC_BATCH || record->header.op == TRACE_FREE_BATCH) continue;
+
+        if (!replayMallocRecord(&replay, record, &status)) {
+            stats->diverged++;
+        }
+        stats->operations++;
+    }
+
+    stats->replayNanos = monotonicNanos() - started;
+    freeMallocReplay(&replay);
+    free(record);
+    fclose(file);
+    free(buffer);
+    return status;
+}
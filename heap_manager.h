@@ -0,0 +1,339 @@
+#ifndef HEAP_MANAGER_H
+#define HEAP_MANAGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fibonacci buddy heap with mark-and-sweep garbage collection.
+//
+// The allocator core never prints. Everything it does is reported through
+// an optional event handler; with no handler installed no event is built.
+
+typedef struct Heap Heap;
+
+// Result of a heap operation
+typedef enum {
+    HEAP_OK,
+    HEAP_ERR_INVALID,          // NULL or empty name
+    HEAP_ERR_NAME_TOO_LONG,    // Names hold at most 19 characters
+    HEAP_ERR_DUPLICATE_NAME,
+    HEAP_ERR_NOT_FOUND,        // No allocated block with that name, or a stale handle
+    HEAP_ERR_NO_SPACE,         // No free block large enough, even after GC
+    HEAP_ERR_REF_EXISTS,
+    HEAP_ERR_REF_NOT_FOUND,
+    HEAP_ERR_SYSTEM,           // The system allocator or an I/O call failed
+    HEAP_ERR_BAD_IMAGE,        // Not a heap image this build can load
+    HEAP_ERR_BAD_TRACE         // Not a trace this build can replay, or one cut short
+} HeapStatus;
+
+typedef enum {
+    HEAP_EVENT_ALLOC_REQUEST,  // name, requestedSize, isRoot
+    HEAP_EVENT_ALLOC,          // name, size, requestedSize, offset, isRoot
+    HEAP_EVENT_ALLOC_FAILED,   // name, requestedSize, status
+    HEAP_EVENT_SPLIT,          // size of the block being split
+    HEAP_EVENT_SPLIT_FREE,     // size of a half put back on the free lists
+    HEAP_EVENT_MERGE,          // buddies of size and otherSize merged into one block
+    HEAP_EVENT_COALESCED,      // count merges done by one free or merge pass
+    HEAP_EVENT_FREE_REQUEST,   // name
+    HEAP_EVENT_FREE,           // name, size
+    HEAP_EVENT_FREE_FAILED,    // name, status
+    HEAP_EVENT_REF_ADD,        // name -> target
+    HEAP_EVENT_REF_REMOVE,     // name -> target
+    HEAP_EVENT_REF_FAILED,     // name -> target, status; name is the missing block for NOT_FOUND
+    HEAP_EVENT_ROOT,           // name, isRoot
+    HEAP_EVENT_ROOT_FAILED,    // name, status
+    HEAP_EVENT_GC_START,       // triggered when a failed allocation started the collection
+    HEAP_EVENT_GC_ROOT,        // name
+    HEAP_EVENT_GC_NO_ROOTS,
+    HEAP_EVENT_MARK,           // name, size, count = depth (0 when marking incrementally)
+    HEAP_EVENT_MARK_FOLLOW,    // target, count = depth (0 when marking incrementally)
+    HEAP_EVENT_SWEEP_START,
+    HEAP_EVENT_SWEEP_FREE,     // name, size, requestedSize
+    HEAP_EVENT_SWEEP_END,      // count blocks, size bytes
+    HEAP_EVENT_GC_END,         // count blocks freed
+    HEAP_EVENT_MINOR_GC_START,
+    HEAP_EVENT_PROMOTE,        // name, size; the block survived enough minor collections to become old
+    HEAP_EVENT_MINOR_GC_END,   // count blocks freed
+    HEAP_EVENT_RC_FREE,        // name, size; freed as soon as nothing referenced it
+    HEAP_EVENT_RESIZE,         // name, size, otherSize = previous size, requestedSize, offset
+    HEAP_EVENT_RESIZE_FAILED,  // name (NULL when resizing by handle), requestedSize, status
+    HEAP_EVENT_COMPACT,        // count blocks moved, size bytes moved
+    HEAP_EVENT_GROW,           // size bytes added as a new region at offset
+    HEAP_EVENT_SHRINK          // size bytes of free regions given back, count regions unmapped
+} HeapEventType;
+
+typedef struct HeapEvent {
+    HeapEventType type;
+    HeapStatus status;
+    const char* name;
+    const char* target;
+    size_t size;
+    size_t otherSize;
+    size_t requestedSize;
+    size_t offset;
+    int count;
+    bool isRoot;
+    bool triggered;
+} HeapEvent;
+
+typedef void (*HeapEventHandler)(const HeapEvent* event, void* context);
+
+// GC statistics of a heap
+typedef struct {
+    int totalCollections;
+    int totalFreed;
+    int lastFreedCount;
+    int totalAllocations;
+    int totalManualFrees;
+    int minorCollections;
+    int totalPromoted;
+    int totalRefCountFrees;
+    int totalCompactions;
+    int regionsAdded;
+    int regionsUnmapped;
+} GCStats;
+
+// A reference to a block: its id plus a generation that changes when the
+// block is freed, so references to freed blocks go stale instead of
+// pointing at whatever takes the id next
+typedef unsigned long long HeapRef;
+
+// A HeapRef that never names a block
+#define HEAP_NULL_REF (~0ULL)
+
+// Read-only view of one block, for heap walkers
+typedef struct HeapBlockView {
+    const char* name;
+    size_t offset;
+    size_t size;
+    size_t allocatedSize;
+    bool isFree;
+    bool isRoot;
+    int numReferences;
+    const HeapRef* references;    // May include stale references; see heapRefName
+} HeapBlockView;
+
+#define HEAP_NO_BLOCK -1
+
+// One allocation of a batch. name, size and isRoot are read; memory and
+// status are filled in.
+typedef struct HeapAllocRequest {
+    char* name;
+    size_t size;
+    bool isRoot;
+    void* memory;        // NULL if the allocation failed
+    HeapStatus status;
+} HeapAllocRequest;
+
+// Audit log. Every heap keeps its last HEAP_AUDIT_CAPACITY operations as
+// fixed-size binary records in a ring buffer; nothing is formatted until the
+// log is read.
+#define HEAP_AUDIT_CAPACITY 1024
+
+typedef enum {
+    HEAP_AUDIT_INIT,        // size = arena bytes, count = initial blocks
+    HEAP_AUDIT_ALLOC,       // name, size = requested bytes, isRoot
+    HEAP_AUDIT_FREE,        // name, size = block bytes
+    HEAP_AUDIT_MERGE,       // count merges
+    HEAP_AUDIT_REF_ADD,     // name -> target
+    HEAP_AUDIT_REF_REMOVE,  // name -> target
+    HEAP_AUDIT_ROOT,        // name, isRoot
+    HEAP_AUDIT_GC,          // size = collection number, count = blocks freed
+    HEAP_AUDIT_MINOR_GC,    // size = minor collection number, count = blocks freed
+    HEAP_AUDIT_RC_FREE,     // name, size = block bytes
+    HEAP_AUDIT_ALLOC_BATCH, // size = requested bytes, count = blocks allocated
+    HEAP_AUDIT_FREE_BATCH,  // size = block bytes, count = blocks freed
+    HEAP_AUDIT_RESIZE,      // name, size = requested bytes, count = block bytes
+    HEAP_AUDIT_COMPACT,     // size = bytes moved, count = blocks moved
+    HEAP_AUDIT_GROW,        // size = region bytes, count = regions
+    HEAP_AUDIT_SHRINK,      // size = bytes given back, count = regions unmapped
+    HEAP_AUDIT_SAVE,        // size = image bytes, count = descriptors
+    HEAP_AUDIT_LOAD         // size = arena bytes, count = descriptors
+} HeapAuditOp;
+
+typedef struct HeapAuditRecord {
+    unsigned long long timestamp;   // CLOCK_MONOTONIC, in nanoseconds
+    unsigned char op;               // HeapAuditOp
+    bool isRoot;
+    int block;                      // Block id, or HEAP_NO_BLOCK
+    size_t size;
+    int count;
+    // Names are copied because block ids are reused once a block is freed
+    char name[20];
+    char target[20];
+} HeapAuditRecord;
+
+Heap* initializeHeap(size_t totalMemory);
+// A heap that may be used from several threads at once. Each thread keeps a
+// small cache of free blocks per size class, so small allocations and frees
+// mostly avoid the shared state. Garbage collection stops all threads at
+// their next operation boundary. Event handlers are called from whichever
+// thread performs the operation; the walking functions below must not race
+// with other operations.
+Heap* initializeConcurrentHeap(size_t totalMemory);
+// A heap that starts with initialMemory bytes and grows up to maxMemory.
+// Address space for maxMemory is reserved up front, so block memory never
+// moves as the heap grows. When an allocation finds no free block, a new
+// region is mapped in rather than collecting, unless a heap's worth of
+// bytes has been allocated since the last collection; only a heap at its
+// limit always collects. After a full collection, free regions at the top
+// are unmapped and other wholly free regions are given back with madvise.
+Heap* initializeGrowableHeap(size_t initialMemory, size_t maxMemory, bool concurrent);
+void destroyHeap(Heap* heap);
+// Heap images. heapSaveImage writes the whole heap to a file: its regions,
+// blocks, names, roots and references, with offsets in place of pointers.
+// It writes to path.tmp and renames it over path, so an existing image is
+// replaced only once the new one is complete. heapLoadImage maps an image
+// back in copy-on-write, so loading costs about the same whatever the heap
+// size and block memory is only read from the file when it is touched. The
+// loaded heap has the same blocks at the same offsets, and handles saved
+// with the image stay valid. Settings (event handler, GC modes and threads)
+// and the audit log are not saved, and blocks start out old. Only images
+// with this build's image version and descriptor layout, written on a system
+// with the same page size, are loaded; anything else fails with
+// HEAP_ERR_BAD_IMAGE. The file must not be modified in place while a heap
+// loaded from it is alive. Returns NULL on failure, with the reason in
+// *status if status is not NULL.
+HeapStatus heapSaveImage(Heap* heap, const char* path);
+Heap* heapLoadImage(const char* path, bool concurrent, HeapStatus* status);
+
+// Tracing. While a trace is under way, every allocation, free, reference
+// and root change, resize and garbageCollect call is appended to a binary
+// trace file with its arguments, whether it succeeded, when it started and
+// how long it took. A batch is recorded as one record for the batch followed
+// by its entries. Settings, images and walks are not recorded, so a trace
+// should be replayed against a heap set up the same way. Starting a trace
+// stops any trace under way. heapStopTrace returns HEAP_ERR_SYSTEM if some
+// of the trace could not be written.
+HeapStatus heapStartTrace(Heap* heap, const char* path);
+HeapStatus heapStopTrace(Heap* heap);
+
+typedef struct HeapReplayStats {
+    unsigned long long operations;     // Operations replayed, counting each entry of a batch
+    unsigned long long diverged;       // Operations that succeeded where the recorded one failed, or the reverse
+    unsigned long long recordedNanos;  // Time the recorded operations took
+    unsigned long long replayNanos;    // Time the replay took, reading the trace included
+} HeapReplayStats;
+
+// Replay a trace against heap from a single thread as fast as it will go,
+// ignoring the recorded timing. Handles in the trace are mapped to the
+// handles the replayed allocations return. Returns HEAP_ERR_BAD_TRACE if the
+// file is not a trace or ends part way through a record; stats (which may
+// be NULL) then cover the operations replayed before that.
+HeapStatus heapReplayTrace(Heap* heap, const char* path, HeapReplayStats* stats);
+// Replay the allocations, frees and resizes of a trace through malloc, free
+// and realloc instead, as a baseline for heapReplayTrace. Failed operations
+// are skipped; diverged counts those malloc failed or could not find the
+// block of. Blocks still allocated at the end are freed after the timing.
+HeapStatus heapReplayTraceMalloc(const char* path, HeapReplayStats* stats);
+
+void heapSetEventHandler(Heap* heap, HeapEventHandler handler, void* context);
+// Number of threads a collection uses (default 1). With more than one,
+// large heaps are marked with work-stealing and swept in parallel; the
+// per-block MARK, MARK_FOLLOW and SWEEP_FREE events are then not reported.
+void heapSetGCThreads(Heap* heap, int threads);
+// Collect incrementally (sliceBudget > 0) instead of stopping the world when
+// an allocation fails. Once the heap is three quarters full each allocation
+// marks a little, about sliceBudget blocks, references and root checks, and
+// the allocation that finishes marking also sweeps. An allocation that finds
+// no space completes the cycle first. Ignored for concurrent heaps.
+void heapSetIncrementalGC(Heap* heap, int sliceBudget);
+// Collect young blocks separately (nurseryBytes > 0). Blocks start young;
+// once young blocks add up to nurseryBytes, a minor collection frees the
+// unreachable ones, tracing only young blocks and the old blocks known to
+// reference them. Blocks that survive promoteAge minor collections (at most
+// 62) become old and are only freed by full collections. Minor collections
+// report SWEEP_FREE for each block they free. Ignored for concurrent heaps.
+void heapSetGenerational(Heap* heap, size_t nurseryBytes, int promoteAge);
+// Count the references to each block and free a block, along with anything
+// that leaves unreferenced, as soon as its last reference is removed and it
+// is not a root. Dropping a block's root status counts too. A newly
+// allocated block is kept until that happens. Cycles are left to garbage
+// collection. Ignored for concurrent heaps.
+void heapSetRefCounting(Heap* heap, bool enabled);
+// Leave the sweep of collections started by allocations (including
+// incremental cycles) to later allocations, which sweep only until they find
+// a block. GC_END then comes right after marking with count 0, and the
+// SWEEP_FREE and SWEEP_END events follow as the sweep proceeds. An explicit
+// garbageCollect always sweeps in full. Ignored for concurrent heaps.
+void heapSetLazySweep(Heap* heap, bool lazy);
+// Compact the arena after every collection that sweeps in full, instead of
+// only merging free buddies. The allocated blocks are packed together,
+// keeping the alignment they were allocated with, so the free space forms
+// large blocks again; the heap is left as it was if they would not all fit.
+// Handles, names and references stay valid, but block memory moves, so
+// pointers from allocate_memory and the like are only good until the next
+// collection. Incremental cycles and lazily swept collections never compact.
+void heapSetCompaction(Heap* heap, bool enabled);
+
+void* allocate_memory(Heap* heap, char* name, size_t size, bool isRoot);
+HeapStatus free_memory(Heap* heap, char* name);
+HeapStatus addReference(Heap* heap, char* fromName, char* toName);
+HeapStatus removeReference(Heap* heap, char* fromName, char* toName);
+HeapStatus setRoot(Heap* heap, char* name, bool isRoot);
+int garbageCollect(Heap* heap);
+
+// Handle API. allocate_handle returns a HeapRef to the new block, or
+// HEAP_NULL_REF on failure; the name is optional (NULL or "") and only used
+// in events and the audit log. The other calls check the handle's
+// generation instead of looking a name up, and fail with HEAP_ERR_NOT_FOUND
+// once the block has been freed. Their events carry the block's name, empty
+// for unnamed blocks and NULL for stale handles. Named blocks can be used
+// through either API.
+HeapRef allocate_handle(Heap* heap, char* name, size_t size, bool isRoot);
+HeapStatus free_handle(Heap* heap, HeapRef block);
+HeapStatus addReferenceByHandle(Heap* heap, HeapRef from, HeapRef to);
+HeapStatus removeReferenceByHandle(Heap* heap, HeapRef from, HeapRef to);
+HeapStatus setRootByHandle(Heap* heap, HeapRef block, bool isRoot);
+// Memory of the block a handle names, or NULL if the handle is stale
+void* heapHandleMemory(Heap* heap, HeapRef handle);
+
+// Resize an allocated block, keeping its name, references, root status and
+// handles. Growing absorbs free buddies and shrinking splits off the tail,
+// both in place; only when that fails is the block relocated, which may
+// collect garbage first. The first min(old, new) requested bytes are kept.
+// resize_memory returns the block's memory, or NULL if it could not be
+// resized, in which case the block is unchanged. resizeByHandle stores the
+// memory in *memory.
+void* resize_memory(Heap* heap, char* name, size_t newSize);
+HeapStatus resizeByHandle(Heap* heap, HeapRef block, size_t newSize, void** memory);
+
+// Aligned allocation. The block starts on an alignment boundary (a power of
+// two up to HEAP_MAX_ALIGNMENT; 0 or 1 for none). It is carved out of a free
+// block by splitting toward an aligned offset, so it is still of the
+// smallest class that holds size and the halves split off go back on the
+// free lists. With HEAP_ALLOC_EXACT_CLASS only free blocks already of that
+// class are used, never split from larger ones, and the allocation fails
+// rather than break a large block up.
+#define HEAP_MAX_ALIGNMENT     4096
+#define HEAP_ALLOC_EXACT_CLASS 0x1
+
+void* allocate_aligned(Heap* heap, char* name, size_t size, bool isRoot, int alignment, int flags);
+HeapRef allocate_handle_aligned(Heap* heap, char* name, size_t size, bool isRoot, int alignment, int flags);
+
+// Allocate or free many blocks at once. Each entry succeeds or fails as the
+// single call would, with the same events, but the batch takes the free
+// lists once, coalesces in one pass and writes one audit record. Returns the
+// number of blocks allocated or freed. statuses may be NULL.
+int allocate_batch(Heap* heap, HeapAllocRequest* requests, int count);
+int free_batch(Heap* heap, char** names, int count, HeapStatus* statuses);
+int free_batch_handles(Heap* heap, const HeapRef* blocks, int count, HeapStatus* statuses);
+
+// Walk blocks in address order: for (b = heapFirstBlock(h); b != HEAP_NO_BLOCK; b = heapNextBlock(h, b))
+int heapFirstBlock(Heap* heap);
+int heapNextBlock(Heap* heap, int block);
+void heapInspectBlock(Heap* heap, int block, HeapBlockView* view);
+// Name of the block a reference points to, or NULL if it has been freed
+const char* heapRefName(Heap* heap, HeapRef ref);
+
+// Copy up to max audit records into records, most recent first. Returns the
+// number copied.
+int heapAuditRead(Heap* heap, HeapAuditRecord* records, int max);
+// Number of operations recorded since the heap was created, including those
+// the ring has since overwritten
+unsigned long long heapAuditTotal(Heap* heap);
+
+size_t heapTotalMemory(Heap* heap);
+const GCStats* heapGetStats(Heap* heap);
+
+#endif
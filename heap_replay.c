@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heap_manager.h"
+
+// Replays a trace recorded with heapStartTrace against a fresh growable
+// heap, with no event handler, and prints one summary line.
+//
+//     heap_replay trace [initialBytes [maxBytes]]
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace [initialBytes [maxBytes]]\n", argv[0]);
+        return 2;
+    }
+
+    size_t totalMemory = argc > 2 ? strtoull(argv[2], NULL, 10) : 16000;
+    size_t maxMemory = argc > 3 ? strtoull(argv[3], NULL, 10) : (size_t)1 << 30;
+    Heap* heap = initializeGrowableHeap(totalMemory, maxMemory, false);
+    if (heap == NULL) {
+        fprintf(stderr, "Failed to initialize heap.\n");
+        return 1;
+    }
+
+    HeapReplayStats stats;
+    HeapStatus status = heapReplayTrace(heap, argv[1], &stats);
+    size_t finalMemory = heapTotalMemory(heap);
+    destroyHeap(heap);
+
+    if (status == HEAP_ERR_BAD_TRACE) {
+        fprintf(stderr, "%s: not a trace, or cut short after %llu operations\n", argv[1], stats.operations);
+        return 1;
+    } else if (status != HEAP_OK) {
+        fprintf(stderr, "%s: could not be read\n", argv[1]);
+        return 1;
+    }
+
+    double perOp = stats.operations > 0 ? (double)stats.replayNanos / stats.operations : 0.0;
+    printf("%llu operations, %llu diverged, recorded %.3f ms, replayed %.3f ms (%.1f ns/op), heap %zu bytes\n",
+           stats.operations, stats.diverged, stats.recordedNanos / 1e6, stats.replayNanos / 1e6, perOp, finalMemory);
+    return stats.diverged > 0 ? 3 : 0;
+}
@@ -0,0 +1,665 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap_manager.h"
+
+// Regression checks for the allocator. Each check prints where it failed;
+// the program exits with 1 if any did.
+//
+//     heap_test
+
+static int failures = 0;
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,   \
+                    #condition);                                                \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+// xorshift64*, so every run sees the same workload
+static unsigned long long nextRandom(unsigned long long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// Walk the blocks in address order. They must tile the heap exactly, with
+// no cycle.
+static bool blocksTileHeap(Heap* heap) {
+    HeapBlockView view;
+    size_t covered = 0;
+    size_t end = 0;
+    for (int block = heapFirstBlock(heap); block != HEAP_NO_BLOCK; block = heapNextBlock(heap, block)) {
+        heapInspectBlock(heap, block, &view);
+        if (view.offset < end || covered > heapTotalMemory(heap)) return false;
+        end = view.offset + view.size;
+        covered += view.size;
+    }
+    return covered == heapTotalMemory(heap);
+}
+
+// Random allocations, frees, references and collections, with a quarter
+// of the blocks rooted and the rest kept alive through references or not
+static void churn(Heap* heap, int operations, unsigned long long seed) {
+    HeapRef blocks[512];
+    for (int i = 0; i < 512; i++) blocks[i] = HEAP_NULL_REF;
+
+    for (int i = 0; i < operations; i++) {
+        unsigned long long r = nextRandom(&seed);
+        int slot = (int)(r % 512);
+        switch ((r >> 16) % 8) {
+        case 0:
+            free_handle(heap, blocks[slot]);
+            blocks[slot] = HEAP_NULL_REF;
+            break;
+        case 1:
+            addReferenceByHandle(heap, blocks[slot], blocks[(r >> 24) % 512]);
+            break;
+        case 2:
+            if ((r >> 32) % 64 == 0) garbageCollect(heap);
+            break;
+        default:
+            blocks[slot] = allocate_handle(heap, NULL, 1 + (r >> 32) % 2000, (r >> 40) % 4 == 0);
+            break;
+        }
+    }
+}
+
+// Fill a heap with rooted blocks, large then small, so nothing more fits.
+// Returns how many it took.
+static int fillHeap(Heap* heap, HeapRef* blocks, int max) {
+    int count = 0;
+    while (count < max && (blocks[count] = allocate_handle(heap, NULL, 3000, true)) != HEAP_NULL_REF) count++;
+    while (count < max && (blocks[count] = allocate_handle(heap, NULL, 10, true)) != HEAP_NULL_REF) count++;
+    return count;
+}
+
+// Marking follows a chain far deeper than the C stack would allow a
+// recursive trace to go, and keeps every link of it
+static void testDeepChainIsMarked(void) {
+    int length = 200000;
+    Heap* heap = initializeHeap(64 << 20);
+    HeapRef head = allocate_handle(heap, NULL, 10, true);
+    HeapRef previous = head;
+    for (int i = 1; i < length; i++) {
+        HeapRef next = allocate_handle(heap, NULL, 10, false);
+        CHECK(next != HEAP_NULL_REF);
+        CHECK(addReferenceByHandle(heap, previous, next) == HEAP_OK);
+        previous = next;
+    }
+    CHECK(garbageCollect(heap) == 0);
+    CHECK(heapHandleMemory(heap, previous) != NULL);
+
+    CHECK(setRootByHandle(heap, head, false) == HEAP_OK);
+    CHECK(garbageCollect(heap) == length);
+    CHECK(blocksTileHeap(heap));
+    destroyHeap(heap);
+}
+
+// A parallel collection of a random graph, large enough to be marked and
+// swept by several threads, frees exactly the blocks a serial one does
+static void testParallelCollectionMatchesSerial(void) {
+    int count = 20000;
+    HeapRef* blocks[2];
+    int freed[2];
+
+    for (int run = 0; run < 2; run++) {
+        Heap* heap = initializeHeap(16 << 20);
+        heapSetGCThreads(heap, run == 0 ? 1 : 4);
+        unsigned long long seed = 7;
+        blocks[run] = (HeapRef*)malloc(count * sizeof(HeapRef));
+        for (int i = 0; i < count; i++) {
+            blocks[run][i] = allocate_handle(heap, NULL, 16, nextRandom(&seed) % 32 == 0);
+        }
+        for (int i = 0; i < 2 * count; i++) {
+            unsigned long long r = nextRandom(&seed);
+            addReferenceByHandle(heap, blocks[run][r % count], blocks[run][(r >> 32) % count]);
+        }
+        freed[run] = garbageCollect(heap);
+        for (int i = 0; i < count; i++) {
+            if (heapHandleMemory(heap, blocks[run][i]) == NULL) blocks[run][i] = HEAP_NULL_REF;
+        }
+        CHECK(blocksTileHeap(heap));
+        destroyHeap(heap);
+    }
+
+    CHECK(freed[0] > 0 && freed[0] < count);
+    CHECK(freed[0] == freed[1]);
+    for (int i = 0; i < count; i++) {
+        CHECK((blocks[0][i] == HEAP_NULL_REF) == (blocks[1][i] == HEAP_NULL_REF));
+    }
+    free(blocks[0]);
+    free(blocks[1]);
+}
+
+// While incremental cycles run, a block is handed back and forth between
+// two roots, gaining its new referrer before losing the old one. The
+// barriers must keep it alive when it moves to a root already scanned.
+static void testIncrementalBarrierKeepsMovedBlock(void) {
+    Heap* heap = initializeHeap(1 << 16);
+    heapSetIncrementalGC(heap, 32);
+    HeapRef roots[2] = { allocate_handle(heap, NULL, 10, true), allocate_handle(heap, NULL, 10, true) };
+    // Scanning a root uses up a slice, so marking stops between the two
+    for (int i = 0; i < 128; i++) {
+        CHECK(addReferenceByHandle(heap, roots[i % 2], allocate_handle(heap, NULL, 10, false)) == HEAP_OK);
+    }
+    HeapRef moved = allocate_handle(heap, NULL, 10, false);
+    CHECK(addReferenceByHandle(heap, roots[0], moved) == HEAP_OK);
+    strcpy((char*)heapHandleMemory(heap, moved), "moved");
+
+    // Blocks of 89 and 55 bytes tile their parents, so the heap reaches
+    // the incremental trigger before it fills. The block is moved at
+    // random, so sometimes to the root marking has just scanned.
+    unsigned long long seed = 3;
+    int holder = 0;
+    for (int i = 0; i < 20000; i++) {
+        allocate_handle(heap, NULL, i % 2 ? 50 : 80, false);
+        if (nextRandom(&seed) % 2 == 0) continue;
+        CHECK(addReferenceByHandle(heap, roots[1 - holder], moved) == HEAP_OK);
+        CHECK(removeReferenceByHandle(heap, roots[holder], moved) == HEAP_OK);
+        holder = 1 - holder;
+
+        char* memory = (char*)heapHandleMemory(heap, moved);
+        CHECK(memory != NULL);
+        if (memory == NULL) break;
+        CHECK(strcmp(memory, "moved") == 0);
+    }
+    CHECK(heapGetStats(heap)->totalCollections > 10);
+    destroyHeap(heap);
+}
+
+// The root an incremental cycle scanned first, once it has been scanned
+typedef struct MarkWatch {
+    char scanned[20];
+    bool marking;
+} MarkWatch;
+
+static void watchMarking(const HeapEvent* event, void* context) {
+    MarkWatch* watch = (MarkWatch*)context;
+    if (event->type == HEAP_EVENT_GC_START) {
+        watch->marking = true;
+        watch->scanned[0] = '\0';
+    } else if (event->type == HEAP_EVENT_MARK && watch->scanned[0] == '\0') {
+        strcpy(watch->scanned, event->name);
+    } else if (event->type == HEAP_EVENT_GC_END) {
+        watch->marking = false;
+    }
+}
+
+// A garbage block that gains a referrer part way through marking, from a
+// root already scanned, is kept by the barrier on adding references
+static void testIncrementalBarrierKeepsRescuedBlock(void) {
+    Heap* heap = initializeHeap(1 << 16);
+    MarkWatch watch = { "", false };
+    heapSetIncrementalGC(heap, 32);
+    heapSetEventHandler(heap, watchMarking, &watch);
+    HeapRef roots[2] = { allocate_handle(heap, "left", 10, true), allocate_handle(heap, "right", 10, true) };
+    for (int i = 0; i < 128; i++) {
+        CHECK(addReferenceByHandle(heap, roots[i % 2], allocate_handle(heap, NULL, 10, false)) == HEAP_OK);
+    }
+    CHECK(allocate_memory(heap, "rescued", 10, false) != NULL);
+
+    bool rescued = false;
+    for (int i = 0; i < 20000 && !rescued; i++) {
+        allocate_handle(heap, NULL, i % 2 ? 50 : 80, false);
+        if (watch.marking && watch.scanned[0] != '\0') {
+            CHECK(addReference(heap, watch.scanned, "rescued") == HEAP_OK);
+            rescued = true;
+        }
+    }
+    CHECK(rescued);
+    for (int i = 0; i < 1000; i++) {
+        allocate_handle(heap, NULL, i % 2 ? 50 : 80, false);
+    }
+    CHECK(!watch.marking);
+    CHECK(free_memory(heap, "rescued") == HEAP_OK);
+    heapSetEventHandler(heap, NULL, NULL);
+    destroyHeap(heap);
+}
+
+// A block allocated as the nursery fills is not rooted or referenced yet,
+// so the minor collection it sets off must not free it
+static void testFreshBlockSurvivesMinorCollection(void) {
+    Heap* heap = initializeHeap(1 << 20);
+    heapSetGenerational(heap, 4096, 2);
+
+    for (int i = 0; i < 200; i++) {
+        HeapRef block = allocate_handle(heap, NULL, 100, false);
+        CHECK(block != HEAP_NULL_REF);
+        CHECK(heapHandleMemory(heap, block) != NULL);
+    }
+    CHECK(heapGetStats(heap)->minorCollections > 0);
+
+    char name[20];
+    for (int i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "young%d", i);
+        CHECK(allocate_memory(heap, name, 100, false) != NULL);
+        CHECK(free_memory(heap, name) == HEAP_OK);
+    }
+    destroyHeap(heap);
+}
+
+// A full collection that frees young garbage takes it out of the young
+// byte count, so the nursery does not fill early. Enough blocks are used
+// for the parallel sweep to run when there are GC threads.
+static void testFullCollectionFreesNurseryBytes(int gcThreads) {
+    Heap* heap = initializeHeap(8 << 20);
+    heapSetGCThreads(heap, gcThreads);
+    heapSetGenerational(heap, 200000, 2);
+
+    // 9000 blocks of 13 bytes
+    for (int i = 0; i < 9000; i++) {
+        CHECK(allocate_handle(heap, NULL, 10, false) != HEAP_NULL_REF);
+    }
+    CHECK(garbageCollect(heap) == 9000);
+
+    // 1000 blocks of 144 bytes, which only overflow the nursery if the
+    // garbage is still counted
+    int minorCollections = heapGetStats(heap)->minorCollections;
+    for (int i = 0; i < 1000; i++) {
+        CHECK(allocate_handle(heap, NULL, 100, true) != HEAP_NULL_REF);
+    }
+    CHECK(heapGetStats(heap)->minorCollections == minorCollections);
+    destroyHeap(heap);
+}
+
+// With reference counting, losing the last referrer or root status frees a
+// block and what it alone kept at once; cycles wait for a collection
+static void testRefCountingFreesAtOnce(void) {
+    Heap* heap = initializeHeap(1 << 16);
+    heapSetRefCounting(heap, true);
+    HeapRef root = allocate_handle(heap, NULL, 10, true);
+    HeapRef chain[2] = { allocate_handle(heap, NULL, 10, false), allocate_handle(heap, NULL, 10, false) };
+    HeapRef fresh = allocate_handle(heap, NULL, 10, false);
+    CHECK(addReferenceByHandle(heap, root, chain[0]) == HEAP_OK);
+    CHECK(addReferenceByHandle(heap, chain[0], chain[1]) == HEAP_OK);
+
+    CHECK(removeReferenceByHandle(heap, root, chain[0]) == HEAP_OK);
+    CHECK(heapHandleMemory(heap, chain[0]) == NULL);
+    CHECK(heapHandleMemory(heap, chain[1]) == NULL);
+    CHECK(heapHandleMemory(heap, fresh) != NULL);
+    CHECK(heapGetStats(heap)->totalRefCountFrees == 2);
+
+    HeapRef unrooted = allocate_handle(heap, NULL, 10, true);
+    CHECK(setRootByHandle(heap, unrooted, false) == HEAP_OK);
+    CHECK(heapHandleMemory(heap, unrooted) == NULL);
+
+    HeapRef cycle[2] = { allocate_handle(heap, NULL, 10, false), allocate_handle(heap, NULL, 10, false) };
+    CHECK(addReferenceByHandle(heap, root, cycle[0]) == HEAP_OK);
+    CHECK(addReferenceByHandle(heap, cycle[0], cycle[1]) == HEAP_OK);
+    CHECK(addReferenceByHandle(heap, cycle[1], cycle[0]) == HEAP_OK);
+    CHECK(removeReferenceByHandle(heap, root, cycle[0]) == HEAP_OK);
+    CHECK(heapHandleMemory(heap, cycle[0]) != NULL);
+    CHECK(heapGetStats(heap)->totalRefCountFrees == 3);
+    CHECK(heapGetStats(heap)->totalCollections == 0);
+
+    // The cycle and the block never referenced
+    CHECK(garbageCollect(heap) == 3);
+    CHECK(heapHandleMemory(heap, cycle[1]) == NULL);
+    CHECK(heapHandleMemory(heap, root) != NULL);
+    destroyHeap(heap);
+}
+
+// Compaction recycles the descriptors of the places it fills. A lazy sweep
+// walks descriptor ids, so it must never take a recycled one for garbage.
+static void testLazySweepWithCompaction(void) {
+    Heap* heap = initializeHeap(1 << 20);
+    heapSetLazySweep(heap, true);
+    heapSetCompaction(heap, true);
+
+    churn(heap, 40000, 1);
+    CHECK(heapGetStats(heap)->totalCompactions > 0);
+    CHECK(blocksTileHeap(heap));
+    garbageCollect(heap);
+    CHECK(blocksTileHeap(heap));
+    destroyHeap(heap);
+}
+
+// A batch that has to collect for some of its blocks must keep the ones it
+// already took, rooted or not
+static void testBatchKeepsBlocksThroughCollection(void) {
+    Heap* heap = initializeHeap(16000);
+    HeapRef garbage[256];
+
+    // Fill the heap with blocks, then leave one small place free and make
+    // everything else garbage
+    int count = fillHeap(heap, garbage, 256);
+    CHECK(count > 1 && count < 256);
+    free_handle(heap, garbage[--count]);
+    for (int i = 0; i < count; i++) {
+        setRootByHandle(heap, garbage[i], false);
+    }
+
+    HeapAllocRequest requests[] = {
+        { .name = "a", .size = 10, .isRoot = false },
+        { .name = "b", .size = 3000, .isRoot = true },
+        { .name = "b", .size = 10, .isRoot = false },
+    };
+    int collections = heapGetStats(heap)->totalCollections;
+    CHECK(allocate_batch(heap, requests, 3) == 2);
+    CHECK(requests[0].status == HEAP_OK && requests[1].status == HEAP_OK);
+    CHECK(requests[2].status == HEAP_ERR_DUPLICATE_NAME);
+    CHECK(heapGetStats(heap)->totalCollections == collections + 1);
+
+    // Both blocks survived the batch's collection, and only the one asked
+    // to be a root is one
+    CHECK(addReference(heap, "b", "a") == HEAP_OK);
+    garbageCollect(heap);
+    CHECK(removeReference(heap, "b", "a") == HEAP_OK);
+    garbageCollect(heap);
+    CHECK(free_memory(heap, "a") == HEAP_ERR_NOT_FOUND);
+    CHECK(free_memory(heap, "b") == HEAP_OK);
+    destroyHeap(heap);
+}
+
+// A handle goes stale when its block is freed and stays stale when the
+// block's descriptor is reused. Named blocks work through either API.
+static void testStaleHandles(void) {
+    Heap* heap = initializeHeap(1 << 16);
+    HeapRef named = allocate_handle(heap, "named", 10, true);
+    HeapRef block = allocate_handle(heap, NULL, 10, true);
+    CHECK(named != HEAP_NULL_REF && block != HEAP_NULL_REF);
+    CHECK(addReference(heap, "named", "named") == HEAP_OK);
+    CHECK(removeReferenceByHandle(heap, named, named) == HEAP_OK);
+
+    CHECK(free_handle(heap, block) == HEAP_OK);
+    CHECK(heapHandleMemory(heap, block) == NULL);
+    CHECK(free_handle(heap, block) == HEAP_ERR_NOT_FOUND);
+    CHECK(addReferenceByHandle(heap, named, block) == HEAP_ERR_NOT_FOUND);
+
+    // The same descriptor, with a new generation
+    HeapRef reused = allocate_handle(heap, NULL, 10, true);
+    CHECK(reused != HEAP_NULL_REF && reused != block);
+    CHECK((unsigned int)reused == (unsigned int)block);
+    CHECK(heapHandleMemory(heap, block) == NULL);
+    CHECK(setRootByHandle(heap, block, false) == HEAP_ERR_NOT_FOUND);
+    CHECK(heapHandleMemory(heap, reused) != NULL);
+
+    CHECK(free_memory(heap, "named") == HEAP_OK);
+    CHECK(free_handle(heap, named) == HEAP_ERR_NOT_FOUND);
+    destroyHeap(heap);
+}
+
+// Shrinking splits off the tail and growing absorbs free buddies, so
+// neither relocates the block. In a heap of one buddy tree, growing into a
+// buddy before the block moves it down and keeps its contents.
+static void testResizeInPlace(void) {
+    Heap* heap = initializeHeap(1597);
+    char* memory = (char*)allocate_memory(heap, "a", 100, true);
+    CHECK(memory != NULL);
+    memset(memory, 'a', 100);
+
+    CHECK(resize_memory(heap, "a", 40) == memory);
+    CHECK(resize_memory(heap, "a", 200) == memory);
+    CHECK(memory[0] == 'a' && memory[39] == 'a');
+
+    char* grown = (char*)resize_memory(heap, "a", 1000);
+    CHECK(grown != NULL && grown < memory);
+    CHECK(grown != NULL && grown[0] == 'a' && grown[39] == 'a');
+
+    HeapBlockView view;
+    heapInspectBlock(heap, heapFirstBlock(heap), &view);
+    CHECK(view.offset == 0 && view.size == 1597 && view.allocatedSize == 1000);
+    CHECK(blocksTileHeap(heap));
+    destroyHeap(heap);
+}
+
+// A block that cannot grow where it is moves, keeping its contents,
+// references, root status and handle
+static void testResizeRelocates(void) {
+    Heap* heap = initializeHeap(1 << 20);
+    HeapRef a = allocate_handle(heap, "a", 100, true);
+    HeapRef b = allocate_handle(heap, "b", 100, false);
+    CHECK(addReference(heap, "a", "b") == HEAP_OK);
+    char* before = (char*)heapHandleMemory(heap, a);
+    memset(before, 'a', 100);
+
+    void* memory = NULL;
+    CHECK(resizeByHandle(heap, a, 5000, &memory) == HEAP_OK);
+    CHECK(memory != NULL && memory != before && memory == heapHandleMemory(heap, a));
+    CHECK(((char*)memory)[0] == 'a' && ((char*)memory)[99] == 'a');
+
+    garbageCollect(heap);
+    CHECK(heapHandleMemory(heap, b) != NULL);
+    CHECK(resize_memory(heap, "a", 20000) != NULL);
+    CHECK(blocksTileHeap(heap));
+    destroyHeap(heap);
+}
+
+// Relocating in a full heap collects for the space. The block being
+// resized is neither a root nor referenced, but must come through it.
+static void testResizeSurvivesCollection(void) {
+    Heap* heap = initializeHeap(16000);
+    HeapRef garbage[256];
+    char* memory = (char*)allocate_memory(heap, "x", 10, true);
+    memset(memory, 'x', 10);
+    int count = fillHeap(heap, garbage, 256);
+    CHECK(count > 0 && count < 256);
+    CHECK(setRoot(heap, "x", false) == HEAP_OK);
+    for (int i = 0; i < count; i++) {
+        setRootByHandle(heap, garbage[i], false);
+    }
+
+    int collections = heapGetStats(heap)->totalCollections;
+    memory = (char*)resize_memory(heap, "x", 3000);
+    CHECK(memory != NULL);
+    CHECK(heapGetStats(heap)->totalCollections == collections + 1);
+    CHECK(memory != NULL && memory[0] == 'x' && memory[9] == 'x');
+
+    // The garbage is gone and x is not left a root
+    int allocated = 0;
+    for (int block = heapFirstBlock(heap); block != HEAP_NO_BLOCK; block = heapNextBlock(heap, block)) {
+        HeapBlockView view;
+        heapInspectBlock(heap, block, &view);
+        if (!view.isFree) {
+            CHECK(strcmp(view.name, "x") == 0 && !view.isRoot && view.allocatedSize == 3000);
+            allocated++;
+        }
+    }
+    CHECK(allocated == 1);
+
+    // With no space at all the block is left as it was
+    CHECK(setRoot(heap, "x", true) == HEAP_OK);
+    CHECK(resize_memory(heap, "x", 20000) == NULL);
+    CHECK(free_memory(heap, "x") == HEAP_OK);
+    destroyHeap(heap);
+}
+
+static int countBlocks(Heap* heap) {
+    int count = 0;
+    for (int block = heapFirstBlock(heap); block != HEAP_NO_BLOCK; block = heapNextBlock(heap, block)) count++;
+    return count;
+}
+
+// Aligned blocks start on the boundary asked for and are still of the
+// smallest class that holds them. An exact-class allocation only takes a
+// free block already of its class.
+static void testAlignedAndExactClassPlacement(void) {
+    Heap* heap = initializeHeap(1 << 20);
+    HeapBlockView view;
+    char name[20];
+
+    for (int alignment = 1; alignment <= HEAP_MAX_ALIGNMENT; alignment *= 4) {
+        snprintf(name, sizeof(name), "aligned%d", alignment);
+        char* memory = (char*)allocate_aligned(heap, name, 100, true, alignment, 0);
+        CHECK(memory != NULL);
+        if (memory == NULL) continue;
+        CHECK((uintptr_t)memory % alignment == 0);
+        for (int block = heapFirstBlock(heap); block != HEAP_NO_BLOCK; block = heapNextBlock(heap, block)) {
+            heapInspectBlock(heap, block, &view);
+            if (!view.isFree && strcmp(view.name, name) == 0) {
+                CHECK(view.offset % alignment == 0);
+                CHECK(view.size == 144);
+            }
+        }
+    }
+    CHECK(allocate_aligned(heap, "odd", 100, true, 24, 0) == NULL);
+    CHECK(allocate_aligned(heap, "huge", 100, true, 2 * HEAP_MAX_ALIGNMENT, 0) == NULL);
+    CHECK(blocksTileHeap(heap));
+    destroyHeap(heap);
+
+    // A fresh tree has no block of 55 bytes. A block of 50 bytes splits one
+    // off with a free buddy of 34, which the block of 30 takes, so freeing
+    // the first leaves a free block of its class. The next exact-class
+    // allocation must then fail rather than split the larger free blocks.
+    heap = initializeHeap(1597);
+    CHECK(allocate_aligned(heap, "exact", 50, true, 0, HEAP_ALLOC_EXACT_CLASS) == NULL);
+    char* first = (char*)allocate_memory(heap, "first", 50, true);
+    CHECK(allocate_memory(heap, "buddy", 30, true) != NULL);
+    CHECK(free_memory(heap, "first") == HEAP_OK);
+    CHECK(allocate_aligned(heap, "exact", 50, true, 0, HEAP_ALLOC_EXACT_CLASS) == first);
+
+    int blocks = countBlocks(heap);
+    CHECK(allocate_aligned(heap, "again", 50, true, 0, HEAP_ALLOC_EXACT_CLASS) == NULL);
+    CHECK(countBlocks(heap) == blocks);
+    CHECK(blocksTileHeap(heap));
+    destroyHeap(heap);
+}
+
+// A growable heap maps regions in as it fills, without moving the blocks
+// it has, and unmaps them again once a collection leaves them empty. Sizes
+// beyond 32 bits are not truncated.
+static void testGrowableHeapRegions(void) {
+    Heap* heap = initializeGrowableHeap(16000, 1 << 24, false);
+    HeapRef blocks[64];
+    char* first = (char*)allocate_memory(heap, "first", 100, true);
+    CHECK(first != NULL);
+    strcpy(first, "first");
+
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = allocate_handle(heap, NULL, 10000, true);
+        CHECK(blocks[i] != HEAP_NULL_REF);
+    }
+    CHECK(heapTotalMemory(heap) >= 64 * 10000);
+    CHECK(heapGetStats(heap)->regionsAdded > 0);
+    CHECK(heapGetStats(heap)->totalCollections == 0);
+    CHECK(blocksTileHeap(heap));
+    CHECK(strcmp(first, "first") == 0);
+
+    CHECK(allocate_memory(heap, "wide", ((size_t)1 << 32) + 10, true) == NULL);
+    CHECK(allocate_memory(heap, "beyond", (size_t)1 << 24, true) == NULL);
+
+    size_t grown = heapTotalMemory(heap);
+    for (int i = 0; i < 64; i++) {
+        setRootByHandle(heap, blocks[i], false);
+    }
+    CHECK(garbageCollect(heap) == 64);
+    CHECK(heapGetStats(heap)->regionsUnmapped > 0);
+    CHECK(heapTotalMemory(heap) < grown);
+    CHECK(blocksTileHeap(heap));
+    CHECK(strcmp(first, "first") == 0);
+    destroyHeap(heap);
+}
+
+// Restarting a trace onto the file being written must start it afresh
+static void testTraceRestartsOnSameFile(void) {
+    const char* path = "heap_test.trace";
+    Heap* heap = initializeHeap(1 << 20);
+
+    CHECK(heapStartTrace(heap, path) == HEAP_OK);
+    for (int i = 0; i < 1000; i++) {
+        allocate_handle(heap, NULL, 100, true);
+    }
+    CHECK(heapStartTrace(heap, path) == HEAP_OK);
+    allocate_handle(heap, NULL, 100, true);
+    CHECK(heapStopTrace(heap) == HEAP_OK);
+    destroyHeap(heap);
+
+    HeapReplayStats stats;
+    heap = initializeHeap(1 << 20);
+    CHECK(heapReplayTrace(heap, path, &stats) == HEAP_OK);
+    CHECK(stats.operations == 1 && stats.diverged == 0);
+    destroyHeap(heap);
+    remove(path);
+}
+
+// Bit flips in a saved image must be caught when it is loaded, or leave a
+// heap that still works
+static void testCorruptImagesAreRejected(void) {
+    const char* path = "heap_test.img";
+    const char* corruptPath = "heap_test.bad.img";
+    Heap* heap = initializeGrowableHeap(50000, 1 << 24, false);
+    heapSetCompaction(heap, true);
+    churn(heap, 20000, 2);
+    CHECK(heapSaveImage(heap, path) == HEAP_OK);
+    destroyHeap(heap);
+
+    FILE* file = fopen(path, "rb");
+    CHECK(file != NULL);
+    if (file == NULL) return;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    unsigned char* image = (unsigned char*)malloc(size);
+    unsigned char* corrupt = (unsigned char*)malloc(size);
+    CHECK(fread(image, 1, size, file) == (size_t)size);
+    fclose(file);
+
+    // Most flips land in the header and the first descriptor chunk
+    unsigned long long seed = 3;
+    int rejected = 0;
+    for (int i = 0; i < 200; i++) {
+        memcpy(corrupt, image, size);
+        for (int flips = 1 + nextRandom(&seed) % 4; flips > 0; flips--) {
+            unsigned long long r = nextRandom(&seed);
+            long span = (r >> 60) % 2 == 0 ? 4096 : (size < 200000 ? size : 200000);
+            corrupt[(r >> 8) % span] ^= 1 << ((r >> 4) % 8);
+        }
+        file = fopen(corruptPath, "wb");
+        fwrite(corrupt, 1, size, file);
+        fclose(file);
+
+        HeapStatus status;
+        heap = heapLoadImage(corruptPath, false, &status);
+        if (heap == NULL) {
+            CHECK(status == HEAP_ERR_BAD_IMAGE);
+            rejected++;
+            continue;
+        }
+        CHECK(blocksTileHeap(heap));
+        churn(heap, 2000, i);
+        garbageCollect(heap);
+        CHECK(blocksTileHeap(heap));
+        destroyHeap(heap);
+    }
+    CHECK(rejected > 0);
+
+    free(image);
+    free(corrupt);
+    remove(path);
+    remove(corruptPath);
+}
+
+int main(void) {
+    testDeepChainIsMarked();
+    testParallelCollectionMatchesSerial();
+    testIncrementalBarrierKeepsMovedBlock();
+    testIncrementalBarrierKeepsRescuedBlock();
+    testFreshBlockSurvivesMinorCollection();
+    testFullCollectionFreesNurseryBytes(1);
+    testFullCollectionFreesNurseryBytes(4);
+    testRefCountingFreesAtOnce();
+    testLazySweepWithCompaction();
+    testBatchKeepsBlocksThroughCollection();
+    testStaleHandles();
+    testTraceRestartsOnSameFile();
+    testResizeInPlace();
+    testResizeRelocates();
+    testResizeSurvivesCollection();
+    testAlignedAndExactClassPlacement();
+    testGrowableHeapRegions();
+    testCorruptImagesAreRejected();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}